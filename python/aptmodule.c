@@ -0,0 +1,563 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// libapt._apt: Python bindings for libapt.
+//
+// Every call that may touch the USB bus releases the GIL. libapt itself is
+// not re-entrant, so the calls are serialised on apt_lock instead, which
+// lets other Python threads (and the asyncio wrappers in __init__.py) carry
+// on while a stage is moving.
+//
+// Position samples are stored in Trace objects which export their storage
+// through the buffer protocol, numpy.asarray(trace) is an (n, 2) float64
+// view of (time, position) rows, no copy involved.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+#include <time.h>
+
+// Python.h may already define true/false, so don't redefine BOOL as an enum
+typedef int BOOL;
+typedef char TCHAR;
+#define WINAPI
+
+#include "APTAPI.h"
+#include "libapt.h"
+
+static PyObject *AptError;
+static PyThread_type_lock apt_lock;
+
+// Runs a libapt call with the library lock held, the GIL already released.
+#define APT_LOCKED(ret, call) do { \
+        PyThread_acquire_lock(apt_lock, WAIT_LOCK); \
+        ret = call; \
+        PyThread_release_lock(apt_lock); \
+    } while (0)
+
+// Runs a libapt call with the GIL released and the library lock held.
+#define APT_CALL(ret, call) do { \
+        Py_BEGIN_ALLOW_THREADS \
+        APT_LOCKED(ret, call); \
+        Py_END_ALLOW_THREADS \
+    } while (0)
+
+static PyObject *apt_error(const char *name, long ret) {
+    PyObject *exc = Py_BuildValue("(ls)", ret, name);
+    if (exc != NULL) {
+        PyErr_SetObject(AptError, exc);
+        Py_DECREF(exc);
+    }
+    return NULL;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// >>>>>>>>>>>>>>>>> Trace type <<<<<<<<<<<<<<<<<<
+
+typedef struct {
+    PyObject_HEAD
+    double *data;           // (capacity, 2) rows of time [s], position
+    Py_ssize_t capacity;
+    Py_ssize_t length;      // rows filled by the last sampling call
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+    int exports;
+    int filling;            // a sampling call writes the rows with the GIL released
+} TraceObject;
+
+static PyTypeObject TraceType;
+
+static int Trace_init(TraceObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"capacity", NULL};
+    Py_ssize_t capacity;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n", kwlist, &capacity))
+        return -1;
+    if (capacity <= 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be positive");
+        return -1;
+    }
+    if (self->exports > 0 || self->filling) {
+        PyErr_SetString(PyExc_BufferError, self->filling ? "trace is being filled" : "trace is exported");
+        return -1;
+    }
+
+    PyMem_Free(self->data);
+    self->data = PyMem_Calloc(capacity * 2, sizeof(double));
+    if (self->data == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->capacity = capacity;
+    self->length = capacity;
+    return 0;
+}
+
+static void Trace_dealloc(TraceObject *self) {
+    PyMem_Free(self->data);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Trace_getbuffer(TraceObject *self, Py_buffer *view, int flags) {
+    if (self->data == NULL) {
+        PyErr_SetString(PyExc_BufferError, "trace is not initialised");
+        return -1;
+    }
+    if (self->filling) {
+        // another thread is writing the rows, and will change their number
+        PyErr_SetString(PyExc_BufferError, "trace is being filled");
+        return -1;
+    }
+
+    self->shape[0] = self->length;
+    self->shape[1] = 2;
+    self->strides[0] = 2 * sizeof(double);
+    self->strides[1] = sizeof(double);
+
+    view->obj = (PyObject *)self;
+    view->buf = self->data;
+    view->len = self->length * 2 * sizeof(double);
+    view->readonly = 0;
+    view->itemsize = sizeof(double);
+    view->format = (flags & PyBUF_FORMAT) ? "d" : NULL;
+    view->ndim = 2;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    // plain contiguous request, expose it as a flat array of bytes
+    if (view->shape == NULL) view->ndim = 1;
+
+    Py_INCREF(self);
+    self->exports++;
+    return 0;
+}
+
+static void Trace_releasebuffer(TraceObject *self, Py_buffer *view) {
+    (void)view;
+    self->exports--;
+}
+
+static Py_ssize_t Trace_length(TraceObject *self) {
+    return self->length;
+}
+
+static PyObject *Trace_get_capacity(TraceObject *self, void *closure) {
+    (void)closure;
+    return PyLong_FromSsize_t(self->capacity);
+}
+
+static PyBufferProcs Trace_as_buffer = {
+    (getbufferproc)Trace_getbuffer,
+    (releasebufferproc)Trace_releasebuffer,
+};
+
+static PySequenceMethods Trace_as_sequence = {
+    .sq_length = (lenfunc)Trace_length,
+};
+
+static PyGetSetDef Trace_getset[] = {
+    {"capacity", (getter)Trace_get_capacity, NULL, "Number of rows allocated.", NULL},
+    {NULL}
+};
+
+static PyTypeObject TraceType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "libapt._apt.Trace",
+    .tp_doc = "Trace(capacity)\n\n"
+        "Preallocated (time, position) samples. numpy.asarray(trace) gives an\n"
+        "(n, 2) float64 view of the rows filled by the last sampling call.",
+    .tp_basicsize = sizeof(TraceObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Trace_init,
+    .tp_dealloc = (destructor)Trace_dealloc,
+    .tp_as_buffer = &Trace_as_buffer,
+    .tp_as_sequence = &Trace_as_sequence,
+    .tp_getset = Trace_getset,
+};
+
+
+// >>>>>>>>>>>>>>>>> System level <<<<<<<<<<<<<<<<<<
+
+static PyObject *py_init(PyObject *self, PyObject *args) {
+    long ret, n = 0;
+
+    APT_CALL(ret, APTInit());
+    // ENODEV only means there's nothing plugged in
+    if (ret != 0 && ret != ENODEV) return apt_error("APTInit", ret);
+    APT_CALL(ret, GetNumHWUnitsEx(0, &n));
+    return PyLong_FromLong(n);
+}
+
+static PyObject *py_cleanup(PyObject *self, PyObject *args) {
+    long ret;
+
+    APT_CALL(ret, APTCleanUp());
+    if (ret != 0) return apt_error("APTCleanUp", ret);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_set_debug(PyObject *self, PyObject *args) {
+    int value;
+
+    if (!PyArg_ParseTuple(args, "p", &value)) return NULL;
+    SetDebug(value);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_num_units(PyObject *self, PyObject *args) {
+    long ret, hwtype = 0, n = 0;
+
+    if (!PyArg_ParseTuple(args, "|l", &hwtype)) return NULL;
+    APT_CALL(ret, GetNumHWUnitsEx(hwtype, &n));
+    if (ret != 0) return apt_error("GetNumHWUnitsEx", ret);
+    return PyLong_FromLong(n);
+}
+
+static PyObject *py_serial_num(PyObject *self, PyObject *args) {
+    long ret, hwtype, index, serial = 0;
+
+    if (!PyArg_ParseTuple(args, "ll", &hwtype, &index)) return NULL;
+    APT_CALL(ret, GetHWSerialNumEx(hwtype, index, &serial));
+    if (ret != 0) return apt_error("GetHWSerialNumEx", ret);
+    return PyLong_FromLong(serial);
+}
+
+static PyObject *py_hw_info(PyObject *self, PyObject *args) {
+    long ret, serial;
+    char model[64] = {0}, swver[64] = {0}, notes[64] = {0};
+
+    if (!PyArg_ParseTuple(args, "l", &serial)) return NULL;
+    APT_CALL(ret, GetHWInfo(serial, model, 63, swver, 63, notes, 63));
+    if (ret != 0) return apt_error("GetHWInfo", ret);
+    return Py_BuildValue("(sss)", model, swver, notes);
+}
+
+static PyObject *py_init_device(PyObject *self, PyObject *args) {
+    long ret, serial;
+
+    if (!PyArg_ParseTuple(args, "l", &serial)) return NULL;
+    APT_CALL(ret, InitHWDevice(serial));
+    if (ret != 0) return apt_error("InitHWDevice", ret);
+    Py_RETURN_NONE;
+}
+
+
+// >>>>>>>>>>>>>>>>> Motor specific <<<<<<<<<<<<<<<<<<
+
+static PyObject *py_set_channel(PyObject *self, PyObject *args) {
+    long ret, serial, chan;
+
+    if (!PyArg_ParseTuple(args, "ll", &serial, &chan)) return NULL;
+    APT_CALL(ret, MOT_SetChannel(serial, chan));
+    if (ret != 0) return apt_error("MOT_SetChannel", ret);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_identify(PyObject *self, PyObject *args) {
+    long ret, serial;
+
+    if (!PyArg_ParseTuple(args, "l", &serial)) return NULL;
+    APT_CALL(ret, MOT_Identify(serial));
+    if (ret != 0) return apt_error("MOT_Identify", ret);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_enable(PyObject *self, PyObject *args) {
+    long ret, serial;
+
+    if (!PyArg_ParseTuple(args, "l", &serial)) return NULL;
+    APT_CALL(ret, MOT_EnableHWChannel(serial));
+    if (ret != 0) return apt_error("MOT_EnableHWChannel", ret);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_disable(PyObject *self, PyObject *args) {
+    long ret, serial;
+
+    if (!PyArg_ParseTuple(args, "l", &serial)) return NULL;
+    APT_CALL(ret, MOT_DisableHWChannel(serial));
+    if (ret != 0) return apt_error("MOT_DisableHWChannel", ret);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_set_vel_params(PyObject *self, PyObject *args) {
+    long ret, serial;
+    float min_vel, accn, max_vel;
+
+    if (!PyArg_ParseTuple(args, "lfff", &serial, &min_vel, &accn, &max_vel)) return NULL;
+    APT_CALL(ret, MOT_SetVelParams(serial, min_vel, accn, max_vel));
+    if (ret != 0) return apt_error("MOT_SetVelParams", ret);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_get_vel_params(PyObject *self, PyObject *args) {
+    long ret, serial;
+    float min_vel = 0, accn = 0, max_vel = 0;
+
+    if (!PyArg_ParseTuple(args, "l", &serial)) return NULL;
+    APT_CALL(ret, MOT_GetVelParams(serial, &min_vel, &accn, &max_vel));
+    if (ret != 0) return apt_error("MOT_GetVelParams", ret);
+    return Py_BuildValue("(fff)", min_vel, accn, max_vel);
+}
+
+static PyObject *py_get_stage_axis_info(PyObject *self, PyObject *args) {
+    long ret, serial, units = 0;
+    float min_pos = 0, max_pos = 0, pitch = 0;
+
+    if (!PyArg_ParseTuple(args, "l", &serial)) return NULL;
+    APT_CALL(ret, MOT_GetStageAxisInfo(serial, &min_pos, &max_pos, &units, &pitch));
+    if (ret != 0) return apt_error("MOT_GetStageAxisInfo", ret);
+    return Py_BuildValue("(fflf)", min_pos, max_pos, units, pitch);
+}
+
+static PyObject *py_get_position(PyObject *self, PyObject *args) {
+    long ret, serial;
+    float pos = 0;
+
+    if (!PyArg_ParseTuple(args, "l", &serial)) return NULL;
+    APT_CALL(ret, MOT_GetPosition(serial, &pos));
+    if (ret != 0) return apt_error("MOT_GetPosition", ret);
+    return PyFloat_FromDouble(pos);
+}
+
+static PyObject *py_move_home(PyObject *self, PyObject *args) {
+    long ret, serial;
+    int wait = 1;
+
+    if (!PyArg_ParseTuple(args, "l|p", &serial, &wait)) return NULL;
+    APT_CALL(ret, MOT_MoveHome(serial, wait));
+    if (ret != 0) return apt_error("MOT_MoveHome", ret);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_move_relative(PyObject *self, PyObject *args) {
+    long ret, serial;
+    float dist;
+    int wait = 1;
+
+    if (!PyArg_ParseTuple(args, "lf|p", &serial, &dist, &wait)) return NULL;
+    APT_CALL(ret, MOT_MoveRelativeEx(serial, dist, wait));
+    if (ret != 0) return apt_error("MOT_MoveRelativeEx", ret);
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_move_absolute(PyObject *self, PyObject *args) {
+    long ret, serial;
+    float pos;
+    int wait = 1;
+
+    if (!PyArg_ParseTuple(args, "lf|p", &serial, &pos, &wait)) return NULL;
+    APT_CALL(ret, MOT_MoveAbsoluteEx(serial, pos, wait));
+    if (ret != 0) return apt_error("MOT_MoveAbsoluteEx", ret);
+    Py_RETURN_NONE;
+}
+
+
+// >>>>>>>>>>>>>>>>> Buffer based calls <<<<<<<<<<<<<<<<<<
+
+static PyObject *py_sample_positions(PyObject *self, PyObject *args) {
+    TraceObject *trace;
+    long ret = 0, serial;
+    Py_ssize_t i, count = -1;
+    double t0, interval = 0;
+    float pos;
+
+    if (!PyArg_ParseTuple(args, "lO!|nd", &serial, &TraceType, &trace, &count, &interval))
+        return NULL;
+    if (trace->data == NULL) {
+        PyErr_SetString(PyExc_ValueError, "trace is not initialised");
+        return NULL;
+    }
+    if (trace->exports > 0 || trace->filling) {
+        // the shape of existing views must not change under their feet
+        PyErr_SetString(PyExc_BufferError, trace->filling ? "trace is being filled"
+                : "release the views on the trace before refilling it");
+        return NULL;
+    }
+    if (count < 0 || count > trace->capacity) count = trace->capacity;
+
+    // no views until the rows are in, see Trace_getbuffer
+    trace->filling = 1;
+    Py_BEGIN_ALLOW_THREADS
+    // the lock is only held for each call, other threads get in between the samples
+    t0 = now_s();
+    for (i = 0; i < count; i++) {
+        APT_LOCKED(ret, MOT_GetPosition(serial, &pos));
+        if (ret != 0) break;
+        trace->data[2 * i] = now_s() - t0;
+        trace->data[2 * i + 1] = pos;
+        if (interval > 0) {
+            // sleep until the next sample is due
+            double due = t0 + (i + 1) * interval, left = due - now_s();
+            if (left > 0) {
+                struct timespec ts;
+                ts.tv_sec = (time_t)left;
+                ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    trace->length = i;
+    trace->filling = 0;
+    if (ret != 0) return apt_error("MOT_GetPosition", ret);
+    return PyLong_FromSsize_t(i);
+}
+
+static PyObject *py_run_trajectory(PyObject *self, PyObject *args) {
+    PyObject *targets, *out = Py_None;
+    TraceObject *trace = NULL;
+    Py_buffer view;
+    long ret = 0, serial;
+    Py_ssize_t i, n;
+    int wait = 1, is_double;
+    double t0, target;
+    float pos;
+
+    if (!PyArg_ParseTuple(args, "lO|pO", &serial, &targets, &wait, &out)) return NULL;
+    if (out != Py_None) {
+        if (!PyObject_TypeCheck(out, &TraceType)) {
+            PyErr_SetString(PyExc_TypeError, "out must be a Trace");
+            return NULL;
+        }
+        trace = (TraceObject *)out;
+        if (trace->exports > 0 || trace->filling) {
+            PyErr_SetString(PyExc_BufferError, trace->filling ? "trace is being filled"
+                    : "release the views on the trace before refilling it");
+            return NULL;
+        }
+    }
+
+    // read the targets in place from any contiguous float32/float64 buffer
+    if (PyObject_GetBuffer(targets, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+        return NULL;
+    is_double = view.format != NULL && strcmp(view.format, "d") == 0;
+    if (!is_double && (view.format == NULL || strcmp(view.format, "f") != 0)) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_TypeError, "targets must be a float32 or float64 buffer");
+        return NULL;
+    }
+    n = view.len / view.itemsize;
+    if (trace != NULL && n > trace->capacity) n = trace->capacity;
+
+    if (trace != NULL) trace->filling = 1;
+    Py_BEGIN_ALLOW_THREADS
+    t0 = now_s();
+    for (i = 0; i < n; i++) {
+        target = is_double ? ((double *)view.buf)[i] : ((float *)view.buf)[i];
+        APT_LOCKED(ret, MOT_MoveAbsoluteEx(serial, (float)target, wait));
+        if (ret != 0) break;
+        if (trace != NULL) {
+            APT_LOCKED(ret, MOT_GetPosition(serial, &pos));
+            if (ret != 0) break;
+            trace->data[2 * i] = now_s() - t0;
+            trace->data[2 * i + 1] = pos;
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&view);
+    if (trace != NULL) {
+        trace->length = i;
+        trace->filling = 0;
+    }
+    if (ret != 0) return apt_error("MOT_MoveAbsoluteEx", ret);
+    return PyLong_FromSsize_t(i);
+}
+
+
+static PyMethodDef apt_methods[] = {
+    {"init", py_init, METH_NOARGS, "init() -> number of devices\n\nAPTInit."},
+    {"cleanup", py_cleanup, METH_NOARGS, "cleanup()\n\nAPTCleanUp."},
+    {"set_debug", py_set_debug, METH_VARARGS, "set_debug(enabled)\n\nTurn libapt's debug output on or off."},
+    {"num_units", py_num_units, METH_VARARGS, "num_units(hwtype=0) -> int\n\nGetNumHWUnitsEx."},
+    {"serial_num", py_serial_num, METH_VARARGS, "serial_num(hwtype, index) -> int\n\nGetHWSerialNumEx."},
+    {"hw_info", py_hw_info, METH_VARARGS, "hw_info(serial) -> (model, sw_version, notes)\n\nGetHWInfo."},
+    {"init_device", py_init_device, METH_VARARGS, "init_device(serial)\n\nInitHWDevice."},
+    {"set_channel", py_set_channel, METH_VARARGS, "set_channel(serial, channel)\n\nMOT_SetChannel."},
+    {"identify", py_identify, METH_VARARGS, "identify(serial)\n\nMOT_Identify."},
+    {"enable", py_enable, METH_VARARGS, "enable(serial)\n\nMOT_EnableHWChannel."},
+    {"disable", py_disable, METH_VARARGS, "disable(serial)\n\nMOT_DisableHWChannel."},
+    {"set_vel_params", py_set_vel_params, METH_VARARGS, "set_vel_params(serial, min_vel, accn, max_vel)\n\nMOT_SetVelParams."},
+    {"get_vel_params", py_get_vel_params, METH_VARARGS, "get_vel_params(serial) -> (min_vel, accn, max_vel)\n\nMOT_GetVelParams."},
+    {"get_stage_axis_info", py_get_stage_axis_info, METH_VARARGS, "get_stage_axis_info(serial) -> (min_pos, max_pos, units, pitch)\n\nMOT_GetStageAxisInfo."},
+    {"get_position", py_get_position, METH_VARARGS, "get_position(serial) -> float\n\nMOT_GetPosition."},
+    {"move_home", py_move_home, METH_VARARGS, "move_home(serial, wait=True)\n\nMOT_MoveHome."},
+    {"move_relative", py_move_relative, METH_VARARGS, "move_relative(serial, distance, wait=True)\n\nMOT_MoveRelativeEx."},
+    {"move_absolute", py_move_absolute, METH_VARARGS, "move_absolute(serial, position, wait=True)\n\nMOT_MoveAbsoluteEx."},
+    {"sample_positions", py_sample_positions, METH_VARARGS,
+        "sample_positions(serial, trace, count=-1, interval=0.0) -> int\n\n"
+        "Fill trace with (time, position) samples, every interval seconds or\n"
+        "as fast as the controller answers. Returns the number of samples."},
+    {"run_trajectory", py_run_trajectory, METH_VARARGS,
+        "run_trajectory(serial, targets, wait=True, out=None) -> int\n\n"
+        "Move through each position of a float32/float64 buffer (read in place),\n"
+        "optionally recording the reached positions into the Trace out."},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef apt_module = {
+    PyModuleDef_HEAD_INIT,
+    "libapt._apt",
+    "Low level bindings for libapt.",
+    -1,
+    apt_methods
+};
+
+PyMODINIT_FUNC PyInit__apt(void) {
+    PyObject *m;
+
+    if (PyType_Ready(&TraceType) < 0) return NULL;
+    if ((apt_lock = PyThread_allocate_lock()) == NULL) return PyErr_NoMemory();
+
+    if ((m = PyModule_Create(&apt_module)) == NULL) return NULL;
+
+    AptError = PyErr_NewException("libapt.AptError", PyExc_OSError, NULL);
+    Py_INCREF(AptError);
+    PyModule_AddObject(m, "AptError", AptError);
+
+    Py_INCREF(&TraceType);
+    PyModule_AddObject(m, "Trace", (PyObject *)&TraceType);
+
+    PyModule_AddIntConstant(m, "HWTYPE_BSC001", HWTYPE_BSC001);
+    PyModule_AddIntConstant(m, "HWTYPE_BSC101", HWTYPE_BSC101);
+    PyModule_AddIntConstant(m, "HWTYPE_BSC002", HWTYPE_BSC002);
+    PyModule_AddIntConstant(m, "HWTYPE_BDC101", HWTYPE_BDC101);
+    PyModule_AddIntConstant(m, "HWTYPE_SCC001", HWTYPE_SCC001);
+    PyModule_AddIntConstant(m, "HWTYPE_DCC001", HWTYPE_DCC001);
+    PyModule_AddIntConstant(m, "HWTYPE_ODC001", HWTYPE_ODC001);
+    PyModule_AddIntConstant(m, "HWTYPE_OST001", HWTYPE_OST001);
+    PyModule_AddIntConstant(m, "HWTYPE_MST601", HWTYPE_MST601);
+    PyModule_AddIntConstant(m, "HWTYPE_TST001", HWTYPE_TST001);
+    PyModule_AddIntConstant(m, "HWTYPE_TDC001", HWTYPE_TDC001);
+    PyModule_AddIntConstant(m, "HWTYPE_LTSXXX", HWTYPE_LTSXXX);
+    PyModule_AddIntConstant(m, "HWTYPE_L490MZ", HWTYPE_L490MZ);
+    PyModule_AddIntConstant(m, "HWTYPE_BBD10X", HWTYPE_BBD10X);
+    PyModule_AddIntConstant(m, "CHAN1_INDEX", CHAN1_INDEX);
+    PyModule_AddIntConstant(m, "CHAN2_INDEX", CHAN2_INDEX);
+    return m;
+}
@@ -0,0 +1,78 @@
+#
+# (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""Python bindings for libapt.
+
+The functions of the _apt extension release the GIL while they talk to the
+controllers, so they can be run from worker threads. The *_async variants
+below do just that and can be awaited from an asyncio event loop::
+
+    import asyncio, numpy as np, libapt
+
+    async def main():
+        libapt.init()
+        sn = libapt.serial_num(0, 0)
+        libapt.init_device(sn)
+        await libapt.move_absolute_async(sn, 10000)
+
+        trace = libapt.Trace(100)
+        await libapt.sample_positions_async(sn, trace, interval=0.01)
+        samples = np.asarray(trace)     # (n, 2) view, no copy
+
+    asyncio.run(main())
+
+A Trace can't be exported (numpy.asarray raises BufferError) while a call is
+filling it from another thread, nor refilled while views on it are alive.
+"""
+
+import asyncio
+import functools
+
+from ._apt import *
+from ._apt import AptError, Trace
+
+
+async def _run(func, *args):
+    loop = asyncio.get_running_loop()
+    return await loop.run_in_executor(None, functools.partial(func, *args))
+
+
+async def init_device_async(serial):
+    return await _run(init_device, serial)
+
+
+async def get_position_async(serial):
+    return await _run(get_position, serial)
+
+
+async def move_home_async(serial):
+    return await _run(move_home, serial, True)
+
+
+async def move_relative_async(serial, distance):
+    return await _run(move_relative, serial, distance, True)
+
+
+async def move_absolute_async(serial, position):
+    return await _run(move_absolute, serial, position, True)
+
+
+async def sample_positions_async(serial, trace, count=-1, interval=0.0):
+    return await _run(sample_positions, serial, trace, count, interval)
+
+
+async def run_trajectory_async(serial, targets, out=None):
+    return await _run(run_trajectory, serial, targets, True, out)
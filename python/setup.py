@@ -0,0 +1,40 @@
+#
+# (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# Build against an installed libapt (make install), e.g.
+#   python setup.py build_ext --inplace
+# or link against libaptclient to go through aptd:
+#   LIBAPT=aptclient python setup.py build_ext --inplace
+
+import os
+from setuptools import setup, Extension
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+ext = Extension(
+    "libapt._apt",
+    sources=["aptmodule.c"],
+    include_dirs=[os.path.join(here, "..", "src")],
+    libraries=[os.environ.get("LIBAPT", "apt")],
+)
+
+setup(
+    name="libapt",
+    version="0.0",
+    description="Python bindings for libapt, an open source Thorlabs APT library",
+    packages=["libapt"],
+    ext_modules=[ext],
+)
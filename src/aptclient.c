@@ -0,0 +1,431 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// libaptclient: the APTAPI.h functions, forwarded to a running aptd.
+// Link with -laptclient instead of -lapt, the calling code doesn't change.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifndef WIN32
+    typedef enum { false, true } BOOL;
+    typedef char TCHAR;
+    #define WINAPI
+#endif
+
+#include "APTAPI.h"
+#include "aptd.h"
+
+static APTD_SHM *shm = NULL;
+static APTD_CLIENT *slot = NULL;
+static int sock_fd = -1;
+static uint32_t next_seq = 0;
+
+// one command in flight per client
+static pthread_mutex_t call_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// channel selected by this process, per device
+static struct {
+    long serial;
+    long chan;
+} chans[APTD_MAX_DEVS];
+static int num_chans = 0;
+
+static long get_chan(long lSerialNum) {
+    int i;
+
+    for (i = 0; i < num_chans; i++)
+        if (chans[i].serial == lSerialNum) return chans[i].chan;
+    return 0;
+}
+
+static void set_chan(long lSerialNum, long lChanID) {
+    int i;
+
+    for (i = 0; i < num_chans; i++) {
+        if (chans[i].serial == lSerialNum) {
+            chans[i].chan = lChanID;
+            return;
+        }
+    }
+    if (num_chans < APTD_MAX_DEVS) {
+        chans[num_chans].serial = lSerialNum;
+        chans[num_chans++].chan = lChanID;
+    }
+}
+
+// Whether the daemon serving the segment has gone. A client in aptd's group
+// but running as another user gets EPERM, the daemon is alive then.
+static int daemon_gone(void) {
+    return kill(shm->daemon_pid, 0) < 0 && errno == ESRCH;
+}
+
+static int attach_shm(void) {
+    const char *name = getenv("APTD_SHM") ? getenv("APTD_SHM") : APTD_SHM_NAME;
+    int fd, i;
+    int32_t expected, pid = getpid();
+
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0) return -1;
+    shm = mmap(NULL, sizeof(APTD_SHM), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        shm = NULL;
+        return -1;
+    }
+
+    if (atomic_load(&shm->magic) != APTD_MAGIC || shm->version != APTD_VERSION
+            || daemon_gone())
+        goto fail;
+
+    for (i = 0; i < APTD_MAX_CLIENTS; i++) {
+        expected = 0;
+        if (atomic_compare_exchange_strong(&shm->client[i].owner, &expected, pid)) {
+            slot = &shm->client[i];
+            // anything left over from a previous owner is stale
+            atomic_store(&slot->reply.tail, atomic_load(&slot->reply.head));
+            return 0;
+        }
+    }
+
+fail:
+    munmap(shm, sizeof(APTD_SHM));
+    shm = NULL;
+    return -1;
+}
+
+static int connect_socket(void) {
+    const char *path = getenv("APTD_SOCKET") ? getenv("APTD_SOCKET") : APTD_SOCKET_PATH;
+    struct sockaddr_un addr;
+
+    if ((sock_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock_fd);
+        sock_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static long call_shm(APTD_MSG *m) {
+    APTD_MSG reply;
+    int64_t deadline;
+    int spin;
+    uint32_t head;
+
+    if (aptd_ring_push(&slot->cmd, m) < 0) return EBUSY;
+    atomic_fetch_add(&shm->doorbell, 1);
+    if (atomic_load(&shm->sleeping)) aptd_futex_wake(&shm->doorbell);
+
+    deadline = aptd_now_us() + (int64_t)APTD_REPLY_TIMEOUT_MS * 1000;
+    for (spin = 0; ; spin++) {
+        if (aptd_ring_pop(&slot->reply, &reply) == 0) {
+            if (reply.seq != m->seq) continue;
+            *m = reply;
+            return 0;
+        }
+
+        // spin briefly first, most calls that don't touch the USB bus are
+        // answered within a few microseconds
+        if (spin < 2000) continue;
+
+        head = atomic_load(&slot->reply.head);
+        atomic_store(&slot->reply.waiting, 1);
+        if (head == atomic_load(&slot->reply.tail))
+            aptd_futex_wait(&slot->reply.head, head, 10000);
+        atomic_store(&slot->reply.waiting, 0);
+
+        if (aptd_now_us() > deadline || daemon_gone())
+            return ETIMEDOUT;
+    }
+}
+
+static long call_socket(APTD_MSG *m) {
+    uint32_t seq = m->seq;
+
+    if (send(sock_fd, m, sizeof(*m), MSG_NOSIGNAL) != (ssize_t)sizeof(*m))
+        return ECONNRESET;
+    if (recv(sock_fd, m, sizeof(*m), MSG_WAITALL) != (ssize_t)sizeof(*m) || m->seq != seq)
+        return ECONNRESET;
+    return 0;
+}
+
+// Forwards one call. Returns the transport error if the daemon could not be
+// reached, the libapt return value otherwise.
+static long call(APTD_MSG *m) {
+    long ret;
+
+    pthread_mutex_lock(&call_lock);
+    m->seq = ++next_seq;
+    if (slot != NULL) ret = call_shm(m);
+    else if (sock_fd >= 0) ret = call_socket(m);
+    else ret = ENOTCONN;
+    pthread_mutex_unlock(&call_lock);
+
+    if (ret != 0) {
+        fprintf(stderr, "Error: aptd call %d failed (%s)\n", m->func, strerror(ret));
+        return ret;
+    }
+    return m->ret;
+}
+
+static void init_msg(APTD_MSG *m, int func, long lSerialNum) {
+    memset(m, 0, sizeof(*m));
+    m->func = func;
+    m->serial = lSerialNum;
+    m->chan = get_chan(lSerialNum);
+}
+
+
+long APTD_GetTransport(void) {
+    if (slot != NULL) return 1;
+    if (sock_fd >= 0) return 0;
+    return -1;
+}
+
+long APTD_GetStatus(long lSerialNum, long lChanID, float *pfPosition, long *plFlags, int64_t *pllTimestampUs) {
+    APTD_MSG m;
+    int32_t flags;
+    long i, ret;
+
+    if (lChanID < 0 || lChanID >= APTD_MAX_CHANS) return EINVAL;
+
+    if (shm != NULL) {
+        for (i = 0; i < shm->num_devs; i++) {
+            if (shm->status[i].serial == lSerialNum) {
+                aptd_status_read(&shm->status[i], lChanID, pfPosition, &flags, pllTimestampUs);
+                *plFlags = flags;
+                return 0;
+            }
+        }
+        return ENODEV;
+    }
+
+    init_msg(&m, APTD_FN_GETSTATUS, lSerialNum);
+    m.chan = lChanID;
+    if ((ret = call(&m)) == 0) {
+        *pfPosition = m.farg[0];
+        *plFlags = m.larg[0];
+        *pllTimestampUs = m.timestamp_us;
+    }
+    return ret;
+}
+
+
+long WINAPI APTInit(void) {
+    if (slot != NULL || sock_fd >= 0) return 0;
+
+    // APTD_TRANSPORT=socket skips the shared memory segment
+    if ((getenv("APTD_TRANSPORT") == NULL || strcmp(getenv("APTD_TRANSPORT"), "socket") != 0)
+            && attach_shm() == 0)
+        return 0;
+    if (connect_socket() == 0) return 0;
+
+    fprintf(stderr, "Error: could not reach aptd, is it running?\n");
+    return ECONNREFUSED;
+}
+
+long WINAPI APTCleanUp(void) {
+    if (slot != NULL) {
+        atomic_store(&slot->owner, 0);
+        slot = NULL;
+    }
+    if (shm != NULL) {
+        munmap(shm, sizeof(APTD_SHM));
+        shm = NULL;
+    }
+    if (sock_fd >= 0) {
+        close(sock_fd);
+        sock_fd = -1;
+    }
+    num_chans = 0;
+    return 0;
+}
+
+long WINAPI GetNumHWUnitsEx(long lHWType, long *plNumUnits) {
+    APTD_MSG m;
+    long i, n = 0, ret;
+
+    // the device table is in the shared segment, no need to ask
+    if (shm != NULL) {
+        for (i = 0; i < shm->num_devs; i++)
+            if (lHWType == 0 || shm->status[i].type == lHWType) n++;
+        *plNumUnits = n;
+        return 0;
+    }
+
+    init_msg(&m, APTD_FN_GETNUMHWUNITS, 0);
+    m.larg[0] = lHWType;
+    if ((ret = call(&m)) == 0) *plNumUnits = m.larg[0];
+    return ret;
+}
+
+long WINAPI GetHWSerialNumEx(long lHWType, long lIndex, long *plSerialNum) {
+    APTD_MSG m;
+    long ret;
+
+    init_msg(&m, APTD_FN_GETHWSERIALNUM, 0);
+    m.larg[0] = lHWType;
+    m.larg[1] = lIndex;
+    if ((ret = call(&m)) == 0) *plSerialNum = m.larg[0];
+    return ret;
+}
+
+long WINAPI GetHWInfo(long lSerialNum, TCHAR *szModel, long lModelLen, TCHAR *szSWVer, long lSWVerLen, TCHAR *szHWNotes, long lHWNotesLen) {
+    APTD_MSG m;
+    long ret;
+
+    init_msg(&m, APTD_FN_GETHWINFO, lSerialNum);
+    if ((ret = call(&m)) != 0) return ret;
+
+    if (lModelLen > 0) {
+        strncpy(szModel, m.text[0], lModelLen - 1);
+        szModel[lModelLen - 1] = 0;
+    }
+    if (lSWVerLen > 0) {
+        strncpy(szSWVer, m.text[1], lSWVerLen - 1);
+        szSWVer[lSWVerLen - 1] = 0;
+    }
+    if (lHWNotesLen > 0) {
+        strncpy(szHWNotes, m.text[2], lHWNotesLen - 1);
+        szHWNotes[lHWNotesLen - 1] = 0;
+    }
+    return ret;
+}
+
+long WINAPI InitHWDevice(long lSerialNum) {
+    APTD_MSG m;
+
+    init_msg(&m, APTD_FN_INITHWDEVICE, lSerialNum);
+    return call(&m);
+}
+
+long WINAPI MOT_SetChannel(long lSerialNum, long lChanID) {
+    APTD_MSG m;
+    long ret;
+
+    init_msg(&m, APTD_FN_SETCHANNEL, lSerialNum);
+    m.larg[0] = lChanID;
+    if ((ret = call(&m)) == 0) set_chan(lSerialNum, lChanID);
+    return ret;
+}
+
+long WINAPI MOT_Identify(long lSerialNum) {
+    APTD_MSG m;
+
+    init_msg(&m, APTD_FN_IDENTIFY, lSerialNum);
+    return call(&m);
+}
+
+long WINAPI MOT_EnableHWChannel(long lSerialNum) {
+    APTD_MSG m;
+
+    init_msg(&m, APTD_FN_ENABLEHWCHANNEL, lSerialNum);
+    return call(&m);
+}
+
+long WINAPI MOT_DisableHWChannel(long lSerialNum) {
+    APTD_MSG m;
+
+    init_msg(&m, APTD_FN_DISABLEHWCHANNEL, lSerialNum);
+    return call(&m);
+}
+
+long WINAPI MOT_SetVelParams(long lSerialNum, float fMinVel, float fAccn, float fMaxVel) {
+    APTD_MSG m;
+
+    init_msg(&m, APTD_FN_SETVELPARAMS, lSerialNum);
+    m.farg[0] = fMinVel;
+    m.farg[1] = fAccn;
+    m.farg[2] = fMaxVel;
+    return call(&m);
+}
+
+long WINAPI MOT_GetVelParams(long lSerialNum, float *pfMinVel, float *pfAccn, float *pfMaxVel) {
+    APTD_MSG m;
+    long ret;
+
+    init_msg(&m, APTD_FN_GETVELPARAMS, lSerialNum);
+    if ((ret = call(&m)) == 0) {
+        *pfMinVel = m.farg[0];
+        *pfAccn = m.farg[1];
+        *pfMaxVel = m.farg[2];
+    }
+    return ret;
+}
+
+long WINAPI MOT_GetStageAxisInfo(long lSerialNum, float *pfMinPos, float *pfMaxPos, long *plUnits, float *pfPitch) {
+    APTD_MSG m;
+    long ret;
+
+    init_msg(&m, APTD_FN_GETSTAGEAXISINFO, lSerialNum);
+    if ((ret = call(&m)) == 0) {
+        *pfMinPos = m.farg[0];
+        *pfMaxPos = m.farg[1];
+        *plUnits = m.larg[0];
+        *pfPitch = m.farg[2];
+    }
+    return ret;
+}
+
+long WINAPI MOT_GetPosition(long lSerialNum, float *pfPosition) {
+    APTD_MSG m;
+    long ret;
+
+    init_msg(&m, APTD_FN_GETPOSITION, lSerialNum);
+    if ((ret = call(&m)) == 0) *pfPosition = m.farg[0];
+    return ret;
+}
+
+long WINAPI MOT_MoveHome(long lSerialNum, BOOL bWait) {
+    APTD_MSG m;
+
+    init_msg(&m, APTD_FN_MOVEHOME, lSerialNum);
+    m.larg[0] = bWait;
+    return call(&m);
+}
+
+long WINAPI MOT_MoveRelativeEx(long lSerialNum, float fRelDist, BOOL bWait) {
+    APTD_MSG m;
+
+    init_msg(&m, APTD_FN_MOVERELATIVE, lSerialNum);
+    m.farg[0] = fRelDist;
+    m.larg[0] = bWait;
+    return call(&m);
+}
+
+long WINAPI MOT_MoveAbsoluteEx(long lSerialNum, float fAbsPos, BOOL bWait) {
+    APTD_MSG m;
+
+    init_msg(&m, APTD_FN_MOVEABSOLUTE, lSerialNum);
+    m.farg[0] = fAbsPos;
+    m.larg[0] = bWait;
+    return call(&m);
+}
@@ -0,0 +1,553 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// aptctl: lists, inspects, moves, homes, streams and benchmarks the
+// controllers from the command line or from a script.
+//
+//     aptctl [options] command [args...]
+//     aptctl [options] -f script        (- for stdin)
+//
+// An axis is SERIAL or SERIAL:CHAN (the bay of a rack controller, or the
+// channel of a multi-channel one). A script has one command per line, with
+// # comments. It runs in the one process: libapt is initialised once, each
+// controller once, the axis handles stay open from one command to the next
+// and the commands on several axes of a controller go out in one write
+// (see APT_OpenAxis), so a long sequence doesn't pay for process start-up
+// and device initialisation at every step. -j prints one JSON object per
+// command (JSON lines), -t the time each command took.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define HWTYPE_ANY 0 //Any Thorlabs APT device
+
+#ifndef WIN32
+    typedef enum { false, true } BOOL;
+    typedef char TCHAR;
+    #define WINAPI
+#endif
+
+#include "APTAPI.h"
+#include "libapt.h"
+
+#ifdef APTCTL_SIM
+#include "soaksim.h"
+#endif
+
+#define MAX_ARGS        64
+#define MAX_DEVS        64
+#define BENCH_MAX       100000
+
+static int json = 0, timing = 0, keepGoing = 0;
+static double timeout = 60;
+
+// initialised controllers, and the axis handles opened so far
+static long inited[MAX_DEVS];
+static long numInited = 0;
+static struct {
+    long serial;
+    long chan;
+    long handle;
+} opened[APT_MAX_AXES];
+static long numOpened = 0;
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s [options] command [args...]\n"
+        "       %s [options] -f script\n"
+        "  -f FILE run the commands in FILE, one per line (- for stdin)\n"
+        "  -j      JSON output, one object per command\n"
+        "  -t      print the time each command took\n"
+        "  -k      keep going after a command fails\n"
+        "  -D S    give up on a move or home after S seconds (60)\n"
+        "  -d      debug output\n"
+        "commands (AXIS is SERIAL or SERIAL:CHAN):\n"
+        "  list                          the controllers found\n"
+        "  inspect AXIS...               model, firmware, capabilities, status\n"
+        "  pos AXIS...                   the positions, taken together\n"
+        "  move AXIS POS [AXIS POS...]   absolute moves, waits for them all\n"
+        "  moveby AXIS DIST [...]        relative moves, waits for them all\n"
+        "  home AXIS...                  homes, waits for them all\n"
+        "  stop AXIS...                  profiled stop\n"
+        "  stream [-n N] [-i MS] AXIS... N samples (0 for ever) every MS ms\n"
+        "  bench [-n N] AXIS...          N position round trips, latency stats\n"
+        "  sleep MS\n", name, name);
+}
+
+static const char *err_string(long ret) {
+    static char buf[64];
+
+    if (ret > 0) return strerror((int)ret);
+    snprintf(buf, sizeof(buf), "libftdi error %ld", ret);
+    return buf;
+}
+
+static void json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20) printf("\\u%04x", (unsigned char)*s);
+        else putchar(*s);
+    }
+    putchar('"');
+}
+
+// Takes "-x value" out of the arguments, returning value or def.
+static long take_opt(int *argc, char **argv, const char *opt, long def) {
+    int k;
+
+    for (k = 0; k < *argc - 1; k++) {
+        if (strcmp(argv[k], opt) != 0) continue;
+        def = atol(argv[k + 1]);
+        memmove(argv + k, argv + k + 2, (*argc - k - 2) * sizeof(char *));
+        *argc -= 2;
+        break;
+    }
+    return def;
+}
+
+static long init_device(long serial) {
+    long k, ret;
+
+    for (k = 0; k < numInited; k++)
+        if (inited[k] == serial) return 0;
+    if (numInited == MAX_DEVS) return ENOMEM;
+    if ((ret = InitHWDevice(serial)) != 0) return ret;
+    inited[numInited++] = serial;
+    return 0;
+}
+
+// SERIAL or SERIAL:CHAN to an axis handle, opened once.
+static long get_axis(const char *spec, long *plAxis) {
+    long k, serial, chan = 0, ret;
+    char *end;
+
+    serial = strtol(spec, &end, 10);
+    if (*end == ':') chan = strtol(end + 1, &end, 10);
+    if (*end != 0 || serial <= 0) return EINVAL;
+
+    for (k = 0; k < numOpened; k++) {
+        if (opened[k].serial == serial && opened[k].chan == chan) {
+            *plAxis = opened[k].handle;
+            return 0;
+        }
+    }
+    if (numOpened == APT_MAX_AXES) return ENOMEM;
+    if ((ret = init_device(serial)) != 0) return ret;
+    if ((ret = APT_OpenAxis(serial, chan, plAxis)) != 0) return ret;
+    opened[numOpened].serial = serial;
+    opened[numOpened].chan = chan;
+    opened[numOpened++].handle = *plAxis;
+    return 0;
+}
+
+static long get_axes(int argc, char **argv, long *plAxes) {
+    long k, ret;
+
+    if (argc < 1 || argc > APT_MAX_AXES) return EINVAL;
+    for (k = 0; k < argc; k++)
+        if ((ret = get_axis(argv[k], &plAxes[k])) != 0) return ret;
+    return 0;
+}
+
+static long axis_serial(long lAxis) {
+    long serial = 0, chan, dest;
+
+    APT_AxisGetInfo(lAxis, &serial, &chan, &dest);
+    return serial;
+}
+
+// The APT_Axis* calls take the axes of one controller at a time: calls
+// fn(n, axes, values) for each controller in turn.
+static long per_controller(long lNumAxes, const long *plAxes, const float *pfValues,
+        long (*fn)(long, const long *, const float *)) {
+    long done[APT_MAX_AXES] = {0}, ax[APT_MAX_AXES];
+    float val[APT_MAX_AXES];
+    long k, l, n, ret;
+
+    for (k = 0; k < lNumAxes; k++) {
+        if (done[k]) continue;
+        for (l = k, n = 0; l < lNumAxes; l++) {
+            if (done[l] || axis_serial(plAxes[l]) != axis_serial(plAxes[k])) continue;
+            ax[n] = plAxes[l];
+            val[n++] = pfValues != NULL ? pfValues[l] : 0;
+            done[l] = 1;
+        }
+        if ((ret = fn(n, ax, val)) != 0) return ret;
+    }
+    return 0;
+}
+
+static long start_abs(long n, const long *ax, const float *val) { return APT_AxisMoveAbsolute(n, ax, val, false); }
+static long start_rel(long n, const long *ax, const float *val) { return APT_AxisMoveRelative(n, ax, val, false); }
+static long start_home(long n, const long *ax, const float *val) { (void)val; return APT_AxisMoveHome(n, ax, false); }
+static long stop_axes(long n, const long *ax, const float *val) { (void)val; return APT_AxisStop(n, ax); }
+
+static long still_moving;
+
+static long check_moving(long n, const long *ax, const float *val) {
+    unsigned long bits[APT_MAX_AXES];
+    long k, ret;
+    (void)val;
+
+    if ((ret = APT_AxisGetStatus(n, ax, bits, NULL)) != 0) return ret;
+    for (k = 0; k < n; k++)
+        if (bits[k] & APT_STATUS_MOVING) still_moving++;
+    return 0;
+}
+
+// Waits until none of the axes is moving, stopping them after -D seconds.
+static long wait_stopped(long lNumAxes, const long *plAxes) {
+    double until = APT_Now() + timeout;
+    long ret;
+
+    while (1) {
+        still_moving = 0;
+        if ((ret = per_controller(lNumAxes, plAxes, NULL, check_moving)) != 0 && ret != ETIMEDOUT) return ret;
+        if (ret == 0 && still_moving == 0) return 0;
+        if (APT_Now() > until) {
+            per_controller(lNumAxes, plAxes, NULL, stop_axes);
+            return ETIMEDOUT;
+        }
+        usleep(5000);
+    }
+}
+
+static void print_positions(long lNumAxes, char **argv, const float *pfPos) {
+    long k;
+
+    if (json) {
+        printf(",\"positions\":{");
+        for (k = 0; k < lNumAxes; k++) printf("%s\"%s\":%.0f", k ? "," : "", argv[k], pfPos[k]);
+        printf("}");
+    } else
+        for (k = 0; k < lNumAxes; k++) printf("%-12s %.0f\n", argv[k], pfPos[k]);
+}
+
+static long cmd_list(int argc, char **argv) {
+    APT_DEVICE_CAPS caps;
+    long k, n = 0, serial, ret;
+    (void)argc; (void)argv;
+
+    GetNumHWUnitsEx(HWTYPE_ANY, &n);
+    if (json) printf(",\"devices\":[");
+    for (k = 0; k < n; k++) {
+        if (GetHWSerialNumEx(HWTYPE_ANY, k, &serial) != 0) continue;
+        if ((ret = init_device(serial)) != 0 || (ret = APT_GetDeviceCaps(serial, &caps)) != 0) {
+            memset(&caps, 0, sizeof(caps));
+            strcpy(caps.szModel, "?");
+        }
+        if (json) {
+            printf("%s{\"serial\":%ld,\"model\":", k ? "," : "", serial);
+            json_string(caps.szModel);
+            printf(",\"hwtype\":%ld,\"channels\":%ld,\"bays\":%ld}", caps.lHWType, caps.lNumChannels, caps.lNumBays);
+        } else
+            printf("%-10ld %-8s hwtype %-4ld channels %ld%s\n", serial, caps.szModel, caps.lHWType,
+                    caps.lNumChannels, caps.lNumBays ? " (bays)" : "");
+    }
+    if (json) printf("]");
+    return 0;
+}
+
+static long cmd_inspect(int argc, char **argv) {
+    TCHAR model[64], swver[64], notes[64];
+    APT_DEVICE_CAPS caps;
+    unsigned long bits;
+    long ax[APT_MAX_AXES], k, serial, chan, dest, ret;
+    float pos, minVel, accn, maxVel;
+
+    if ((ret = get_axes(argc, argv, ax)) != 0) return ret;
+    if (json) printf(",\"axes\":[");
+    for (k = 0; k < argc; k++) {
+        APT_AxisGetInfo(ax[k], &serial, &chan, &dest);
+        if ((ret = APT_GetDeviceCaps(serial, &caps)) != 0) break;
+
+        model[0] = swver[0] = notes[0] = 0;
+        if ((ret = GetHWInfo(serial, model, sizeof(model), swver, sizeof(swver), notes, sizeof(notes))) != 0) break;
+        if ((ret = APT_AxisGetStatus(1, &ax[k], &bits, &pos)) != 0) break;
+
+        //the velocity parameters are per channel
+        if (MOT_SetChannel(serial, chan) != 0 || MOT_GetVelParams(serial, &minVel, &accn, &maxVel) != 0)
+            minVel = accn = maxVel = -1;
+
+        model[sizeof(model) - 1] = notes[sizeof(notes) - 1] = 0;
+        if (json) {
+            printf("%s{\"axis\":", k ? "," : "");
+            json_string(argv[k]);
+            printf(",\"model\":");
+            json_string(caps.szModel);
+            printf(",\"firmware\":");
+            json_string(swver);
+            printf(",\"notes\":");
+            json_string(notes);
+            printf(",\"hwtype\":%ld,\"dest\":%ld,\"messages\":%lu,\"position\":%.0f,\"status\":%lu,"
+                    "\"homed\":%s,\"moving\":%s,\"vel\":[%g,%g,%g]}",
+                    caps.lHWType, dest, caps.ulMessages, pos, bits,
+                    (bits & APT_STATUS_HOMED) ? "true" : "false", (bits & APT_STATUS_MOVING) ? "true" : "false",
+                    minVel, accn, maxVel);
+        } else {
+            printf("%s: %s (hwtype %ld), firmware %s, destination 0x%02lx\n", argv[k], caps.szModel,
+                    caps.lHWType, swver, dest);
+            if (notes[0]) printf("  notes      %s\n", notes);
+            printf("  messages   0x%08lx\n", caps.ulMessages);
+            printf("  position   %.0f\n", pos);
+            printf("  status     0x%08lx%s%s\n", bits, (bits & APT_STATUS_HOMED) ? " homed" : "",
+                    (bits & APT_STATUS_MOVING) ? " moving" : "");
+            if (maxVel >= 0) printf("  velocity   min %g accn %g max %g\n", minVel, accn, maxVel);
+        }
+    }
+    if (json) printf("]");
+    return ret;
+}
+
+static long cmd_pos(int argc, char **argv) {
+    long ax[APT_MAX_AXES], ret;
+    float pos[APT_MAX_AXES];
+    double t[APT_MAX_AXES], skew = 0;
+
+    if ((ret = get_axes(argc, argv, ax)) != 0) return ret;
+    if ((ret = APT_SnapshotPositions(argc, ax, pos, t, &skew)) != 0) return ret;
+    print_positions(argc, argv, pos);
+    if (json) printf(",\"skew_ms\":%.3f", skew * 1e3);
+    return 0;
+}
+
+static long cmd_move(int argc, char **argv, int relative) {
+    long ax[APT_MAX_AXES], k, n = argc / 2, ret;
+    float val[APT_MAX_AXES];
+    double t[APT_MAX_AXES];
+    char *axisArgs[APT_MAX_AXES], *end;
+
+    if (argc < 2 || argc % 2 != 0 || n > APT_MAX_AXES) return EINVAL;
+    for (k = 0; k < n; k++) {
+        axisArgs[k] = argv[2 * k];
+        if ((ret = get_axis(argv[2 * k], &ax[k])) != 0) return ret;
+        val[k] = strtof(argv[2 * k + 1], &end);
+        if (*end != 0) return EINVAL;
+    }
+    if ((ret = per_controller(n, ax, val, relative ? start_rel : start_abs)) != 0) return ret;
+    if ((ret = wait_stopped(n, ax)) != 0) return ret;
+    if ((ret = APT_SnapshotPositions(n, ax, val, t, NULL)) != 0) return ret;
+    print_positions(n, axisArgs, val);
+    return 0;
+}
+
+static long cmd_moveabs(int argc, char **argv) {
+    return cmd_move(argc, argv, 0);
+}
+
+static long cmd_moveby(int argc, char **argv) {
+    return cmd_move(argc, argv, 1);
+}
+
+static long cmd_home(int argc, char **argv) {
+    long ax[APT_MAX_AXES], ret;
+
+    if ((ret = get_axes(argc, argv, ax)) != 0) return ret;
+    if ((ret = per_controller(argc, ax, NULL, start_home)) != 0) return ret;
+    return wait_stopped(argc, ax);
+}
+
+static long cmd_stop(int argc, char **argv) {
+    long ax[APT_MAX_AXES], ret;
+
+    if ((ret = get_axes(argc, argv, ax)) != 0) return ret;
+    return per_controller(argc, ax, NULL, stop_axes);
+}
+
+static long cmd_stream(int argc, char **argv) {
+    long ax[APT_MAX_AXES], count, interval, k, l, ret;
+    float pos[APT_MAX_AXES];
+    double t[APT_MAX_AXES], t0, next;
+
+    count = take_opt(&argc, argv, "-n", 10);
+    interval = take_opt(&argc, argv, "-i", 100);
+    if ((ret = get_axes(argc, argv, ax)) != 0) return ret;
+
+    if (json) printf(",\"axes\":[");
+    for (k = 0; json && k < argc; k++) {
+        printf("%s", k ? "," : "");
+        json_string(argv[k]);
+    }
+    if (json) printf("],\"samples\":[");
+
+    t0 = next = APT_Now();
+    for (k = 0; count == 0 || k < count; k++) {
+        if ((ret = APT_SnapshotPositions(argc, ax, pos, t, NULL)) != 0) break;
+        if (json) {
+            printf("%s[%.6f", k ? "," : "", t[0] - t0);
+            for (l = 0; l < argc; l++) printf(",%.0f", pos[l]);
+            printf("]");
+        } else {
+            printf("%10.3f", (t[0] - t0) * 1e3);
+            for (l = 0; l < argc; l++) printf(" %12.0f", pos[l]);
+            printf("\n");
+        }
+        fflush(stdout);
+
+        next += interval / 1e3;
+        if (next > APT_Now()) usleep((useconds_t)((next - APT_Now()) * 1e6));
+    }
+    if (json) printf("]");
+    return ret;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static long cmd_bench(int argc, char **argv) {
+    long ax[APT_MAX_AXES], n, k, ret = 0;
+    float pos[APT_MAX_AXES];
+    double t[APT_MAX_AXES], *lat, t0, total;
+
+    n = take_opt(&argc, argv, "-n", 1000);
+    if (n < 1 || n > BENCH_MAX) return EINVAL;
+    if ((ret = get_axes(argc, argv, ax)) != 0) return ret;
+    if ((lat = malloc(n * sizeof(double))) == NULL) return ENOMEM;
+
+    total = APT_Now();
+    for (k = 0; k < n; k++) {
+        t0 = APT_Now();
+        if ((ret = APT_SnapshotPositions(argc, ax, pos, t, NULL)) != 0) break;
+        lat[k] = (APT_Now() - t0) * 1e3;
+    }
+    total = APT_Now() - total;
+
+    if (ret == 0) {
+        qsort(lat, n, sizeof(double), compare_double);
+        if (json)
+            printf(",\"rounds\":%ld,\"per_s\":%.1f,\"min_ms\":%.3f,\"median_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f",
+                    n, n / total, lat[0], lat[n / 2], lat[(n * 99) / 100], lat[n - 1]);
+        else
+            printf("%ld rounds on %d axes, %.1f/s: min %.3f ms, median %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                    n, argc, n / total, lat[0], lat[n / 2], lat[(n * 99) / 100], lat[n - 1]);
+    }
+    free(lat);
+    return ret;
+}
+
+static long cmd_sleep(int argc, char **argv) {
+    if (argc != 1) return EINVAL;
+    usleep((useconds_t)(atol(argv[0]) * 1000));
+    return 0;
+}
+
+// Runs one command, with its JSON object or timing line around it.
+static long run(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        long (*fn)(int, char **);
+    } cmds[] = {
+        {"list", cmd_list}, {"inspect", cmd_inspect}, {"pos", cmd_pos}, {"move", cmd_moveabs},
+        {"moveby", cmd_moveby}, {"home", cmd_home}, {"stop", cmd_stop}, {"stream", cmd_stream}, {"bench", cmd_bench}, {"sleep", cmd_sleep},
+    };
+    long k, ret;
+    double t0;
+
+    if (json) {
+        printf("{\"cmd\":");
+        json_string(argv[0]);
+    }
+    t0 = APT_Now();
+    for (k = 0; k < (long)(sizeof(cmds) / sizeof(cmds[0])) && strcmp(argv[0], cmds[k].name) != 0; k++);
+    ret = k < (long)(sizeof(cmds) / sizeof(cmds[0])) ? cmds[k].fn(argc - 1, argv + 1) : ENOSYS;
+    t0 = APT_Now() - t0;
+
+    if (json) {
+        printf(",\"ok\":%s", ret == 0 ? "true" : "false");
+        if (ret != 0) {
+            printf(",\"error\":%ld,\"message\":", ret);
+            json_string(ret == ENOSYS ? "unknown command" : err_string(ret));
+        }
+        printf(",\"ms\":%.3f}\n", t0 * 1e3);
+    } else {
+        if (ret == ENOSYS) fprintf(stderr, "aptctl: unknown command %s\n", argv[0]);
+        else if (ret != 0) fprintf(stderr, "aptctl: %s failed (%ld, %s)\n", argv[0], ret, err_string(ret));
+        if (timing) printf("%s: %.3f ms\n", argv[0], t0 * 1e3);
+    }
+    fflush(stdout);
+    return ret;
+}
+
+static long run_script(const char *path) {
+    char line[1024], *argv[MAX_ARGS], *tok;
+    long lineNum = 0, failed = 0, ret;
+    int argc;
+    FILE *f;
+
+    if ((f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r")) == NULL) {
+        fprintf(stderr, "aptctl: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineNum++;
+        if ((tok = strchr(line, '#')) != NULL) *tok = 0;
+        for (argc = 0, tok = strtok(line, " \t\r\n"); tok != NULL && argc < MAX_ARGS; tok = strtok(NULL, " \t\r\n"))
+            argv[argc++] = tok;
+        if (argc == 0) continue;
+
+        if ((ret = run(argc, argv)) != 0) {
+            failed++;
+            if (!json) fprintf(stderr, "aptctl: %s line %ld\n", path, lineNum);
+            if (!keepGoing) break;
+        }
+    }
+    if (f != stdin) fclose(f);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    const char *script = NULL;
+    long ret;
+    int opt, debug = 0;
+
+    while ((opt = getopt(argc, argv, "+f:jtkD:dh")) != -1) {
+        switch (opt) {
+            case 'f': script = optarg; break;
+            case 'j': json = 1; break;
+            case 't': timing = 1; break;
+            case 'k': keepGoing = 1; break;
+            case 'D': timeout = atof(optarg); break;
+            case 'd': debug = 1; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (script == NULL && optind >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+    SetDebug(debug);
+
+#ifdef APTCTL_SIM
+    soaksim_init(getenv("APTCTL_SIM") != NULL ? atoi(getenv("APTCTL_SIM")) : 3, 1);
+#endif
+    //no controllers isn't an error, list says so
+    if ((ret = APTInit()) != 0 && ret != ENODEV) {
+        fprintf(stderr, "aptctl: APTInit failed (%ld)\n", ret);
+        return 1;
+    }
+
+    ret = script != NULL ? run_script(script) : run(argc - optind, argv + optind);
+
+    APTCleanUp();
+    return ret == 0 ? 0 : 1;
+}
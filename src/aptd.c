@@ -0,0 +1,556 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// aptd: owns all the APT controllers and serves the APTAPI.h calls of any
+// number of local processes, see aptd.h for the transport.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define HWTYPE_ANY 0 //Any Thorlabs APT device
+
+#ifndef WIN32
+    typedef enum { false, true } BOOL;
+    typedef char TCHAR;
+    #define WINAPI
+#endif
+
+#include "APTAPI.h"
+#include "libapt.h"
+#include "aptd.h"
+
+static const char *shm_name = APTD_SHM_NAME;
+static const char *socket_path = APTD_SOCKET_PATH;
+static gid_t group = (gid_t)-1;    // given the segment and socket, -1 to keep ours
+static long poll_interval_ms = 0;
+static int verbose = 0;
+
+static APTD_SHM *shm = NULL;
+static int listen_fd = -1;
+static volatile sig_atomic_t running = 1;
+
+// libapt is not re-entrant, the ring and socket threads take turns
+static pthread_mutex_t apt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// channel last selected through MOT_SetChannel, per device
+static long current_chan[APTD_MAX_DEVS];
+
+static void on_signal(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static int find_dev(long lSerialNum) {
+    int i;
+
+    for (i = 0; i < shm->num_devs; i++) {
+        if (shm->status[i].serial == lSerialNum)
+            return i;
+    }
+    return -1;
+}
+
+static void publish(int dev, int chan, float position, int32_t flags) {
+    if (dev < 0 || chan < 0 || chan >= APTD_MAX_CHANS) return;
+    aptd_status_write(&shm->status[dev], chan, position, flags, aptd_now_us());
+}
+
+// Runs one forwarded call against libapt and updates the status page.
+// Must be called with apt_lock held.
+static void execute(APTD_MSG *m) {
+    int dev = find_dev(m->serial);
+    int chan = m->chan;
+    float pos = 0;
+    int32_t flags = 0;
+    int64_t ts;
+    long l0 = 0, l1 = 0;
+    float f0 = 0, f1 = 0, f2 = 0, f3 = 0;
+    long ret = 0;
+
+    if (m->func > APTD_FN_GETHWSERIALNUM && m->func != APTD_FN_GETSTATUS) {
+        if (dev < 0) {
+            m->ret = ENODEV;
+            return;
+        }
+        if (chan < 0 || chan >= APTD_MAX_CHANS) chan = 0;
+
+        // every client keeps its own channel selection
+        if (m->func != APTD_FN_SETCHANNEL && current_chan[dev] != chan) {
+            if ((ret = MOT_SetChannel(m->serial, chan)) != 0) {
+                m->ret = ret;
+                return;
+            }
+            current_chan[dev] = chan;
+        }
+        aptd_status_read(&shm->status[dev], chan, &pos, &flags, &ts);
+    }
+
+    switch (m->func) {
+        case APTD_FN_GETNUMHWUNITS:
+            ret = GetNumHWUnitsEx(m->larg[0], &l0);
+            m->larg[0] = l0;
+            break;
+        case APTD_FN_GETHWSERIALNUM:
+            ret = GetHWSerialNumEx(m->larg[0], m->larg[1], &l0);
+            m->larg[0] = l0;
+            break;
+        case APTD_FN_GETHWINFO:
+            memset(m->text, 0, sizeof(m->text));
+            ret = GetHWInfo(m->serial, m->text[0], 63, m->text[1], 63, m->text[2], 63);
+            break;
+        case APTD_FN_INITHWDEVICE:
+            // already initialised at start-up, don't make the device busy again
+            ret = 0;
+            break;
+        case APTD_FN_SETCHANNEL:
+            if ((ret = MOT_SetChannel(m->serial, m->larg[0])) == 0)
+                current_chan[dev] = m->larg[0];
+            break;
+        case APTD_FN_IDENTIFY:
+            ret = MOT_Identify(m->serial);
+            break;
+        case APTD_FN_ENABLEHWCHANNEL:
+            ret = MOT_EnableHWChannel(m->serial);
+            break;
+        case APTD_FN_DISABLEHWCHANNEL:
+            ret = MOT_DisableHWChannel(m->serial);
+            break;
+        case APTD_FN_SETVELPARAMS:
+            ret = MOT_SetVelParams(m->serial, m->farg[0], m->farg[1], m->farg[2]);
+            break;
+        case APTD_FN_GETVELPARAMS:
+            ret = MOT_GetVelParams(m->serial, &f0, &f1, &f2);
+            m->farg[0] = f0; m->farg[1] = f1; m->farg[2] = f2;
+            break;
+        case APTD_FN_GETSTAGEAXISINFO:
+            ret = MOT_GetStageAxisInfo(m->serial, &f0, &f1, &l1, &f3);
+            m->farg[0] = f0; m->farg[1] = f1; m->larg[0] = l1; m->farg[2] = f3;
+            break;
+        case APTD_FN_GETPOSITION:
+            if ((ret = MOT_GetPosition(m->serial, &f0)) == 0) {
+                m->farg[0] = f0;
+                publish(dev, chan, f0, (flags & ~APTD_STATUS_MOVING) | APTD_STATUS_VALID);
+            }
+            break;
+        case APTD_FN_MOVEHOME:
+            flags &= ~APTD_STATUS_HOMED;
+            if ((ret = MOT_MoveHome(m->serial, m->larg[0])) == 0) {
+                if (m->larg[0]) publish(dev, chan, 0, flags | APTD_STATUS_VALID | APTD_STATUS_HOMED);
+                else publish(dev, chan, pos, flags | APTD_STATUS_MOVING);
+            }
+            break;
+        case APTD_FN_MOVERELATIVE:
+            if ((ret = MOT_MoveRelativeEx(m->serial, m->farg[0], m->larg[0])) == 0) {
+                if (m->larg[0]) publish(dev, chan, pos + m->farg[0], flags);
+                else publish(dev, chan, pos, flags | APTD_STATUS_MOVING);
+            }
+            break;
+        case APTD_FN_MOVEABSOLUTE:
+            if ((ret = MOT_MoveAbsoluteEx(m->serial, m->farg[0], m->larg[0])) == 0) {
+                if (m->larg[0]) publish(dev, chan, m->farg[0], flags | APTD_STATUS_VALID);
+                else publish(dev, chan, pos, flags | APTD_STATUS_MOVING);
+            }
+            break;
+        case APTD_FN_GETSTATUS:
+            // only used by socket clients, shared memory clients read the page
+            if (dev < 0 || chan < 0 || chan >= APTD_MAX_CHANS) {
+                ret = ENODEV;
+                break;
+            }
+            aptd_status_read(&shm->status[dev], chan, &m->farg[0], &m->larg[0], &m->timestamp_us);
+            break;
+        default:
+            ret = ENOSYS;
+    }
+
+    if (ret != 0 && dev >= 0 && m->func != APTD_FN_GETSTATUS)
+        publish(dev, chan, pos, flags | APTD_STATUS_ERROR);
+
+    if (verbose) printf("aptd: fn=%d serial=%d chan=%d ret=%ld\n", m->func, m->serial, chan, ret);
+    m->ret = ret;
+}
+
+static void locked_execute(APTD_MSG *m) {
+    pthread_mutex_lock(&apt_lock);
+    execute(m);
+    pthread_mutex_unlock(&apt_lock);
+}
+
+// Refreshes the position of every known channel, used when -p is given.
+static void poll_positions(void) {
+    APTD_MSG m;
+    int i, c;
+
+    for (i = 0; i < shm->num_devs && running; i++) {
+        for (c = 0; c < shm->status[i].num_chans && c < APTD_MAX_CHANS; c++) {
+            memset(&m, 0, sizeof(m));
+            m.func = APTD_FN_GETPOSITION;
+            m.serial = shm->status[i].serial;
+            m.chan = c;
+            locked_execute(&m);
+        }
+    }
+}
+
+// Reclaims slots whose owner process went away without detaching.
+static void reap_clients(void) {
+    int i;
+    int32_t pid;
+
+    for (i = 0; i < APTD_MAX_CLIENTS; i++) {
+        pid = atomic_load(&shm->client[i].owner);
+        if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) {
+            atomic_store(&shm->client[i].cmd.tail, atomic_load(&shm->client[i].cmd.head));
+            atomic_store(&shm->client[i].reply.head, atomic_load(&shm->client[i].reply.tail));
+            atomic_store(&shm->client[i].owner, 0);
+            if (verbose) printf("aptd: reclaimed slot %d (pid %d)\n", i, pid);
+        }
+    }
+}
+
+static void *ring_thread(void *arg) {
+    APTD_MSG m;
+    APTD_CLIENT *cl;
+    int i, busy;
+    uint32_t bell;
+    int64_t next_poll = 0, next_reap = 0, now;
+    (void)arg;
+
+    while (running) {
+        bell = atomic_load(&shm->doorbell);
+        busy = 0;
+
+        for (i = 0; i < APTD_MAX_CLIENTS; i++) {
+            cl = &shm->client[i];
+            if (atomic_load_explicit(&cl->owner, memory_order_relaxed) == 0) continue;
+            while (aptd_ring_pop(&cl->cmd, &m) == 0) {
+                locked_execute(&m);
+                // a client that doesn't empty its replies doesn't hold up the
+                // others, it times out on that call instead (and skips the
+                // stale replies by their seq)
+                if (aptd_ring_push(&cl->reply, &m) < 0 && verbose)
+                    printf("aptd: slot %d reply ring full, reply to fn=%d dropped\n", i, m.func);
+                busy = 1;
+            }
+        }
+        if (busy) continue;
+
+        now = aptd_now_us();
+        if (now >= next_reap) {
+            reap_clients();
+            next_reap = now + 1000000;
+        }
+        if (poll_interval_ms > 0 && now >= next_poll) {
+            poll_positions();
+            next_poll = aptd_now_us() + poll_interval_ms * 1000;
+            continue;
+        }
+
+        // nothing to do, sleep until a client rings the door bell
+        atomic_store(&shm->sleeping, 1);
+        for (i = 0; i < APTD_MAX_CLIENTS; i++) {
+            cl = &shm->client[i];
+            if (atomic_load(&cl->cmd.head) != atomic_load(&cl->cmd.tail)) break;
+        }
+        if (i == APTD_MAX_CLIENTS)
+            aptd_futex_wait(&shm->doorbell, bell, 100000);
+        atomic_store(&shm->sleeping, 0);
+    }
+    return NULL;
+}
+
+static void *socket_thread(void *arg) {
+    struct pollfd fds[APTD_MAX_CLIENTS + 1];
+    // what came so far of each client's next message, the sockets don't
+    // block so that one sending half a message can't hold up the others
+    struct {
+        APTD_MSG m;
+        size_t len;
+    } in[APTD_MAX_CLIENTS + 1];
+    int i, n, nfds = 1;
+    ssize_t len;
+    (void)arg;
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+
+    while (running) {
+        if ((n = poll(fds, nfds, 200)) <= 0) continue;
+
+        if ((fds[0].revents & POLLIN) && nfds < APTD_MAX_CLIENTS + 1) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fds[nfds].fd = fd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                in[nfds].len = 0;
+                nfds++;
+            }
+        }
+
+        for (i = 1; i < nfds; i++) {
+            if (fds[i].revents == 0) continue;
+
+            len = recv(fds[i].fd, (char *)&in[i].m + in[i].len, sizeof(APTD_MSG) - in[i].len, 0);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+            if (len > 0) {
+                in[i].len += len;
+                if (in[i].len < sizeof(APTD_MSG)) continue;
+
+                // a client waits for its reply before sending the next call,
+                // there's room for it in the socket buffer
+                in[i].len = 0;
+                locked_execute(&in[i].m);
+                len = send(fds[i].fd, &in[i].m, sizeof(APTD_MSG), MSG_NOSIGNAL);
+                if (len == (ssize_t)sizeof(APTD_MSG)) continue;
+            }
+
+            // gone, or not following the protocol
+            close(fds[i].fd);
+            nfds--;
+            fds[i] = fds[nfds];
+            in[i] = in[nfds];
+            i--;
+        }
+    }
+
+    for (i = 1; i < nfds; i++) close(fds[i].fd);
+    return NULL;
+}
+
+// Whether another aptd is serving the segment: it's there, ready and its
+// daemon is still alive. One left behind by a daemon that died isn't.
+static int shm_live(void) {
+    APTD_SHM *other;
+    int fd, live = 0;
+
+    if ((fd = shm_open(shm_name, O_RDONLY, 0)) < 0) return 0;
+    other = mmap(NULL, sizeof(APTD_SHM), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (other == MAP_FAILED) return 0;
+
+    if (atomic_load(&other->magic) == APTD_MAGIC && other->daemon_pid > 0)
+        live = (kill(other->daemon_pid, 0) == 0 || errno == EPERM);
+    munmap(other, sizeof(APTD_SHM));
+    return live;
+}
+
+// Whether another aptd is listening on the socket.
+static int socket_live(void) {
+    struct sockaddr_un addr;
+    int fd, live;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    live = (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    close(fd);
+    return live;
+}
+
+static int create_shm(void) {
+    int fd;
+
+    // main made sure no daemon serves it, so this is a stale one
+    shm_unlink(shm_name);
+    if ((fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0660)) < 0) {
+        fprintf(stderr, "aptd: shm_open(%s): %s\n", shm_name, strerror(errno));
+        return -1;
+    }
+    if (group != (gid_t)-1 && fchown(fd, (uid_t)-1, group) < 0)
+        fprintf(stderr, "aptd: chown(%s): %s\n", shm_name, strerror(errno));
+    fchmod(fd, 0660);
+    if (ftruncate(fd, sizeof(APTD_SHM)) < 0) {
+        fprintf(stderr, "aptd: ftruncate: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    shm = mmap(NULL, sizeof(APTD_SHM), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        fprintf(stderr, "aptd: mmap: %s\n", strerror(errno));
+        shm = NULL;
+        return -1;
+    }
+    memset(shm, 0, sizeof(APTD_SHM));
+    shm->version = APTD_VERSION;
+    shm->daemon_pid = getpid();
+    return 0;
+}
+
+static int create_socket(void) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    // main made sure nobody listens on it, so a socket there is a stale one
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+        fprintf(stderr, "aptd: %s: %s\n", socket_path, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    if (group != (gid_t)-1 && chown(socket_path, (uid_t)-1, group) < 0)
+        fprintf(stderr, "aptd: chown(%s): %s\n", socket_path, strerror(errno));
+    chmod(socket_path, 0660);
+    return 0;
+}
+
+static void init_devices(void) {
+    long i, nDevices = 0, SerialNumber;
+    APT_DEVICE_CAPS caps;
+    APTD_STATUS *st;
+
+    GetNumHWUnitsEx(HWTYPE_ANY, &nDevices);
+    if (nDevices > APTD_MAX_DEVS) nDevices = APTD_MAX_DEVS;
+
+    for (i = 0; i < nDevices; i++) {
+        if (GetHWSerialNumEx(HWTYPE_ANY, i, &SerialNumber) != 0) continue;
+
+        st = &shm->status[shm->num_devs++];
+        st->serial = SerialNumber;
+        st->num_chans = 1;
+
+        if (InitHWDevice(SerialNumber) != 0) {
+            fprintf(stderr, "aptd: could not initialise %ld\n", SerialNumber);
+            continue;
+        }
+
+        if (APT_GetDeviceCaps(SerialNumber, &caps) == 0)
+            st->type = caps.lHWType;
+
+        // count the channels MOT_SetChannel accepts
+        while (st->num_chans < APTD_MAX_CHANS && MOT_SetChannel(SerialNumber, st->num_chans + 1) == 0)
+            st->num_chans++;
+        MOT_SetChannel(SerialNumber, 0);
+
+        printf("aptd: device %ld, serial %ld, type %d\n", i, SerialNumber, st->type);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-d] [-v] [-p ms] [-g group] [-m shm_name] [-s socket_path]\n"
+        "  -d            detach and run in the background\n"
+        "  -v            log every forwarded call and keep libapt debug output\n"
+        "  -p ms         refresh the status pages every ms milliseconds\n"
+        "  -g group      group allowed to use the daemon (default aptd's own)\n"
+        "  -m shm_name   shared memory segment (default %s)\n"
+        "  -s path       Unix socket for the fallback transport (default %s)\n",
+        name, APTD_SHM_NAME, APTD_SOCKET_PATH);
+}
+
+int main(int argc, char **argv) {
+    pthread_t ring_tid, socket_tid;
+    struct group *gr;
+    int opt, detach = 0, have_socket;
+    long ret;
+
+    if (getenv("APTD_SHM")) shm_name = getenv("APTD_SHM");
+    if (getenv("APTD_SOCKET")) socket_path = getenv("APTD_SOCKET");
+
+    while ((opt = getopt(argc, argv, "dvp:g:m:s:h")) != -1) {
+        switch (opt) {
+            case 'd': detach = 1; break;
+            case 'v': verbose = 1; break;
+            case 'p': poll_interval_ms = atol(optarg); break;
+            case 'g':
+                if ((gr = getgrnam(optarg)) == NULL) {
+                    fprintf(stderr, "aptd: no group %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                group = gr->gr_gid;
+                break;
+            case 'm': shm_name = optarg; break;
+            case 's': socket_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    SetDebug(verbose);
+
+    // a second aptd would take the segment and the socket from under the
+    // first one's clients
+    if (shm_live() || socket_live()) {
+        fprintf(stderr, "aptd: already running on %s or %s\n", shm_name, socket_path);
+        return EXIT_FAILURE;
+    }
+
+    if (detach && daemon(0, 1) < 0) {
+        perror("aptd: daemon");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (create_shm() < 0)
+        return EXIT_FAILURE;
+
+    ret = APTInit();
+    if (ret != 0 && ret != ENODEV)
+        fprintf(stderr, "aptd: APTInit returned %ld\n", ret);
+
+    init_devices();
+    have_socket = (create_socket() == 0);
+
+    // publish the segment, clients check the magic before attaching
+    atomic_store(&shm->magic, APTD_MAGIC);
+    printf("aptd: serving %d device(s) on %s%s%s\n", shm->num_devs, shm_name,
+            have_socket ? " and " : "", have_socket ? socket_path : "");
+    fflush(stdout);
+
+    pthread_create(&ring_tid, NULL, ring_thread, NULL);
+    if (have_socket) pthread_create(&socket_tid, NULL, socket_thread, NULL);
+
+    pthread_join(ring_tid, NULL);
+    if (have_socket) {
+        pthread_join(socket_tid, NULL);
+        close(listen_fd);
+        unlink(socket_path);
+    }
+
+    atomic_store(&shm->magic, 0);
+    munmap(shm, sizeof(APTD_SHM));
+    shm_unlink(shm_name);
+    APTCleanUp();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,239 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Shared definitions for the aptd device broker (aptd.c) and its client
+// library (aptclient.c).
+//
+// aptd owns every controller and serialises access to them. Local clients
+// claim a slot in a shared memory segment and talk to the daemon through a
+// pair of single producer / single consumer rings (commands in, replies out).
+// The daemon also publishes a status page per device, protected by a seqlock,
+// so that reading the last known position never involves a system call.
+// When the shared memory segment can't be used, the same APTD_MSG structures
+// are exchanged over a Unix domain socket instead.
+
+#ifndef APTD_H
+#define APTD_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#ifdef __linux__
+    #include <limits.h>
+    #include <unistd.h>
+    #include <sys/syscall.h>
+    #include <linux/futex.h>
+#endif
+
+#define APTD_MAGIC          0x41505444  // "APTD"
+#define APTD_VERSION        1
+
+#define APTD_SHM_NAME       "/aptd"
+#define APTD_SOCKET_PATH    "/tmp/aptd.sock"
+
+#define APTD_MAX_DEVS       32
+#define APTD_MAX_CHANS      4
+#define APTD_MAX_CLIENTS    16
+#define APTD_RING_SIZE      16          // must be a power of two
+
+// How long a client waits for the daemon to answer a command
+#define APTD_REPLY_TIMEOUT_MS   30000
+
+// Broker function identifiers, one per forwarded APTAPI.h call
+enum {
+    APTD_FN_NONE = 0,
+    APTD_FN_GETNUMHWUNITS,
+    APTD_FN_GETHWSERIALNUM,
+    APTD_FN_GETHWINFO,
+    APTD_FN_INITHWDEVICE,
+    APTD_FN_SETCHANNEL,
+    APTD_FN_IDENTIFY,
+    APTD_FN_ENABLEHWCHANNEL,
+    APTD_FN_DISABLEHWCHANNEL,
+    APTD_FN_SETVELPARAMS,
+    APTD_FN_GETVELPARAMS,
+    APTD_FN_GETSTAGEAXISINFO,
+    APTD_FN_GETPOSITION,
+    APTD_FN_MOVEHOME,
+    APTD_FN_MOVERELATIVE,
+    APTD_FN_MOVEABSOLUTE,
+    APTD_FN_GETSTATUS,
+    APTD_FN_LAST
+};
+
+// Status page flags
+#define APTD_STATUS_VALID   0x01    // position holds a value read from or set on the device
+#define APTD_STATUS_HOMED   0x02    // the channel was homed through the broker
+#define APTD_STATUS_MOVING  0x04    // a move was started without waiting for it to complete
+#define APTD_STATUS_ERROR   0x08    // the last command on this device failed
+
+// One command or reply. Commands fill func, serial, chan and the arguments,
+// replies fill ret and the outputs. Fixed size so that it can be copied into
+// a ring slot or written to a socket as is.
+typedef struct {
+    uint32_t seq;
+    int32_t func;
+    int32_t ret;
+    int32_t serial;
+    int32_t chan;
+    int32_t larg[4];
+    float farg[4];
+    int64_t timestamp_us;
+    char text[3][64];
+} APTD_MSG;
+
+// Single producer / single consumer ring. head is only written by the
+// producer, tail only by the consumer, each on its own cache line.
+typedef struct {
+    _Atomic uint32_t head;
+    char pad1[60];
+    _Atomic uint32_t tail;
+    _Atomic uint32_t waiting;   // consumer is (about to be) blocked on head
+    char pad2[56];
+    APTD_MSG msg[APTD_RING_SIZE];
+} APTD_RING;
+
+typedef struct {
+    _Atomic int32_t owner;      // pid of the client holding the slot, 0 if free
+    char pad[60];
+    APTD_RING cmd;              // client -> daemon
+    APTD_RING reply;            // daemon -> client
+} APTD_CLIENT;
+
+// Per-device status page. seq is odd while the daemon is updating the page.
+typedef struct {
+    _Atomic uint32_t seq;
+    int32_t serial;
+    int32_t type;
+    int32_t num_chans;
+    _Atomic int32_t flags[APTD_MAX_CHANS];
+    _Atomic float position[APTD_MAX_CHANS];
+    _Atomic int64_t timestamp_us[APTD_MAX_CHANS];
+    char pad[4];
+} APTD_STATUS;
+
+typedef struct {
+    _Atomic uint32_t magic;     // set last, once the segment is ready
+    uint32_t version;
+    int32_t daemon_pid;
+    int32_t num_devs;
+    _Atomic uint32_t doorbell;  // bumped by clients after queuing a command
+    _Atomic uint32_t sleeping;  // daemon is (about to be) blocked on doorbell
+    char pad[40];
+    APTD_STATUS status[APTD_MAX_DEVS];
+    APTD_CLIENT client[APTD_MAX_CLIENTS];
+} APTD_SHM;
+
+
+static inline int64_t aptd_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Block while *addr == val, for at most timeout_us. Spurious wake-ups are
+// fine, callers always re-check their condition.
+static inline void aptd_futex_wait(_Atomic uint32_t *addr, uint32_t val, long timeout_us) {
+    struct timespec ts;
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+    if (atomic_load(addr) == val) {
+        if (ts.tv_sec == 0 && ts.tv_nsec > 100000) ts.tv_nsec = 100000;
+        nanosleep(&ts, NULL);
+    }
+#endif
+}
+
+static inline void aptd_futex_wake(_Atomic uint32_t *addr) {
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)addr;
+#endif
+}
+
+// Producer side: returns 0 on success, -1 if the ring is full.
+static inline int aptd_ring_push(APTD_RING *ring, const APTD_MSG *msg) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail >= APTD_RING_SIZE) return -1;
+    ring->msg[head & (APTD_RING_SIZE - 1)] = *msg;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    if (atomic_load(&ring->waiting)) aptd_futex_wake(&ring->head);
+    return 0;
+}
+
+// Consumer side: returns 0 on success, -1 if the ring is empty.
+static inline int aptd_ring_pop(APTD_RING *ring, APTD_MSG *msg) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) return -1;
+    *msg = ring->msg[tail & (APTD_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+// Seqlock writer, only ever called by the daemon.
+static inline void aptd_status_write(APTD_STATUS *st, int chan, float position, int32_t flags, int64_t timestamp_us) {
+    uint32_t seq = atomic_load_explicit(&st->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&st->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&st->position[chan], position, memory_order_relaxed);
+    atomic_store_explicit(&st->flags[chan], flags, memory_order_relaxed);
+    atomic_store_explicit(&st->timestamp_us[chan], timestamp_us, memory_order_relaxed);
+    atomic_store_explicit(&st->seq, seq + 2, memory_order_release);
+}
+
+// Seqlock reader, lock-free and syscall-free.
+static inline void aptd_status_read(APTD_STATUS *st, int chan, float *position, int32_t *flags, int64_t *timestamp_us) {
+    uint32_t seq0, seq1;
+
+    do {
+        seq0 = atomic_load_explicit(&st->seq, memory_order_acquire);
+        *position = atomic_load_explicit(&st->position[chan], memory_order_relaxed);
+        *flags = atomic_load_explicit(&st->flags[chan], memory_order_relaxed);
+        *timestamp_us = atomic_load_explicit(&st->timestamp_us[chan], memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        seq1 = atomic_load_explicit(&st->seq, memory_order_relaxed);
+    } while ((seq0 & 1) || seq0 != seq1);
+}
+
+// Client library extras (aptclient.c), on top of the APTAPI.h functions.
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Last known position of a channel as published by the daemon. Reads the
+// shared status page directly when attached through shared memory.
+long APTD_GetStatus(long lSerialNum, long lChanID, float *pfPosition, long *plFlags, int64_t *pllTimestampUs);
+
+// Returns 1 when talking to the daemon through shared memory, 0 when using
+// the socket fallback and -1 when not connected.
+long APTD_GetTransport(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// aptsoak: fault injection soak test of libapt.
+//
+// The library sources are linked against soaksim.c rather than libftdi1,
+// which gives dozens of simulated controllers in the one process (TDC001,
+// KDC101 and three bay BBD103 in turn). Caller threads then hammer them
+// with a mix of position requests, moves, homing, parameter reads and
+// multi-axis calls, serialised on one lock as aptd and the Python bindings
+// do, each call with a deadline. Meanwhile the simulated controllers drop,
+// truncate and corrupt reply frames, hold replies back and disconnect and
+// come back at the given rates.
+//
+// Before the faults, a few checks of what the soak itself can't see (a
+// failure there exits with status 1 as well).
+//
+// At the end aptsoak reports the throughput, the latency percentiles, the
+// faults injected, how long the callers took to get a controller working
+// again after it came back, and the callers that hung: a call that takes
+// longer than -H seconds, whatever its deadline, is a bug. Every position
+// and velocity parameter a call returns is checked against the simulated
+// controller, and a wrong one counts as a failed call; APT frames have no
+// checksum, so a corrupted frame may pass for a good one, but there can't
+// be more wrong values than corrupted frames. The exit status is 1 if any
+// caller hung or there were. `make soak-tsan` runs it under ThreadSanitizer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#ifndef WIN32
+    typedef enum { false, true } BOOL;
+    typedef char TCHAR;
+    #define WINAPI
+#endif
+
+#include "APTAPI.h"
+#include "libapt.h"
+#include "soaksim.h"
+
+#define MAX_THREADS     64
+
+// latency histogram: HIST_PER_DECADE buckets per decade from 1 us
+#define HIST_PER_DECADE 50
+#define HIST_BUCKETS    (8 * HIST_PER_DECADE)
+
+typedef enum {
+    OP_POSITION,
+    OP_MOVE,
+    OP_HOME,
+    OP_PARAMS,
+    OP_VELPARAMS,
+    OP_AXES,
+    OP_COUNT
+} OP;
+
+static const char *opNames[OP_COUNT] = {"position", "move", "home", "params", "velparams", "axes"};
+
+// how often each call comes up, out of 100
+static const int opMix[OP_COUNT] = {40, 25, 5, 10, 5, 15};
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    unsigned int seed;
+
+    long since;             // us on the monotonic clock the call started, 0 between calls
+    long op;
+    long serial;
+    int hung;               // reported by the watchdog
+
+    long calls[OP_COUNT];
+    long failed[OP_COUNT];
+    long wrong[OP_COUNT];   // returned 0 with a value the controller doesn't have
+    long hist[HIST_BUCKETS];
+    double maxLatency;
+} CALLER;
+
+static pthread_mutex_t apt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static CALLER callers[MAX_THREADS];
+static int numCallers = 8;
+static int numControllers = 32;
+static double duration = 20;
+static double callDeadline = 1.0;
+static double hungAfter = 5.0;
+static int running = 1;
+
+// the axis handles of the rack controllers, three per controller
+static long axisHandles[256][3];
+
+// recovery times after a reconnect (s), under apt_lock
+static double recoverSum = 0, recoverMax = 0;
+static long recoverCount = 0;
+
+static long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void record(CALLER *c, int op, double latency, int ok, int wrong) {
+    int b = latency > 1e-6 ? (int)(log10(latency * 1e6) * HIST_PER_DECADE) : 0;
+
+    if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+    c->hist[b]++;
+    c->calls[op]++;
+    if (!ok) c->failed[op]++;
+    if (wrong) c->wrong[op]++;
+    if (latency > c->maxLatency) c->maxLatency = latency;
+}
+
+// Whether a value returned by a call is the controller's, flags it in *wrong if not.
+static int agrees(int same, int *wrong) {
+    if (!same) *wrong = 1;
+    return same;
+}
+
+// One call to controller k, returns non-zero if it worked and returned what
+// the controller has, sets *wrong if it returned 0 with something else.
+static int call(CALLER *c, int op, int k, int *wrong) {
+    long lSerialNum = soaksim_serial(k), lProp, lInt, lDeriv, lIntLim, lDerivTime, lGain, lVelFFwd, lAccFFwd, lPosErrLim, ret;
+    APT_DEVICE_CAPS caps;
+    float fPos, fMinVel, fAccn, fMaxVel, afPos[3];
+    float fMinVelSim, fAccnSim, fMaxVelSim;
+    double dDeadline = APT_Now() + callDeadline;
+    int b;
+
+    *wrong = 0;
+    switch (op) {
+        case OP_POSITION:
+            if (MOT_GetPositionDl(lSerialNum, &fPos, dDeadline, NULL) != 0) return 0;
+            return agrees(fPos == soaksim_position(k, 0), wrong);
+        case OP_MOVE:
+            // small moves back and forth, so that the stages stay put on average
+            fPos = (rand_r(&c->seed) % 2) ? 2000 : -2000;
+            return MOT_MoveRelativeExDl(lSerialNum, fPos, true, dDeadline, NULL) == 0;
+        case OP_HOME:
+            return MOT_MoveHomeDl(lSerialNum, true, dDeadline, NULL) == 0;
+        case OP_PARAMS:
+            // the brushless controllers have a position loop instead of the PID block
+            if (APT_GetDeviceCaps(lSerialNum, &caps) == 0 && !(caps.ulMessages & APT_CAP_DCPID))
+                return MOT_GetDCPositionLoopParamsDl(lSerialNum, &lProp, &lInt, &lIntLim, &lDeriv, &lDerivTime,
+                        &lGain, &lVelFFwd, &lAccFFwd, &lPosErrLim, dDeadline, NULL) == 0;
+            return MOT_GetPIDParamsDl(lSerialNum, &lProp, &lInt, &lDeriv, &lIntLim, dDeadline, NULL) == 0;
+        case OP_VELPARAMS:
+            if (MOT_GetVelParamsDl(lSerialNum, &fMinVel, &fAccn, &fMaxVel, dDeadline, NULL) != 0) return 0;
+            soaksim_velparams(k, &fMinVelSim, &fAccnSim, &fMaxVelSim);
+            return agrees(fMinVel == fMinVelSim && fAccn == fAccnSim && fMaxVel == fMaxVelSim, wrong);
+        case OP_AXES:
+            if (soaksim_bays(k) == 0) {
+                if (MOT_GetPositionDl(lSerialNum, &fPos, dDeadline, NULL) != 0) return 0;
+                return agrees(fPos == soaksim_position(k, 0), wrong);
+            }
+            APT_SetDeadline(dDeadline, NULL);
+            ret = APT_AxisGetPositions(3, axisHandles[k], afPos);
+            APT_SetDeadline(0, NULL);
+            if (ret != 0) return 0;
+            for (b = 0; b < 3; b++)
+                if (!agrees(afPos[b] == soaksim_position(k, b), wrong)) return 0;
+            return 1;
+    }
+    return 0;
+}
+
+static void *caller_thread(void *arg) {
+    CALLER *c = (CALLER *)arg;
+    double t0, rc;
+    int op, k, r, ok, wrong;
+
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        k = rand_r(&c->seed) % numControllers;
+        r = rand_r(&c->seed) % 100;
+        for (op = 0; op < OP_COUNT - 1 && r >= opMix[op]; op++) r -= opMix[op];
+
+        pthread_mutex_lock(&apt_lock);
+        t0 = APT_Now();
+        __atomic_store_n(&c->op, op, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->serial, soaksim_serial(k), __ATOMIC_RELAXED);
+        __atomic_store_n(&c->since, now_us(), __ATOMIC_RELEASE);
+
+        ok = call(c, op, k, &wrong);
+
+        __atomic_store_n(&c->since, 0, __ATOMIC_RELEASE);
+        if (ok && (rc = soaksim_reconnected(soaksim_serial(k))) > 0) {
+            rc = APT_Now() - rc;
+            recoverSum += rc;
+            recoverCount++;
+            if (rc > recoverMax) recoverMax = rc;
+        }
+        record(c, op, APT_Now() - t0, ok, wrong);
+        pthread_mutex_unlock(&apt_lock);
+    }
+    return NULL;
+}
+
+// Reports the callers stuck in one call for longer than hungAfter.
+static void watchdog(void) {
+    long since, t = now_us();
+    int k;
+
+    for (k = 0; k < numCallers; k++) {
+        since = __atomic_load_n(&callers[k].since, __ATOMIC_ACQUIRE);
+        if (since == 0 || t - since < hungAfter * 1e6 || callers[k].hung) continue;
+        callers[k].hung = 1;
+        printf("aptsoak: caller %d hung for %.1f s in %s on %ld\n", k, (t - since) / 1e6,
+                opNames[__atomic_load_n(&callers[k].op, __ATOMIC_RELAXED)],
+                __atomic_load_n(&callers[k].serial, __ATOMIC_RELAXED));
+        fflush(stdout);
+    }
+}
+
+// upper edge of the bucket, but no more than the slowest call
+static double percentile(const long *hist, long total, double p, double max) {
+    long n = 0, want = (long)ceil(total * p);
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        n += hist[b];
+        if (n >= want && n > 0) return fmin(pow(10, (b + 1.0) / HIST_PER_DECADE) * 1e-6, max);
+    }
+    return 0;
+}
+
+// One check, counted in checksFailed.
+static int checksFailed = 0;
+
+static void check(int ok, const char *what) {
+    printf("aptsoak: check %s: %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) checksFailed++;
+}
+
+// Runs the checks on controller k, before any fault.
+static void run_checks(int k) {
+    long lSerialNum = soaksim_serial(k), lAxis, ret;
+    APT_COMPARE_STATS stats;
+    APT_COMPARE_EVENT e;
+    SOAK_FAULTS f;
+    float fPos, fTarget;
+    char what[64];
+    int plant, n;
+
+    // a *Dl call out of time must leave the thread's own context alone
+    check(MOT_GetPositionDl(lSerialNum, &fPos, APT_Now() - 1, NULL) == ETIMEDOUT
+            && MOT_GetPosition(lSerialNum, &fPos) == 0 && APT_GetDeadlineStatus() == 0,
+            "deadline status after a timed out call");
+
+    // a reply that doesn't come, or comes cut short, is an error rather
+    // than whatever the last one left behind
+    memset(&f, 0, sizeof(f));
+    f.drop = 1;
+    soaksim_set_faults(&f);
+    check(MOT_GetPosition(lSerialNum, &fPos) == ETIMEDOUT, "position not answered");
+    f.drop = 0;
+    f.truncate = 1;
+    soaksim_set_faults(&f);
+    check(MOT_GetPosition(lSerialNum, &fPos) == EIO, "position cut short");
+    soaksim_set_faults(NULL);
+
+    // a move that ends returns 0, one that doesn't in time ETIMEDOUT (2 s
+    // at the simulated speed, past MOVE_TIMEOUT)
+    check(MOT_MoveRelativeEx(lSerialNum, 1000, true) == 0, "move completed");
+    check(MOT_MoveRelativeEx(lSerialNum, 4e6, true) == ETIMEDOUT, "move timed out");
+    MOT_StopProfiled(lSerialNum);
+    MOT_MoveHome(lSerialNum, true);
+
+    // compare points from the start position on, the first one included,
+    // with the stage jumping to the target and following the plant
+    for (plant = 0; plant < 2; plant++) {
+        soaksim_set_plant(plant);
+        MOT_MoveHome(lSerialNum, true);
+        APT_OpenAxis(lSerialNum, 0, &lAxis);
+        for (n = 0; n < 2; n++) {
+            fTarget = 5000 * (n + 1);
+            APT_CompareSetInterval(lAxis, 5000 * n, 1000, 5, 0);
+            ret = APT_CompareRun(1, &lAxis, &fTarget, NULL, NULL);
+            APT_CompareGetStats(lAxis, &stats);
+            while (APT_ComparePoll(&e) == 0);
+            snprintf(what, sizeof(what), "compare from %d%s", 5000 * n, plant ? " with the plant" : "");
+            check(ret == 0 && stats.lNumCrossed == 5, what);
+        }
+        APT_CompareClear(lAxis);
+        APT_CloseAxis(lAxis);
+    }
+    soaksim_set_plant(0);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -c N    simulated controllers (32)\n"
+        "  -t N    caller threads (8)\n"
+        "  -d S    duration in seconds (20)\n"
+        "  -D P    reply frames dropped (0.001)\n"
+        "  -T P    reply frames truncated (0.001)\n"
+        "  -C P    reply frames corrupted (0.001)\n"
+        "  -L P    reply frames held back by a latency spike (0.002)\n"
+        "  -S MS   latency spike (50)\n"
+        "  -X P    writes that find the controller disconnected (0.0005)\n"
+        "  -R MS   time a disconnected controller stays away (200)\n"
+        "  -l S    deadline of each call (1)\n"
+        "  -H S    a call taking longer than this is hung (5)\n"
+        "  -s N    random seed (1)\n"
+        "  -v      show libapt's error messages\n", name);
+}
+
+int main(int argc, char **argv) {
+    SOAK_FAULTS f = {0.001, 0.001, 0.001, 0.002, 50, 0.0005, 200};
+    SOAK_COUNTS counts;
+    long hist[HIST_BUCKETS], total = 0, failed = 0, calls[OP_COUNT], fails[OP_COUNT], wrongs[OP_COUNT], wrong = 0, n;
+    unsigned int seed = 1;
+    double t0, elapsed, maxLatency = 0;
+    int opt, verbose = 0, hung = 0, k, b, op;
+
+    while ((opt = getopt(argc, argv, "c:t:d:D:T:C:L:S:X:R:l:H:s:vh")) != -1) {
+        switch (opt) {
+            case 'c': numControllers = atoi(optarg); break;
+            case 't': numCallers = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'D': f.drop = atof(optarg); break;
+            case 'T': f.truncate = atof(optarg); break;
+            case 'C': f.corrupt = atof(optarg); break;
+            case 'L': f.spike = atof(optarg); break;
+            case 'S': f.spikeMs = atof(optarg); break;
+            case 'X': f.disconnect = atof(optarg); break;
+            case 'R': f.downMs = atof(optarg); break;
+            case 'l': callDeadline = atof(optarg); break;
+            case 'H': hungAfter = atof(optarg); break;
+            case 's': seed = (unsigned int)atol(optarg); break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (numControllers < 1 || numControllers > 256 || numCallers < 1 || numCallers > MAX_THREADS) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // libapt has plenty to say about every fault
+    if (!verbose && freopen("/dev/null", "w", stderr) == NULL) return 1;
+    SetDebug(0);
+
+    // a clean start, then the faults
+    soaksim_init(numControllers, seed);
+    if (APTInit() != 0 && APTInit() != 0) {
+        printf("aptsoak: APTInit failed\n");
+        return 1;
+    }
+    for (k = 0; k < numControllers; k++) {
+        if (InitHWDevice(soaksim_serial(k)) != 0) {
+            printf("aptsoak: InitHWDevice(%ld) failed\n", soaksim_serial(k));
+            return 1;
+        }
+        for (b = 0; b < soaksim_bays(k) && b < 3; b++)
+            APT_OpenAxis(soaksim_serial(k), b + 1, &axisHandles[k][b]);
+    }
+    run_checks(0);
+    fflush(stdout);
+    soaksim_set_faults(&f);
+
+    printf("aptsoak: %d controllers, %d callers, %.0f s, drop %g truncate %g corrupt %g spike %g (%g ms) disconnect %g (%g ms)\n",
+            numControllers, numCallers, duration, f.drop, f.truncate, f.corrupt, f.spike, f.spikeMs, f.disconnect, f.downMs);
+    fflush(stdout);
+
+    t0 = APT_Now();
+    for (k = 0; k < numCallers; k++) {
+        callers[k].id = k;
+        callers[k].seed = seed * 7919 + k;
+        pthread_create(&callers[k].thread, NULL, caller_thread, &callers[k]);
+    }
+    while (APT_Now() - t0 < duration) {
+        usleep(100000);
+        watchdog();
+    }
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+
+    // a caller that never comes back is hung for good
+    while (APT_Now() - t0 < duration + hungAfter + callDeadline) {
+        for (k = 0; k < numCallers && __atomic_load_n(&callers[k].since, __ATOMIC_ACQUIRE) == 0; k++);
+        if (k == numCallers) break;
+        usleep(100000);
+        watchdog();
+    }
+    for (k = 0; k < numCallers; k++) {
+        if (__atomic_load_n(&callers[k].since, __ATOMIC_ACQUIRE) != 0) {
+            hung++;
+            continue;
+        }
+        pthread_join(callers[k].thread, NULL);
+        hung += callers[k].hung;
+    }
+    elapsed = APT_Now() - t0;
+
+    pthread_mutex_lock(&apt_lock);
+    memset(hist, 0, sizeof(hist));
+    memset(calls, 0, sizeof(calls));
+    memset(fails, 0, sizeof(fails));
+    memset(wrongs, 0, sizeof(wrongs));
+    for (k = 0; k < numCallers; k++) {
+        for (b = 0; b < HIST_BUCKETS; b++) hist[b] += callers[k].hist[b];
+        for (op = 0; op < OP_COUNT; op++) {
+            calls[op] += callers[k].calls[op];
+            fails[op] += callers[k].failed[op];
+            wrongs[op] += callers[k].wrong[op];
+        }
+        if (callers[k].maxLatency > maxLatency) maxLatency = callers[k].maxLatency;
+    }
+    for (op = 0; op < OP_COUNT; op++) {
+        total += calls[op];
+        failed += fails[op];
+        wrong += wrongs[op];
+    }
+    soaksim_counts(&counts);
+
+    printf("calls      %ld in %.1f s (%.0f/s), %ld failed\n", total, elapsed, total / elapsed, failed);
+    for (op = 0; op < OP_COUNT; op++)
+        printf("  %-9s %ld, %ld failed (%ld wrong values)\n", opNames[op], calls[op], fails[op], wrongs[op]);
+    printf("latency    p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+            percentile(hist, total, 0.5, maxLatency) * 1e3, percentile(hist, total, 0.99, maxLatency) * 1e3,
+            percentile(hist, total, 0.999, maxLatency) * 1e3, maxLatency * 1e3);
+    printf("faults     %ld frames: %ld dropped, %ld truncated, %ld corrupted, %ld spikes; %ld disconnects\n",
+            counts.frames, counts.dropped, counts.truncated, counts.corrupted, counts.spikes, counts.disconnects);
+    n = recoverCount;
+    printf("recovery   %ld reconnects seen, mean %.1f ms, max %.1f ms\n",
+            n, n > 0 ? recoverSum / n * 1e3 : 0, recoverMax * 1e3);
+    printf("wrong      %ld values, against %ld corrupted frames\n", wrong, counts.corrupted);
+    printf("hung       %d callers\n", hung);
+    pthread_mutex_unlock(&apt_lock);
+
+    // hung callers still hold the lock, don't wait for them
+    if (hung) _exit(1);
+    APTCleanUp();
+    return checksFailed != 0 || wrong > counts.corrupted;
+}
@@ -0,0 +1,128 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// apttune: tunes the loop gains of a controller, see APT_TunePID.
+//
+//     apttune [options] serial
+//
+// prints the step response of every trial, and the gains it settled on,
+// which the controller keeps until it is power cycled (-o saves them with
+// APT_SaveConfig). apttune-sim is the same program linked against the
+// simulated controllers of soaksim.c with their second order plant
+// turned on, and tunes the first of them when no serial number is given.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifndef WIN32
+    typedef enum { false, true } BOOL;
+    typedef char TCHAR;
+    #define WINAPI
+#endif
+
+#include "APTAPI.h"
+#include "libapt.h"
+
+#ifdef APTTUNE_SIM
+#include "soaksim.h"
+#endif
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s [options] serial\n"
+        "  -s N    step size in encoder counts (20000)\n"
+        "  -v P    overshoot limit, as a fraction of the step (0.05)\n"
+        "  -b N    settle band in encoder counts (20)\n"
+        "  -t S    longest a step may take (2)\n"
+        "  -n N    number of trials (24)\n"
+        "  -m      measure one step with the current gains, don't tune\n"
+        "  -o FILE save the controller settings to FILE afterwards\n"
+        "  -d      debug output\n", name);
+}
+
+static void print_trial(const char *what, const APT_TUNE_TRIAL *t) {
+    printf("%-6s Prop %5ld Int %5ld Deriv %5ld   rise %7.1f ms   overshoot %5.1f%%   settle ",
+            what, t->lProp, t->lInt, t->lDeriv, t->dRiseTime * 1e3, t->dOvershoot * 100);
+    if (t->dSettleTime < 0) printf("    never\n");
+    else printf("%7.1f ms\n", t->dSettleTime * 1e3);
+}
+
+int main(int argc, char **argv) {
+    APT_TUNE_OPTIONS o = {20000, 0.05f, 20, 2.0, 24};
+    APT_TUNE_RESULT r;
+    const char *szSave = NULL;
+    double rise, over, settle;
+    long lSerialNum = 0, ret, k;
+    int opt, measure = 0, debug = 0;
+
+    while ((opt = getopt(argc, argv, "s:v:b:t:n:mo:dh")) != -1) {
+        switch (opt) {
+            case 's': o.fStep = (float)atof(optarg); break;
+            case 'v': o.fMaxOvershoot = (float)atof(optarg); break;
+            case 'b': o.fSettleBand = (float)atof(optarg); break;
+            case 't': o.dMaxStepTime = atof(optarg); break;
+            case 'n': o.lMaxTrials = atol(optarg); break;
+            case 'm': measure = 1; break;
+            case 'o': szSave = optarg; break;
+            case 'd': debug = 1; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind < argc) lSerialNum = atol(argv[optind]);
+    SetDebug(debug);
+
+#ifdef APTTUNE_SIM
+    soaksim_init(3, 1);
+    soaksim_set_plant(1);
+    if (lSerialNum == 0) lSerialNum = soaksim_serial(0);
+#endif
+    if (lSerialNum == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if ((ret = APTInit()) != 0 || (ret = InitHWDevice(lSerialNum)) != 0) {
+        fprintf(stderr, "apttune: can't open %ld (%ld)\n", lSerialNum, ret);
+        return 1;
+    }
+
+    if (measure) {
+        for (k = 0; k < 2; k++) {
+            if ((ret = APT_MeasureStep(lSerialNum, k ? -o.fStep : o.fStep, &o, &rise, &over, &settle)) != 0) break;
+            printf("step %+.0f: rise %.1f ms, overshoot %.1f%%, settle ", k ? -o.fStep : o.fStep, rise * 1e3, over * 100);
+            if (settle < 0) printf("never\n");
+            else printf("%.1f ms\n", settle * 1e3);
+        }
+    } else {
+        ret = APT_TunePID(lSerialNum, &o, &r);
+        for (k = 0; k < r.lNumTrials && k < APT_TUNE_MAX_TRIALS; k++)
+            print_trial(k == 0 ? "start" : "trial", &r.Trials[k]);
+        if (r.lNumTrials > 0) {
+            print_trial("best", &r.Best);
+            printf("gains  Prop %ld Int %ld Deriv %ld IntLimit %ld\n", r.lProp, r.lInt, r.lDeriv, r.lIntLimit);
+        }
+        if (ret == ERANGE) printf("apttune: no gains met the overshoot limit, kept the ones it had\n");
+    }
+    if (ret == 0 && szSave != NULL) ret = APT_SaveConfig(lSerialNum, szSave, APT_CONFIG_TEXT);
+    if (ret != 0) fprintf(stderr, "apttune: failed (%ld)\n", ret);
+
+    APTCleanUp();
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Device capability table, see APT_GetDeviceCaps in libapt.h.
+//
+// The first two digits of a serial number tell the controller family, and
+// the family tells how it is addressed and which messages it answers. A
+// controller that doesn't know a message simply ignores it, so asking
+// anyway costs a full reply timeout; the table lets the callers skip those.
+// Rows with a serial prefix of 0 are only found by hardware type, either
+// the HWTYPE_ value or the type the controller reports in MGMSG_HW_GET_INFO.
+
+#include "libapt_private.h"
+
+// DC servo controllers count time in 2048 / 6 MHz sampling intervals,
+// velocities and accelerations are scaled by 65536, the jerk by 2^32
+#define DC_T        (2048.0 / 6e6)
+#define DC_VEL      (DC_T * 65536.0)
+#define DC_ACCN     (DC_T * DC_T * 65536.0)
+#define DC_JERK     (DC_T * DC_T * DC_T * 4294967296.0)
+
+// brushless DC controllers sample every 102.4 us
+#define BBD_T       102.4e-6
+#define BBD_VEL     (BBD_T * 65536.0)
+#define BBD_ACCN    (BBD_T * BBD_T * 65536.0)
+#define BBD_JERK    (BBD_T * BBD_T * BBD_T * 4294967296.0)
+
+// the newer stepper controllers (K-Cube, LTS, K10CR1), per microstep
+#define STEP_VEL    53.687091
+#define STEP_ACCN   0.010995
+
+#define MSG_MOTOR       (APT_CAP_VELPARAMS | APT_CAP_BACKLASH | APT_CAP_HOMEPARAMS | APT_CAP_LIMSWITCH)
+#define MSG_STEPPER     MSG_MOTOR
+#define MSG_DCSERVO     (MSG_MOTOR | APT_CAP_DCPID | APT_CAP_DCSTATUS)
+#define MSG_BRUSHLESS   (MSG_MOTOR | APT_CAP_POSITIONLOOP | APT_CAP_CURRENTLOOP | APT_CAP_SETTLEDCURRENTLOOP \
+                        | APT_CAP_MOTOROUTPUT | APT_CAP_TRACKSETTLE | APT_CAP_PROFILEMODE \
+                        | APT_CAP_STAGEAXIS | APT_CAP_DCSTATUS)
+
+// The 94xxxxxx BBD10x motor cards sit behind a 73xxxxxx motherboard and
+// never show up on their own.
+static const APT_DEVICE_CAPS builtin[] = {
+    // prefix, type, model, channels, destination, bays, messages, vel, accn, jerk, counts per unit
+    {20, HWTYPE_BSC001, "BSC001",       1, 0x50, 0, MSG_STEPPER,   0, 0, 0, 0},
+    {25, HWTYPE_BMS001, "BMS001",       1, 0x50, 0, MSG_STEPPER,   0, 0, 0, 0},
+    {26, HWTYPE_KST101, "KST101",       1, 0x50, 0, MSG_STEPPER | APT_CAP_KCUBETRIGGER, STEP_VEL, STEP_ACCN, 0, 0},
+    {27, HWTYPE_KDC101, "KDC101",       1, 0x50, 0, MSG_DCSERVO | APT_CAP_KCUBETRIGGER, DC_VEL, DC_ACCN, 0, 0},
+    {28, HWTYPE_KBD101, "KBD101",       1, 0x50, 0, MSG_BRUSHLESS | APT_CAP_KCUBETRIGGER, BBD_VEL, BBD_ACCN, BBD_JERK, 0},
+    {30, HWTYPE_BSC002, "BSC002",       2, 0x50, 0, MSG_STEPPER,   0, 0, 0, 0},
+    {35, HWTYPE_BMS002, "BMS002",       2, 0x50, 0, MSG_STEPPER,   0, 0, 0, 0},
+    {40, HWTYPE_BSC101, "BSC101",       1, 0x50, 0, MSG_STEPPER,   0, 0, 0, 0},
+    {45, HWTYPE_LTSXXX, "LTS150/300",   1, 0x50, 0, MSG_STEPPER,   STEP_VEL, STEP_ACCN, 0, 409600.0},
+    {55, HWTYPE_K10CR1, "K10CR1",       1, 0x50, 0, MSG_STEPPER,   STEP_VEL, STEP_ACCN, 0, 136533.33},
+    {60, HWTYPE_OST001, "OST001",       1, 0x50, 0, MSG_STEPPER,   0, 0, 0, 0},
+    {63, HWTYPE_ODC001, "ODC001",       1, 0x50, 0, MSG_DCSERVO,   DC_VEL, DC_ACCN, 0, 0},
+    {67, HWTYPE_TBD001, "TBD001",       1, 0x50, 0, MSG_BRUSHLESS, BBD_VEL, BBD_ACCN, BBD_JERK, 0},
+    {70, HWTYPE_SCC001, "BSC102/103",   3, 0x11, 3, MSG_STEPPER,   0, 0, 0, 0},
+    {73, HWTYPE_BBD10X, "BBD102/103",   3, 0x11, 3, MSG_BRUSHLESS | APT_CAP_JOYSTICK | APT_CAP_TRIGGER, BBD_VEL, BBD_ACCN, BBD_JERK, 0},
+    {80, HWTYPE_TST001, "TST001",       1, 0x50, 0, MSG_STEPPER,   0, 0, 0, 0},
+    {83, HWTYPE_TDC001, "TDC001",       1, 0x50, 0, MSG_DCSERVO,   DC_VEL, DC_ACCN, 0, 0},
+    {0,  HWTYPE_BDC101, "BDC101",       1, 0x50, 0, MSG_DCSERVO,   DC_VEL, DC_ACCN, 0, 0},
+    {0,  HWTYPE_MST601, "MST601",       2, 0x11, 2, MSG_STEPPER,   0, 0, 0, 0},
+    {0,  HWTYPE_L490MZ, "L490MZ",       1, 0x50, 0, MSG_STEPPER,   0, 0, 0, 0},
+};
+
+// anything else: ask for everything, as if the table wasn't there
+static const APT_DEVICE_CAPS unknown = {0, 0, "unknown", 1, 0x50, 0, APT_CAP_ALL, 0, 0, 0, 0};
+
+// rows added with APT_AddDeviceCaps, looked up before the built in ones
+#define CAPS_USER_MAX   16
+static APT_DEVICE_CAPS user[CAPS_USER_MAX];
+static int numUser = 0;
+
+// Finds the row for a serial number prefix, or failing that a hardware
+// type (0 for none). Never returns NULL.
+static const APT_DEVICE_CAPS *caps_find(long lPrefix, long lHWType) {
+    unsigned long k;
+    int u;
+
+    for (u = numUser - 1; u >= 0; u--)
+        if (user[u].lSerialPrefix != 0 && user[u].lSerialPrefix == lPrefix) return &user[u];
+    for (k = 0; k < sizeof(builtin) / sizeof(builtin[0]); k++)
+        if (builtin[k].lSerialPrefix != 0 && builtin[k].lSerialPrefix == lPrefix) return &builtin[k];
+
+    if (lHWType == 0) return &unknown;
+    for (u = numUser - 1; u >= 0; u--)
+        if (user[u].lHWType == lHWType) return &user[u];
+    for (k = 0; k < sizeof(builtin) / sizeof(builtin[0]); k++)
+        if (builtin[k].lHWType == lHWType) return &builtin[k];
+    return &unknown;
+}
+
+static void caps_apply(long i, const APT_DEVICE_CAPS *caps) {
+    aptInfo[i].Caps = caps;
+    aptInfo[i].Type = caps->lHWType;
+    aptInfo[i].DestinationByte = (char)caps->lDestByte;
+    if (caps->lNumBays > 0) aptInfo[i].DestinationByte = (char)caps_dest(i, aptInfo[i].ChannelId);
+}
+
+// Sets up aptInfo[i] from its serial number. Returns ENODEV if the family
+// isn't in the table, the device is still usable as an unknown one.
+long caps_init(long i) {
+    caps_apply(i, caps_find(aptInfo[i].SerialNumber / 1000000, 0));
+    return aptInfo[i].Caps == &unknown ? ENODEV : 0;
+}
+
+// Second chance for an unknown family once MGMSG_HW_GET_INFO has told us
+// the hardware type.
+void caps_refine(long i) {
+    const APT_DEVICE_CAPS *caps;
+
+    if (aptInfo[i].Caps != &unknown) return;
+    caps = caps_find(0, aptInfo[i].HardwareType);
+    if (caps == &unknown) return;
+
+    if (DEBUG) printf("Device %ld is a %s (hardware type %ld)\n",
+            aptInfo[i].SerialNumber, caps->szModel, aptInfo[i].HardwareType);
+    caps_apply(i, caps);
+}
+
+long caps_has(long i, unsigned long ulCap) {
+    return (aptInfo[i].Caps->ulMessages & ulCap) != 0;
+}
+
+// Destination byte for a channel: the controller itself, or the bay the
+// channel sits in (channels 0 and 1 are both the first bay).
+long caps_dest(long i, long lChanID) {
+    if (aptInfo[i].Caps->lNumBays <= 0) return aptInfo[i].Caps->lDestByte;
+    if (lChanID > 0) lChanID--;
+    if (lChanID >= aptInfo[i].Caps->lNumBays) lChanID = aptInfo[i].Caps->lNumBays - 1;
+    return 0x21 + lChanID;
+}
+
+// Channel ident to send to a channel: a bay card has only the one
+// channel, 1, whichever bay of the rack it sits in.
+long caps_chan_ident(long i, long lChanID) {
+    if (aptInfo[i].Caps->lNumBays > 0) return 1;
+    return lChanID;
+}
+
+// Channel ident to send with the current channel.
+long caps_ident(long i) {
+    return caps_chan_ident(i, aptInfo[i].ChannelId);
+}
+
+
+long WINAPI APT_GetDeviceCaps(long lSerialNum, APT_DEVICE_CAPS *pCaps) {
+    long i;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    memcpy(pCaps, aptInfo[i].Caps, sizeof(APT_DEVICE_CAPS));
+    return 0;
+}
+
+long WINAPI APT_AddDeviceCaps(const APT_DEVICE_CAPS *pCaps) {
+    long i;
+    int u;
+
+    if (pCaps->lSerialPrefix == 0 && pCaps->lHWType == 0) return EINVAL;
+    if (pCaps->lNumChannels < 1 || pCaps->lNumBays < 0) return EINVAL;
+
+    // same key again replaces the row
+    for (u = 0; u < numUser; u++)
+        if (user[u].lSerialPrefix == pCaps->lSerialPrefix && user[u].lHWType == pCaps->lHWType) break;
+    if (u == CAPS_USER_MAX) return ENOMEM;
+    memcpy(&user[u], pCaps, sizeof(APT_DEVICE_CAPS));
+    user[u].szModel[sizeof(user[u].szModel) - 1] = 0;
+    if (u == numUser) numUser++;
+
+    for (i = 0; i < numDevs; i++) {
+        caps_init(i);
+        caps_refine(i);
+    }
+    return 0;
+}
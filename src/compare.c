@@ -0,0 +1,392 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Position compare, see APT_CompareRun in libapt.h.
+//
+// The controllers don't tell us when they pass a position, so the axes'
+// status is asked for over and over, all the axes in one write, with the
+// controller kept open, much as inpos.c does for one channel. Each round
+// is one sample, taken at the middle of its round trip. A point counts as
+// crossed once two samples in a row lie on either side of it (or either of
+// them on it), and the crossing time is interpolated between the two. The
+// points the first sample has already reached, going the way the axis
+// moves, count as crossed then.
+//
+// The K-Cubes can also pulse their TRIG1 output at equally spaced
+// positions on their own (MGMSG_MOT_SET_KCUBEPOSTRIGPARAMS), which is as
+// close to the encoder as it gets. MGMSG_MOT_SET_TRIGGER, which is all the
+// older controllers have, only ties the trigger output to the state of a
+// move (in motion, complete, at speed) and not to a position, so they only
+// get the status samples.
+
+#include "libapt_private.h"
+
+#include <math.h>
+#include <stdatomic.h>
+
+//MGMSG_MOT_SET_KCUBETRIGIOCONFIG, MGMSG_MOT_REQ_KCUBETRIGIOCONFIG, MGMSG_MOT_GET_KCUBETRIGIOCONFIG
+#define MSG_SET_TRIGIO      0x0523
+#define MSG_REQ_TRIGIO      0x0524
+#define MSG_GET_TRIGIO      0x0525
+//MGMSG_MOT_SET_KCUBEPOSTRIGPARAMS
+#define MSG_SET_POSTRIG     0x0526
+
+//TRIG1 modes and polarity
+#define TRIGOUT_ATPOS_FWD   0x0D
+#define TRIGOUT_ATPOS_REV   0x0E
+#define TRIG_HIGH           0x01
+
+//how long the status may go unanswered before we give up (ms)
+#define SILENCE_TIMEOUT     MOVE_TIMEOUT
+
+typedef struct {
+    float *Points;              // NULL for equally spaced ones
+    float Start;
+    float Interval;
+    long NumPoints;
+    long PulseWidth;            // us, 0 for no trigger output
+    long Hardware;              // the trigger output is programmed
+    long Next;                  // the next point to cross
+    long Dir;                   // the way the points go, 1, -1 or 0 for one point
+    float Target;               // of the move APT_CompareRun started
+    long HasTarget;
+
+    //the previous sample
+    float Prev;
+    double PrevTime;
+    long PrevValid;
+
+    APT_COMPARE_STATS Stats;
+    double LatencySum;
+    double LatencySq;
+    double ErrorSum;
+} COMPARE_AXIS;
+
+static COMPARE_AXIS cmp[APT_MAX_AXES];
+
+// the event queue, APT_CompareRun pushes, APT_ComparePoll pops
+static APT_COMPARE_EVENT queue[APT_COMPARE_QUEUE];
+static _Atomic unsigned long queueHead, queueTail;
+
+static float point(const COMPARE_AXIS *c, long k) {
+    return c->Points != NULL ? c->Points[k] : c->Start + k * c->Interval;
+}
+
+static void compare_clear(COMPARE_AXIS *c) {
+    free(c->Points);
+    memset(c, 0, sizeof(COMPARE_AXIS));
+}
+
+static long queue_push(const APT_COMPARE_EVENT *e) {
+    unsigned long head = atomic_load_explicit(&queueHead, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&queueTail, memory_order_acquire);
+
+    if (head - tail >= APT_COMPARE_QUEUE) return -1;
+    queue[head % APT_COMPARE_QUEUE] = *e;
+    atomic_store_explicit(&queueHead, head + 1, memory_order_release);
+    return 0;
+}
+
+// Programs TRIG1 of a K-Cube to pulse at the equally spaced points. The
+// TRIG2 settings are read first and kept as they are.
+static long program_trigger(long lAxis, const COMPARE_AXIS *c) {
+    char txbuf[40], rxbuf[32], dest, ident;
+    int16_t io[5] = {0};
+    int32_t par[8] = {0};
+    long ret;
+
+    axis_address(lAxis, &dest, &ident);
+
+    //MGMSG_MOT_REQ_KCUBETRIGIOCONFIG
+    txbuf[0] = MSG_REQ_TRIGIO & 0xFF;
+    txbuf[1] = MSG_REQ_TRIGIO >> 8;
+    txbuf[2] = ident;
+    txbuf[3] = 0x00;
+    txbuf[4] = dest;
+    txbuf[5] = 0x01;
+    if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) return ret;
+    while ((ret = read_frame(rxbuf, sizeof(rxbuf), 100)) > 0) {
+        if (rxbuf[0] != (MSG_GET_TRIGIO & 0xFF) || rxbuf[1] != (MSG_GET_TRIGIO >> 8) || ret < 16) continue;
+        memcpy(io, rxbuf + 6, 10);
+        break;
+    }
+    if (ret < 0) return ret;
+
+    //MGMSG_MOT_SET_KCUBETRIGIOCONFIG: chan, TRIG1 mode and polarity, TRIG2 mode and polarity, 12 reserved
+    io[0] = ident;
+    io[1] = c->Interval >= 0 ? TRIGOUT_ATPOS_FWD : TRIGOUT_ATPOS_REV;
+    io[2] = TRIG_HIGH;
+    memset(txbuf, 0, sizeof(txbuf));
+    txbuf[0] = MSG_SET_TRIGIO & 0xFF;
+    txbuf[1] = MSG_SET_TRIGIO >> 8;
+    txbuf[2] = 22;
+    txbuf[3] = 0x00;
+    txbuf[4] = dest | 0x80;
+    txbuf[5] = 0x01;
+    memcpy(txbuf+6,(char *)io,10);
+    if (DEBUG) hexDump("program_trigger txbuf",txbuf,28);
+    if ((ret = ftdi_write_data(ftdic, txbuf, 28)) < 0) return ret;
+
+    //MGMSG_MOT_SET_KCUBEPOSTRIGPARAMS: start, interval and count forward then
+    //reverse, the pulse width and the number of cycles
+    par[c->Interval >= 0 ? 0 : 3] = (int32_t)c->Start;
+    par[c->Interval >= 0 ? 1 : 4] = (int32_t)fabs(c->Interval);
+    par[c->Interval >= 0 ? 2 : 5] = (int32_t)c->NumPoints;
+    par[6] = (int32_t)c->PulseWidth;
+    par[7] = 1;
+    txbuf[0] = MSG_SET_POSTRIG & 0xFF;
+    txbuf[1] = MSG_SET_POSTRIG >> 8;
+    txbuf[2] = 34;
+    txbuf[3] = 0x00;
+    txbuf[4] = dest | 0x80;
+    txbuf[5] = 0x01;
+    memcpy(txbuf+6,(char *)(&io[0]),2);
+    memcpy(txbuf+8,(char *)par,32);
+    if (DEBUG) hexDump("program_trigger txbuf",txbuf,40);
+    if ((ret = ftdi_write_data(ftdic, txbuf, 40)) < 0) return ret;
+    return 0;
+}
+
+// Delivers the event for the next point of an axis, crossed at dCrossing
+// and seen at t. Returns the callback's non zero value.
+static long compare_fire(long lAxis, float fPos, double dCrossing, double t, APT_COMPARECALLBACK pfnCallback, void *pUserData) {
+    COMPARE_AXIS *c = &cmp[lAxis];
+    APT_COMPARE_EVENT e;
+    double lat, err;
+
+    e.lAxis = lAxis;
+    e.lPoint = c->Next;
+    e.fTarget = point(c, c->Next);
+    e.fPosition = fPos;
+    e.dCrossing = dCrossing;
+    e.dDetected = t;
+    e.lHardware = c->Hardware;
+    c->Next++;
+
+    lat = e.dDetected - e.dCrossing;
+    err = fabs(e.fPosition - e.fTarget);
+    c->Stats.lNumCrossed++;
+    c->LatencySum += lat;
+    c->LatencySq += lat * lat;
+    c->ErrorSum += err;
+    if (lat > c->Stats.dMaxLatency) c->Stats.dMaxLatency = lat;
+    if (err > c->Stats.fMaxError) c->Stats.fMaxError = (float)err;
+
+    if (queue_push(&e) != 0) c->Stats.lDropped++;
+    return pfnCallback != NULL ? pfnCallback(&e, pUserData) : 0;
+}
+
+// Checks a new sample of an axis against its next points, delivering an
+// event for each one crossed. Returns the callback's non zero value.
+static long compare_sample(long lAxis, float fPos, double t, APT_COMPARECALLBACK pfnCallback, void *pUserData) {
+    COMPARE_AXIS *c = &cmp[lAxis];
+    double p;
+    long dir, ret;
+
+    //the first sample: the points it's on or already past
+    if (!c->PrevValid) {
+        dir = c->Dir;
+        if (c->HasTarget && c->Target != fPos) dir = c->Target > fPos ? 1 : -1;
+        while (c->Next < c->NumPoints) {
+            p = point(c, c->Next);
+            if (p != fPos && (dir == 0 || (p - fPos) * dir > 0)) break;
+            if ((ret = compare_fire(lAxis, fPos, t, t, pfnCallback, pUserData)) != 0) return ret;
+        }
+    }
+
+    while (c->PrevValid && c->Next < c->NumPoints) {
+        p = point(c, c->Next);
+        if ((c->Prev - p) * (fPos - p) > 0) break;
+
+        //on the point at the previous sample, or at this one
+        if (c->Prev == p)
+            ret = compare_fire(lAxis, fPos, c->PrevTime, t, pfnCallback, pUserData);
+        else
+            ret = compare_fire(lAxis, fPos, c->PrevTime + (p - c->Prev) / (fPos - c->Prev) * (t - c->PrevTime), t, pfnCallback, pUserData);
+        if (ret != 0) return ret;
+    }
+    c->Prev = fPos;
+    c->PrevTime = t;
+    c->PrevValid = 1;
+    return 0;
+}
+
+
+long WINAPI APT_CompareSetPoints(long lAxis, long lNumPoints, const float *pfPoints) {
+    long i, ret;
+
+    if ((ret = axis_check(1, &lAxis, &i)) != 0) return ret;
+    if (lNumPoints < 1) return EINVAL;
+
+    compare_clear(&cmp[lAxis]);
+    if ((cmp[lAxis].Points = malloc(lNumPoints * sizeof(float))) == NULL) return ENOMEM;
+    memcpy(cmp[lAxis].Points, pfPoints, lNumPoints * sizeof(float));
+    cmp[lAxis].NumPoints = lNumPoints;
+    return 0;
+}
+
+long WINAPI APT_CompareSetInterval(long lAxis, float fStart, float fInterval, long lNumPoints, long lPulseWidthUs) {
+    long i, ret;
+
+    if ((ret = axis_check(1, &lAxis, &i)) != 0) return ret;
+    if (lNumPoints < 1 || fInterval == 0 || lPulseWidthUs < 0) return EINVAL;
+
+    compare_clear(&cmp[lAxis]);
+    cmp[lAxis].Start = fStart;
+    cmp[lAxis].Interval = fInterval;
+    cmp[lAxis].NumPoints = lNumPoints;
+    cmp[lAxis].PulseWidth = lPulseWidthUs;
+    return 0;
+}
+
+long WINAPI APT_CompareClear(long lAxis) {
+    if (lAxis < 0 || lAxis >= APT_MAX_AXES) return EINVAL;
+    compare_clear(&cmp[lAxis]);
+    return 0;
+}
+
+long WINAPI APT_CompareRun(long lNumAxes, const long *plAxes, const float *pfTargets,
+        APT_COMPARECALLBACK pfnCallback, void *pUserData) {
+    unsigned long bits[APT_MAX_AXES];
+    float pos[APT_MAX_AXES];
+    char txbuf[APT_MAX_AXES * 12], dest, ident;
+    long i, k, len = 0, ret, moving, left;
+    double t0, t1, lastReply;
+    int16_t val16;
+    int32_t val32;
+    COMPARE_AXIS *c;
+
+    if ((ret = axis_check(lNumAxes, plAxes, &i)) != 0) return ret;
+
+    for (k = 0; k < lNumAxes; k++) {
+        c = &cmp[plAxes[k]];
+        c->Next = 0;
+        c->PrevValid = 0;
+        c->Dir = point(c, c->NumPoints - 1) > point(c, 0) ? 1 : point(c, c->NumPoints - 1) < point(c, 0) ? -1 : 0;
+        c->HasTarget = pfTargets != NULL;
+        if (pfTargets != NULL) c->Target = pfTargets[k];
+        c->Hardware = 0;
+        c->LatencySum = c->LatencySq = c->ErrorSum = 0;
+        memset(&c->Stats, 0, sizeof(APT_COMPARE_STATS));
+        c->Stats.lNumPoints = c->NumPoints;
+    }
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+
+    //the trigger outputs first, they have to be ready before the stage moves
+    for (k = 0; k < lNumAxes; k++) {
+        c = &cmp[plAxes[k]];
+        if (c->Points != NULL || c->PulseWidth == 0 || !caps_has(i, APT_CAP_KCUBETRIGGER)) continue;
+        if ((ret = program_trigger(plAxes[k], c)) < 0) goto end;
+        c->Hardware = c->Stats.lHardware = 1;
+    }
+
+    //MGMSG_MOT_MOVE_ABSOLUTE, all the axes in one write
+    if (pfTargets != NULL) {
+        for (k = 0; k < lNumAxes; k++, len += 12) {
+            axis_address(plAxes[k], &dest, &ident);
+            txbuf[len] = 0x53;
+            txbuf[len+1] = 0x04;
+            txbuf[len+2] = 0x06;
+            txbuf[len+3] = 0x00;
+            txbuf[len+4] = dest | 0x80;
+            txbuf[len+5] = 0x01;
+            val16 = ident;
+            memcpy(txbuf+len+6,(char *)(&val16),2);
+            val32 = (int32_t)pfTargets[k];
+            memcpy(txbuf+len+8,(char *)(&val32),4);
+        }
+        if (DEBUG) hexDump("APT_CompareRun txbuf", txbuf, len);
+        if ((ret = ftdi_write_data(ftdic, txbuf, len)) < 0) goto end;
+    }
+
+    lastReply = apt_time();
+    while (1) {
+        t0 = apt_time();
+        ret = axis_status(lNumAxes, plAxes, i, bits, pos);
+        t1 = apt_time();
+        if (ret < 0) break;
+        if (ret != 0) {
+            if (deadline_check() != 0) {
+                ret = deadline_check();
+                break;
+            }
+            if ((t1 - lastReply) * 1e3 > SILENCE_TIMEOUT) break;
+            continue;
+        }
+        lastReply = t1;
+
+        for (k = 0, moving = 0, left = 0; k < lNumAxes; k++) {
+            if ((ret = compare_sample(plAxes[k], pos[k], (t0 + t1) / 2, pfnCallback, pUserData)) != 0) break;
+            if (bits[k] & APT_STATUS_MOVING) moving = 1;
+            left += cmp[plAxes[k]].NumPoints - cmp[plAxes[k]].Next;
+        }
+        if (ret != 0) break;
+        if (left == 0) break;
+
+        //stopped short of the points that are left
+        if (!moving) {
+            ret = ERANGE;
+            break;
+        }
+        if ((ret = deadline_check()) != 0) break;
+    }
+
+    //stop the stages rather than leave them going when we gave up on them
+    if (ret != 0 && ret != ERANGE && ret != ETIMEDOUT) {
+        for (k = 0, len = 0; k < lNumAxes; k++, len += 6) {
+            axis_address(plAxes[k], &dest, &ident);
+            txbuf[len] = 0x65;
+            txbuf[len+1] = 0x04;
+            txbuf[len+2] = ident;
+            txbuf[len+3] = 0x02;
+            txbuf[len+4] = dest;
+            txbuf[len+5] = 0x01;
+        }
+        ftdic->usb_write_timeout = MOVE_TIMEOUT;
+        ftdi_write_data(ftdic, txbuf, len);
+    }
+
+    for (k = 0; k < lNumAxes; k++) {
+        c = &cmp[plAxes[k]];
+        if (c->Stats.lNumCrossed == 0) continue;
+        c->Stats.dMeanLatency = c->LatencySum / c->Stats.lNumCrossed;
+        c->Stats.dJitter = sqrt(fmax(0, c->LatencySq / c->Stats.lNumCrossed - c->Stats.dMeanLatency * c->Stats.dMeanLatency));
+        c->Stats.fMeanError = (float)(c->ErrorSum / c->Stats.lNumCrossed);
+    }
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+long WINAPI APT_ComparePoll(APT_COMPARE_EVENT *pEvent) {
+    unsigned long tail = atomic_load_explicit(&queueTail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&queueHead, memory_order_acquire);
+
+    if (head == tail) return EAGAIN;
+    *pEvent = queue[tail % APT_COMPARE_QUEUE];
+    atomic_store_explicit(&queueTail, tail + 1, memory_order_release);
+    return 0;
+}
+
+long WINAPI APT_CompareGetStats(long lAxis, APT_COMPARE_STATS *pStats) {
+    if (lAxis < 0 || lAxis >= APT_MAX_AXES) return EINVAL;
+    memcpy(pStats, &cmp[lAxis].Stats, sizeof(APT_COMPARE_STATS));
+    return 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Deadlines and cancellation, see APT_SetDeadline in libapt.h.
+//
+// The deadline and cancellation flag live in a per thread context rather
+// than being passed down every call: ftdi_open_apt_serialnum caps the
+// libusb timeouts to what's left, read_reply stops polling when the time is
+// up or the flag is raised, and the moves send MGMSG_MOT_MOVE_STOP when
+// cancelled. Whichever stage ran out records ETIMEDOUT or ECANCELED in the
+// context, which is what the *Dl functions then return.
+
+#include "libapt_private.h"
+
+#include <limits.h>
+#include <math.h>
+
+#ifdef _MSC_VER
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL __thread
+#endif
+
+static THREAD_LOCAL DEADLINE ctx = {0, NULL, 0};
+
+// Returns 0, or ETIMEDOUT / ECANCELED once the current call is out of time.
+long deadline_check(void) {
+    if (ctx.status != 0) return ctx.status;
+    if (ctx.cancel != NULL && *ctx.cancel != 0)
+        ctx.status = ECANCELED;
+    else if (ctx.deadline > 0 && apt_time() >= ctx.deadline)
+        ctx.status = ETIMEDOUT;
+    return ctx.status;
+}
+
+// What's left of the budget in ms (LONG_MAX without a deadline).
+long deadline_remaining_ms(void) {
+    double ms;
+
+    if (ctx.deadline <= 0) return LONG_MAX;
+    ms = (ctx.deadline - apt_time()) * 1e3;
+    if (ms <= 0) return 0;
+    return ms < LONG_MAX ? (long)ceil(ms) : LONG_MAX;
+}
+
+void deadline_push(double dDeadline, volatile long *plCancel, DEADLINE *saved) {
+    memcpy(saved, &ctx, sizeof(DEADLINE));
+
+    // a nested call can only shorten the outer deadline
+    if (dDeadline > 0 && (ctx.deadline <= 0 || dDeadline < ctx.deadline))
+        ctx.deadline = dDeadline;
+    if (plCancel != NULL)
+        ctx.cancel = plCancel;
+    ctx.status = 0;
+}
+
+long deadline_pop(DEADLINE *saved, long ret) {
+    long status = ctx.status;
+
+    // an outer deadline or flag is spent too, but a context without either
+    // (the thread's own, between calls) must not keep the inner one's status
+    memcpy(&ctx, saved, sizeof(DEADLINE));
+    if (ctx.status == 0 && (ctx.deadline > 0 || ctx.cancel != NULL)) ctx.status = status;
+    return status != 0 ? status : ret;
+}
+
+// Lifts the deadline and flag until deadline_pop(saved), for what has to go
+// out whatever they say (stopping the moves of a cancelled wait).
+void deadline_suspend(DEADLINE *saved) {
+    memcpy(saved, &ctx, sizeof(DEADLINE));
+    memset(&ctx, 0, sizeof(DEADLINE));
+}
+
+
+double WINAPI APT_Now(void) {
+    return apt_time();
+}
+
+long WINAPI APT_SetDeadline(double dDeadline, volatile long *plCancel) {
+    ctx.deadline = dDeadline;
+    ctx.cancel = plCancel;
+    ctx.status = 0;
+    return 0;
+}
+
+long WINAPI APT_GetDeadlineStatus(void) {
+    return ctx.status;
+}
+
+long WINAPI InitHWDeviceDl(long lSerialNum, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, InitHWDevice(lSerialNum));
+}
+
+long WINAPI GetHWInfoDl(long lSerialNum, TCHAR *szModel, long lModelLen, TCHAR *szSWVer, long lSWVerLen, TCHAR *szHWNotes, long lHWNotesLen, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, GetHWInfo(lSerialNum, szModel, lModelLen, szSWVer, lSWVerLen, szHWNotes, lHWNotesLen));
+}
+
+long WINAPI MOT_IdentifyDl(long lSerialNum, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_Identify(lSerialNum));
+}
+
+long WINAPI MOT_EnableHWChannelDl(long lSerialNum, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_EnableHWChannel(lSerialNum));
+}
+
+long WINAPI MOT_DisableHWChannelDl(long lSerialNum, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_DisableHWChannel(lSerialNum));
+}
+
+long WINAPI MOT_SetVelParamsDl(long lSerialNum, float fMinVel, float fAccn, float fMaxVel, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetVelParams(lSerialNum, fMinVel, fAccn, fMaxVel));
+}
+
+long WINAPI MOT_GetVelParamsDl(long lSerialNum, float *pfMinVel, float *pfAccn, float *pfMaxVel, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetVelParams(lSerialNum, pfMinVel, pfAccn, pfMaxVel));
+}
+
+long WINAPI MOT_SetHomeParamsDl(long lSerialNum, long lDirection, long lLimSwitch, float fHomeVel, float fZeroOffset, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetHomeParams(lSerialNum, lDirection, lLimSwitch, fHomeVel, fZeroOffset));
+}
+
+long WINAPI MOT_GetHomeParamsDl(long lSerialNum, long *plDirection, long *plLimSwitch, float *pfHomeVel, float *pfZeroOffset, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetHomeParams(lSerialNum, plDirection, plLimSwitch, pfHomeVel, pfZeroOffset));
+}
+
+long WINAPI MOT_SetBLashDistDl(long lSerialNum, float fBLashDist, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetBLashDist(lSerialNum, fBLashDist));
+}
+
+long WINAPI MOT_GetBLashDistDl(long lSerialNum, float *pfBLashDist, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetBLashDist(lSerialNum, pfBLashDist));
+}
+
+long WINAPI MOT_GetStageAxisInfoDl(long lSerialNum, float *pfMinPos, float *pfMaxPos, long *plUnits, float *pfPitch, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetStageAxisInfo(lSerialNum, pfMinPos, pfMaxPos, plUnits, pfPitch));
+}
+
+long WINAPI MOT_SetHWLimSwitchesDl(long lSerialNum, long lRevLimSwitch, long lFwdLimSwitch, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetHWLimSwitches(lSerialNum, lRevLimSwitch, lFwdLimSwitch));
+}
+
+long WINAPI MOT_GetHWLimSwitchesDl(long lSerialNum, long *plRevLimSwitch, long *plFwdLimSwitch, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetHWLimSwitches(lSerialNum, plRevLimSwitch, plFwdLimSwitch));
+}
+
+long WINAPI MOT_SetPIDParamsDl(long lSerialNum, long lProp, long lInt, long lDeriv, long lIntLimit, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetPIDParams(lSerialNum, lProp, lInt, lDeriv, lIntLimit));
+}
+
+long WINAPI MOT_GetPIDParamsDl(long lSerialNum, long *plProp, long *plInt, long *plDeriv, long *plIntLimit, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetPIDParams(lSerialNum, plProp, plInt, plDeriv, plIntLimit));
+}
+
+long WINAPI MOT_GetPositionDl(long lSerialNum, float *pfPosition, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetPosition(lSerialNum, pfPosition));
+}
+
+long WINAPI MOT_MoveHomeDl(long lSerialNum, BOOL bWait, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_MoveHome(lSerialNum, bWait));
+}
+
+long WINAPI MOT_MoveRelativeExDl(long lSerialNum, float fRelDist, BOOL bWait, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_MoveRelativeEx(lSerialNum, fRelDist, bWait));
+}
+
+long WINAPI MOT_MoveAbsoluteExDl(long lSerialNum, float fAbsPos, BOOL bWait, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_MoveAbsoluteEx(lSerialNum, fAbsPos, bWait));
+}
+
+long WINAPI MOT_StopProfiledDl(long lSerialNum, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_StopProfiled(lSerialNum));
+}
+
+long WINAPI MOT_SetDCCurrentLoopParamsDl(long lSerialNum, long lProp, long lInt, long lIntLim, long lIntDeadBand, long lFFwd, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetDCCurrentLoopParams(lSerialNum, lProp, lInt, lIntLim, lIntDeadBand, lFFwd));
+}
+
+long WINAPI MOT_GetDCCurrentLoopParamsDl(long lSerialNum, long *plProp, long *plInt, long *plIntLim, long *plIntDeadBand, long *plFFwd, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetDCCurrentLoopParams(lSerialNum, plProp, plInt, plIntLim, plIntDeadBand, plFFwd));
+}
+
+long WINAPI MOT_SetDCPositionLoopParamsDl(long lSerialNum, long lProp, long lInt, long lIntLim, long lDeriv, long lDerivTime, long lLoopGain, long lVelFFwd, long lAccFFwd, long lPosErrLim, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetDCPositionLoopParams(lSerialNum, lProp, lInt, lIntLim, lDeriv, lDerivTime, lLoopGain, lVelFFwd, lAccFFwd, lPosErrLim));
+}
+
+long WINAPI MOT_GetDCPositionLoopParamsDl(long lSerialNum, long *plProp, long *plInt, long *plIntLim, long *plDeriv, long *plDerivTime, long *plLoopGain, long *plVelFFwd, long *plAccFFwd, long *plPosErrLim, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetDCPositionLoopParams(lSerialNum, plProp, plInt, plIntLim, plDeriv, plDerivTime, plLoopGain, plVelFFwd, plAccFFwd, plPosErrLim));
+}
+
+long WINAPI MOT_SetDCMotorOutputParamsDl(long lSerialNum, float fContCurrLim, float fEnergyLim, float fMotorLim, float fMotorBias, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetDCMotorOutputParams(lSerialNum, fContCurrLim, fEnergyLim, fMotorLim, fMotorBias));
+}
+
+long WINAPI MOT_GetDCMotorOutputParamsDl(long lSerialNum, float *pfContCurrLim, float *pfEnergyLim, float *pfMotorLim, float *pfMotorBias, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetDCMotorOutputParams(lSerialNum, pfContCurrLim, pfEnergyLim, pfMotorLim, pfMotorBias));
+}
+
+long WINAPI MOT_SetDCTrackSettleParamsDl(long lSerialNum, long lSettleTime, long lSettleWnd, long lTrackWnd, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetDCTrackSettleParams(lSerialNum, lSettleTime, lSettleWnd, lTrackWnd));
+}
+
+long WINAPI MOT_GetDCTrackSettleParamsDl(long lSerialNum, long *plSettleTime, long *plSettleWnd, long *plTrackWnd, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetDCTrackSettleParams(lSerialNum, plSettleTime, plSettleWnd, plTrackWnd));
+}
+
+long WINAPI MOT_SetDCProfileModeParamsDl(long lSerialNum, long lProfMode, float fJerk, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetDCProfileModeParams(lSerialNum, lProfMode, fJerk));
+}
+
+long WINAPI MOT_GetDCProfileModeParamsDl(long lSerialNum, long *plProfMode, float *pfJerk, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetDCProfileModeParams(lSerialNum, plProfMode, pfJerk));
+}
+
+long WINAPI MOT_SetDCJoystickParamsDl(long lSerialNum, float fMaxVelLO, float fMaxVelHI, float fAccnLO, float fAccnHI, long lDirSense, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetDCJoystickParams(lSerialNum, fMaxVelLO, fMaxVelHI, fAccnLO, fAccnHI, lDirSense));
+}
+
+long WINAPI MOT_GetDCJoystickParamsDl(long lSerialNum, float *pfMaxVelLO, float *pfMaxVelHI, float *pfAccnLO, float *pfAccnHI, long *plDirSense, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetDCJoystickParams(lSerialNum, pfMaxVelLO, pfMaxVelHI, pfAccnLO, pfAccnHI, plDirSense));
+}
+
+long WINAPI MOT_SetDCSettledCurrentLoopParamsDl(long lSerialNum, long lSettledProp, long lSettledInt, long lSettledIntLim, long lSettledIntDeadBand, long lSettledFFwd, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_SetDCSettledCurrentLoopParams(lSerialNum, lSettledProp, lSettledInt, lSettledIntLim, lSettledIntDeadBand, lSettledFFwd));
+}
+
+long WINAPI MOT_GetDCSettledCurrentLoopParamsDl(long lSerialNum, long *plSettledProp, long *plSettledInt, long *plSettledIntLim, long *plSettledIntDeadBand, long *plSettledFFwd, double dDeadline, volatile long *plCancel) {
+    DEADLINE saved;
+    deadline_push(dDeadline, plCancel, &saved);
+    return deadline_pop(&saved, MOT_GetDCSettledCurrentLoopParams(lSerialNum, plSettledProp, plSettledInt, plSettledIntLim, plSettledIntDeadBand, plSettledFFwd));
+}
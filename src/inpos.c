@@ -0,0 +1,171 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// In-position moves, see APT_MoveAbsoluteInPos in libapt.h.
+//
+// The controller sends MGMSG_MOT_MOVE_COMPLETED once its own settle
+// criteria (MOT_SetDCTrackSettleParams) are met, which on a stage tuned for
+// accuracy can be a long while after it is close enough for an image.
+// Here the device stays open after the move command and the position
+// counter is streamed back, one request after the other, as fast as the
+// controller answers; the move counts as done as soon as the samples have
+// stayed within the caller's tolerance for the caller's dwell time, the
+// same settle window semantics as the controller's but with per-call
+// values. A MOVE_COMPLETED seen on the way with the stage in tolerance
+// ends the wait too.
+//
+// The controller's own MOVE_COMPLETED, when it comes, is left in the FTDI
+// buffer and purged by the next open.
+
+#include "libapt_private.h"
+
+#include <math.h>
+
+//MGMSG_MOT_REQ_POSCOUNTER, MGMSG_MOT_GET_POSCOUNTER, MGMSG_MOT_MOVE_COMPLETED
+#define MSG_REQ_POSCOUNTER  0x0411
+#define MSG_POSCOUNTER      0x0412
+#define MSG_COMPLETED       0x0464
+#define MSG_STOP            0x0465
+
+// how long to wait for one position reply (ms)
+#define POLL_TIMEOUT        100
+
+// Writes a 6 byte message to the current channel of aptInfo[i].
+long write_short(unsigned short id, long i, char param2) {
+    char txbuf[6];
+
+    txbuf[0] = id & 0xFF;
+    txbuf[1] = id >> 8;
+    txbuf[2] = (char)caps_ident(i);
+    txbuf[3] = param2;
+    txbuf[4] = aptInfo[i].DestinationByte;
+    txbuf[5] = 0x01;
+    return ftdi_write_data(ftdic, txbuf, 6);
+}
+
+// Asks the open device for its position and reads up to the reply, noting
+// a MOVE_COMPLETED on the way. Returns 0, ETIMEDOUT (or the deadline
+// status) or a libftdi error.
+long poll_position(long i, double *pdPos, long *plCompleted) {
+    char rxbuf[32];
+    long ret;
+
+    if ((ret = write_short(MSG_REQ_POSCOUNTER, i, 0)) < 0) return ret;
+    while (1) {
+        if ((ret = read_frame(rxbuf, sizeof(rxbuf), POLL_TIMEOUT)) < 0) return ret;
+        if (ret == 0) return deadline_check() ? deadline_check() : ETIMEDOUT;
+        if (rxbuf[0] == (MSG_COMPLETED & 0xFF) && rxbuf[1] == (MSG_COMPLETED >> 8)) *plCompleted = 1;
+        if (ret >= 12 && rxbuf[0] == (MSG_POSCOUNTER & 0xFF) && rxbuf[1] == (MSG_POSCOUNTER >> 8)) {
+            *pdPos = *(int32_t *)(rxbuf+8);
+            return 0;
+        }
+    }
+}
+
+// Moves (relative or absolute) and waits until in position.
+static long move_inpos(long lSerialNum, float fPos, long bRelative, float fTolerance, float fDwellMs,
+        float *pfSettleMs) {
+    MOTION_LIMITS lim;
+    long i, ret, haveLim, completed = 0;
+    double t0, t, pos, from = 0, to, inBand = -1, until, duration = 0;
+    int16_t val16;
+    int32_t val32;
+    char txbuf[12];
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if (fTolerance < 0 || fDwellMs < 0) return EINVAL;
+
+    // for the timeout: the motion model, with its parameters read now
+    // rather than with the device open (nothing else may open or close it
+    // until we're done)
+    haveLim = motion_limits(lSerialNum, -1, &lim) == 0 && lim.vmax > 0 && lim.accn > 0;
+
+    //MGMSG_MOT_MOVE_RELATIVE or MGMSG_MOT_MOVE_ABSOLUTE
+    txbuf[0] = bRelative ? 0x48 : 0x53;
+    txbuf[1] = 0x04;
+    txbuf[2] = 0x06;
+    txbuf[3] = 0x00;
+    txbuf[4] = aptInfo[i].DestinationByte | 0x80;
+    txbuf[5] = 0x01;
+
+    //copy Chan Ident
+    val16 = (int16_t)caps_ident(i);
+    memcpy(txbuf+6,(char *)(&val16),2);
+    val32 = (int32_t)fPos;
+    memcpy(txbuf+8,(char *)(&val32),4);
+    if (DEBUG) hexDump("move_inpos txbuf",txbuf,12);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+
+    // where from, unless we know
+    if (bRelative || !aptInfo[i].PositionValid) {
+        if ((ret = poll_position(i, &from, &completed)) != 0) goto end;
+    } else
+        from = aptInfo[i].Position;
+    to = bRelative ? from + fPos : fPos;
+
+    aptInfo[i].PositionValid = 0;
+    if (haveLim) duration = motion_predict(i, &lim, fabs(to - from));
+    until = deadline_remaining_ms() == LONG_MAX ? apt_time() + 2 * duration + MOVE_TIMEOUT / 1e3 : 0;
+
+    completed = 0;
+    t0 = apt_time();
+    if ((ret = ftdi_write_data(ftdic, txbuf, 12)) < 0) goto end;
+
+    while (1) {
+        if ((ret = poll_position(i, &pos, &completed)) != 0) {
+            if (ret != ETIMEDOUT || deadline_check() != 0) break;
+        } else {
+            t = apt_time();
+            if (fabs(pos - to) <= fTolerance) {
+                if (inBand < 0) inBand = t;
+                if (completed || (t - inBand) * 1e3 >= fDwellMs) {
+                    if (pfSettleMs != NULL) *pfSettleMs = (float)((t - t0) * 1e3);
+                    aptInfo[i].Position = (float)pos;
+                    aptInfo[i].PositionValid = 1;
+                    break;
+                }
+            } else
+                inBand = -1;
+        }
+        if (until > 0 && apt_time() > until) {
+            ret = ETIMEDOUT;
+            break;
+        }
+    }
+
+    //stop it rather than leave it going when we gave up on it, whatever
+    //the deadline
+    if (ret == ECANCELED || ret == ETIMEDOUT) {
+        ftdic->usb_write_timeout = MOVE_TIMEOUT;
+        write_short(MSG_STOP, i, 0x02);
+    }
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+
+long WINAPI APT_MoveAbsoluteInPos(long lSerialNum, float fAbsPos, float fTolerance, float fDwellMs, float *pfSettleMs) {
+    return move_inpos(lSerialNum, fAbsPos, 0, fTolerance, fDwellMs, pfSettleMs);
+}
+
+long WINAPI APT_MoveRelativeInPos(long lSerialNum, float fRelDist, float fTolerance, float fDwellMs, float *pfSettleMs) {
+    return move_inpos(lSerialNum, fRelDist, 1, fTolerance, fDwellMs, pfSettleMs);
+}
@@ -15,57 +15,7 @@
  *
  */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <ftdi.h>
-#include <errno.h>
-#include "hexdump.h"
-
-#define VENDOR_ID 0x403
-#define PRODUCT_ID 0xfaf0
-
-#ifdef WIN32
-    #include <windows.h>
-#elif _POSIX_C_SOURCE >= 199309L
-    #include <time.h>   // for nanosleep
-#else
-    #include <unistd.h> // for usleep
-#endif
-
-#ifndef WIN32
-    typedef enum { false, true } BOOL;
-    typedef char TCHAR;
-    #define WINAPI
-#endif
-
-#include "APTAPI.h"
-
-typedef struct {
-     long SerialNumber;
-     char ModelNumber[9];
-     long Type;
-     long HardwareType;
-     char DestinationByte; //depends on type of controller
-     char FirmwareVersion[13];
-     char Notes[49];
-     long HardwareVersion;
-     long ModState;
-     long NumberChannels;
-     long ChannelId;
-
-     //these are the axis value (changed when changing channel);
-     long StageId;
-     long AxisId;
-     char PartNoAxis[17];
-     long SerialNumAxis;
-     long CntsPerUnit;
-     long MinPos;
-     long MaxPos;
-     long MaxAccn;
-     long MaxDec;
-     long MaxVel;
-} MY_APT_INFO;
+#include "libapt_private.h"
 
 int DEBUG = true;
 int numDevs = 0;
@@ -92,56 +42,171 @@ void sleep_ms(int milliseconds) // cross-platform sleep function
 #endif
 }
 
-void SetDebug(int value) {
-    DEBUG = value;
+// Monotonic time in seconds, used to time the moves.
+double apt_time(void) {
+#ifdef WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
 }
 
-long GetInfo(long lSerialNum, long *plType, char *pbDestByte) {
+// Reads len bytes, polling the device every millisecond rather than
+// sleeping for a fixed time first, for timeout_ms of wall clock time (a
+// sleep can take much longer than asked for on a loaded machine). Returns the number of bytes read (less
+// than len on a timeout, or when the caller's deadline passed or the call
+// was cancelled, see deadline.c) or a negative libftdi error code.
+long read_reply(char *buf, long len, int timeout_ms) {
+    long n = 0, ret;
+    double tEnd;
+
+    if (deadline_remaining_ms() < timeout_ms) timeout_ms = (int)deadline_remaining_ms();
+    tEnd = apt_time() + timeout_ms / 1e3;
+
+    while (n < len) {
+        if (deadline_check() != 0) break;
+        if ((ret = ftdi_read_data(ftdic, buf + n, len - n)) < 0)
+            return ret;
+        n += ret;
+        if (ret == 0) {
+            if (apt_time() >= tEnd) break;
+            sleep_ms(1);
+        }
+    }
+    return n;
+}
 
-    //default values
-    long ret = 0;
+// Reads one APT message: the 6 byte header and, if bit 7 of the destination
+// byte is set, the data packet whose length is in bytes 2-3. Messages longer
+// than maxlen are dropped. Returns the message length, 0 on a timeout or a
+// negative libftdi error code.
+long read_frame(char *buf, long maxlen, int timeout_ms) {
+    char scratch[64];
+    long ret, len, n;
+
+    while (1) {
+        if ((ret = read_reply(buf, 6, timeout_ms)) < 6)
+            return ret < 0 ? ret : 0;
+        if (!(buf[4] & 0x80))
+            return 6;
+
+        len = 6 + ((unsigned char)buf[2] | ((unsigned char)buf[3] << 8));
+        if (len <= maxlen) {
+            if ((ret = read_reply(buf + 6, len - 6, timeout_ms)) < len - 6)
+                return ret < 0 ? ret : 0;
+            return len;
+        }
 
-    *pbDestByte = 0x50; // 0x50 Generic USB hardware unit
-    switch (lSerialNum / 1000000) {
-
-        case 20:
-            // 20xxxxxx  Legacy single channel stepper driver  BSC001
-            *plType = HWTYPE_BSC001; break;
-        case 30:
-            // 30xxxxxx  Legacy dual channel stepper driver  BSC002
-            *plType = HWTYPE_BSC002; break;
-        case 40:
-            // 40xxxxxx  Single channel stepper driver  BSC101
-            *plType = HWTYPE_BSC101; break;
-        case 60:
-            // 60xxxxxx  OptoSTDriver (mini stepper driver)  OST001
-            *plType = HWTYPE_OST001; break;
-        case 63:
-            // 63xxxxxx  OptoDCDriver (mini DC servo driver)  ODC001
-            *plType = HWTYPE_ODC001; break;
-        case 70:
-            // 70xxxxxx  Three channel card slot stepper driver BSC103
-            *plType = HWTYPE_SCC001; break;
-        case 80:
-            // 80xxxxxx  Stepper Driver T-Cube TST001
-            *plType = HWTYPE_TST001; break;
-        case 83:
-            // 83xxxxxx  DC servo driver T-Cube TDC001
-            *plType = HWTYPE_TDC001; break;
-        default:
-            // 25xxxxxx  Legacy single channel mini stepper driver  BMS001
-            // 35xxxxxx  Legacy dual channel mini stepper driver BMS002
-            // 73xxxxxx  Brushless DC motherboard  BBD102/BBD103
-            // 94xxxxxx  Brushless DC motor card  BBD102/BBD103
-            *plType = 0;
-            ret = ENODEV;
+        for (len -= 6; len > 0; len -= n) {
+            n = len < (long)sizeof(scratch) ? len : (long)sizeof(scratch);
+            if ((ret = read_reply(scratch, n, timeout_ms)) < n)
+                return ret < 0 ? ret : 0;
+        }
     }
+}
+
+// Reads the len byte reply to a REQ message into rxbuf. Returns 0 once it's
+// all there and is message id, ETIMEDOUT if nothing came, EIO if it was cut
+// short or is some other message (rxbuf is then no use), or a negative
+// libftdi error code.
+static long read_get(const char *name, long len, unsigned short id) {
+    long ret;
+
+    if ((ret = read_reply(rxbuf, len, 150)) < 0) return ret;
+    if (ret == 0) return ETIMEDOUT;
+
+    if (DEBUG) hexDump(name, rxbuf, ret);
+    if (ret < len || (unsigned char)rxbuf[0] != (id & 0xFF) || (unsigned char)rxbuf[1] != (id >> 8))
+        return EIO;
+    return 0;
+}
+
+// Sends REQ message req to channel lChanID of device i, whichever channel
+// the device is on, and copies the len byte reply into buf. Returns 0,
+// ETIMEDOUT, EIO or a negative libftdi error code as read_get.
+long chan_get(long i, long lChanID, unsigned short req, char *buf, long len) {
+    char txbuf[6];
+    long ret;
+
+    txbuf[0] = req & 0xFF;
+    txbuf[1] = req >> 8;
+    txbuf[2] = (char)caps_chan_ident(i, lChanID);
+    txbuf[3] = 0x00;
+    txbuf[4] = (char)caps_dest(i, lChanID);
+    txbuf[5] = 0x01;
+    if (DEBUG) hexDump("chan_get txbuf",txbuf,6);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) goto end;
+    if ((ret = read_get("chan_get rxbuf", len, req + 1)) != 0) goto end;
+    memcpy(buf, rxbuf, len);
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
     return ret;
 }
 
+// Asks the device already open for the status of the current channel, and
+// keeps Homed only if the controller says so: the flag from the state cache
+// doesn't survive the controller being switched off and on.
+static void homed_check(long i) {
+    //MGMSG_MOT_REQ_DCSTATUSUPDATE or MGMSG_MOT_REQ_STATUSUPDATE
+    char txbuf[6] ={0x80,0x04,0x00,0x00,0x50,0x01};
+    unsigned short req, id;
+    long ret, homed = 0;
+
+    if (!aptInfo[i].Homed) return;
+
+    req = caps_has(i, APT_CAP_DCSTATUS) ? 0x0490 : 0x0480;
+    txbuf[0] = req & 0xFF;
+    txbuf[2] = (char)caps_ident(i);
+    txbuf[4] = aptInfo[i].DestinationByte;
+    if (DEBUG) hexDump("homed_check txbuf",txbuf,6);
+
+    //MGMSG_MOT_GET_DCSTATUSUPDATE or MGMSG_MOT_GET_STATUSUPDATE, the status bits at 16
+    if (ftdi_write_data(ftdic, txbuf, 6) == 6) {
+        while ((ret = read_frame(rxbuf, sizeof(rxbuf), 150)) > 0) {
+            if (DEBUG) hexDump("homed_check rxbuf",rxbuf,ret);
+            id = (unsigned char)rxbuf[0] | ((unsigned char)rxbuf[1] << 8);
+            if (id != req + 1 || ret < 20) continue;
+            homed = (*(uint32_t *)(rxbuf+16) & APT_STATUS_HOMED) != 0;
+            break;
+        }
+    }
+
+    if (!homed) {
+        aptInfo[i].Homed = 0;
+        cache_store(i);
+    }
+}
+
+// The same for a channel whose cached state was just loaded, opening the
+// device.
+void homed_confirm(long i) {
+    if (!aptInfo[i].Homed) return;
+    if (ftdi_open_apt_index(i) < 0)
+        aptInfo[i].Homed = 0;
+    else
+        homed_check(i);
+    ftdi_usb_close(ftdic);
+}
+
+void SetDebug(int value) {
+    DEBUG = value;
+}
+
 long ftdi_open_apt_serialnum(long lSerialNum) {
     char buf[9];
-    long ret=0;
+    long i, ret=0;
+
+    //out of time before we even start?
+    if (deadline_check() != 0) return -1;
 
     sprintf(buf,"%ld",lSerialNum);
     ret = ftdi_usb_open_desc_index(ftdic, VENDOR_ID, PRODUCT_ID, NULL, buf, 0);
@@ -160,8 +225,17 @@ long ftdi_open_apt_serialnum(long lSerialNum) {
     ret = ftdi_usb_purge_tx_buffer(ftdic);
     if (ret < 0) goto end;
 
-    //latency?
-    ret = ftdi_set_latency_timer(ftdic,1);
+    //latency timer, chunk sizes, flow control and timeouts (transport.c)
+    if (GetIndex(lSerialNum, &i) == 0)
+        ret = transport_apply(&aptInfo[i].Transport);
+    else
+        ret = ftdi_set_latency_timer(ftdic,1);
+
+    //and never block past the caller's deadline
+    if (deadline_remaining_ms() < ftdic->usb_read_timeout)
+        ftdic->usb_read_timeout = deadline_remaining_ms() > 0 ? (int)deadline_remaining_ms() : 1;
+    if (deadline_remaining_ms() < ftdic->usb_write_timeout)
+        ftdic->usb_write_timeout = deadline_remaining_ms() > 0 ? (int)deadline_remaining_ms() : 1;
 
 end:
     if (ret < 0) fprintf(stderr,"Error: %s\n",ftdi_get_error_string(ftdic));
@@ -202,6 +276,9 @@ long WINAPI APTInit(void) {
 
     char manufacturer[128], description[128], serialno[128];
 
+    if (getenv("LIBAPT_STATE_CACHE") != NULL)
+        APT_SetStateCache(getenv("LIBAPT_STATE_CACHE"));
+
     // create the device information list 
     if ((ftdic = ftdi_new()) == 0)
     {
@@ -235,12 +312,13 @@ long WINAPI APTInit(void) {
 
         if (DEBUG) printf("Manufacturer: '%s', Description: '%s', Serial No: '%s'\n", manufacturer, description, serialno);
         aptInfo[i].SerialNumber = atoi(serialno);
+        transport_init(i);
 
         //Once you have read from the device, you need to close it!
         if ((ret = ftdi_usb_close(ftdic)) < 0)
              break;
 
-        ret = GetInfo(aptInfo[i].SerialNumber, &aptInfo[i].Type, &aptInfo[i].DestinationByte);
+        ret = caps_init(i);
         curdev = curdev->next;
     }
 
@@ -255,6 +333,7 @@ long WINAPI APTCleanUp(void) {
 
     numDevs = 0;
     if (aptInfo != NULL) free(aptInfo);
+    aptInfo = NULL;
 
     /* XXX Do we still need to try and close the devices first?
     for (i=0;i<numDevs;i++) {
@@ -325,21 +404,17 @@ long WINAPI GetHWInfo(long lSerialNum, TCHAR *szModel, long lModelLen, TCHAR *sz
 
     //MGMSG_HW_REQ_INFO
     char txbuf[6] ={0x05,0x00,0x00,0x00,0x50,0x01};
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
 
-    txbuf[2] = aptInfo[i].ChannelId;
+    txbuf[2] = (char)caps_ident(i);
     txbuf[4] = aptInfo[i].DestinationByte;
     if (DEBUG) hexDump("GetHWInfo txbuf",txbuf,6);
 
     if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
     if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) goto end;
 
-    sleep_ms(150);
-
-    if ((ret = ftdi_read_data(ftdic, rxbuf, 90)) <= 0)
-        goto end;
-
-    if (DEBUG) hexDump("GetHWInfo rxbuf",rxbuf,ret);
+    //MGMSG_HW_GET_INFO
+    if ((ret = read_get("GetHWInfo rxbuf", 90, 0x0006)) != 0) goto end;
 
     memset(szModel,0,lModelLen);
     memcpy(szModel,rxbuf+10,8);
@@ -347,6 +422,7 @@ long WINAPI GetHWInfo(long lSerialNum, TCHAR *szModel, long lModelLen, TCHAR *sz
     memset(szHWNotes,0,lHWNotesLen);
     memcpy(szHWNotes,rxbuf+24,48);
 
+    ret = 0;
 end:
     if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
     ftdi_usb_close(ftdic);
@@ -356,7 +432,7 @@ end:
 
 long WINAPI InitHWDevice(long lSerialNum) {
     long i, ret = 0;
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
 
     //MGMSG_HW_REQ_INFO
     char txbuf[6] ={0x05,0x00,0x00,0x00,0x50,0x01};
@@ -364,18 +440,15 @@ long WINAPI InitHWDevice(long lSerialNum) {
     if ((ret = ftdi_open_apt_index(i)) < 0)
         goto end;
 
-    txbuf[4] = aptInfo[i].DestinationByte;
+    //the motherboard of a rack system, not one of its bays
+    txbuf[4] = (char)aptInfo[i].Caps->lDestByte;
     if (DEBUG) hexDump("InitHWDevice txbuf",txbuf,6);
 
     if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0)
         goto end;
 
-    sleep_ms(150);
-
-    if ((ret = ftdi_read_data(ftdic, rxbuf, 90)) <= 0)
-        goto end;
-
-    if (DEBUG) hexDump("InitHWDevice rxbuf",rxbuf,ret);
+    //MGMSG_HW_GET_INFO, there well before 150ms, don't wait longer than needed
+    if ((ret = read_get("InitHWDevice rxbuf", 90, 0x0006)) != 0) goto end;
 
     //copy to the appropriate structure.
     memset(aptInfo[i].ModelNumber,0,9);
@@ -389,6 +462,13 @@ long WINAPI InitHWDevice(long lSerialNum) {
     aptInfo[i].ModState = *(unsigned short int *)(rxbuf+86);
     aptInfo[i].NumberChannels = *(unsigned short int *)(rxbuf+88);
     aptInfo[i].ChannelId = 0;
+    caps_refine(i);
+    aptInfo[i].DestinationByte = (char)caps_dest(i, aptInfo[i].ChannelId);
+
+    //same serial number and firmware? Then we already know the rest.
+    if (cache_load(i) < 0) aptInfo[i].Homed = 0;
+    homed_check(i);
+    cache_store(i);
 
     if (DEBUG) {
         printf(" APT SerialNumber=%ld\n",aptInfo[i].SerialNumber);
@@ -424,7 +504,7 @@ end:
 long WINAPI MOT_Identify(long lSerialNum) {
     long i, ret = 0;
     char txbuf[6] ={0x23,0x02,0x00,0x00,0x50,0x01};
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
 
     txbuf[4] = aptInfo[i].DestinationByte;
     if (DEBUG) hexDump("MOT_Identify txbuf",txbuf,6);
@@ -444,9 +524,9 @@ long WINAPI MOT_EnableHWChannel(long lSerialNum) {
 
     //MGMSG_MOD_SET_CHANENABLESTATE
     char txbuf[6] ={0x10,0x02,0x00,0x01,0x50,0x01};
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
 
-    txbuf[2] = aptInfo[i].ChannelId;
+    txbuf[2] = (char)caps_ident(i);
     txbuf[4] = aptInfo[i].DestinationByte;
     if (DEBUG) hexDump("MOT_EnableHWChannel txbuf",txbuf,6);
 
@@ -465,9 +545,9 @@ long WINAPI MOT_DisableHWChannel(long lSerialNum) {
 
     //MGMSG_MOD_SET_CHANENABLESTATE
     char txbuf[6] ={0x10,0x02,0x00,0x00,0x50,0x01};
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
 
-    txbuf[2] = aptInfo[i].ChannelId;
+    txbuf[2] = (char)caps_ident(i);
     txbuf[4] = aptInfo[i].DestinationByte;
     if (DEBUG) hexDump("MOT_DisableHWChannel txbuf",txbuf,6);
 
@@ -485,19 +565,19 @@ long WINAPI MOT_SetVelParams(long lSerialNum, float fMinVel, float fAccn, float
     int16_t val16;
     int32_t val32;
 
-    //MGMSG_MOD_SET_CHANENABLESTATE
+    //MGMSG_MOT_SET_VELPARAMS
     char txbuf[20];
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
 
     txbuf[0] = 0x13;
     txbuf[1] = 0x04;
     txbuf[2] = 0x0E;
     txbuf[3] = 0x00;
-    txbuf[4] = aptInfo[i].DestinationByte;
+    txbuf[4] = aptInfo[i].DestinationByte | 0x80;
     txbuf[5] = 0x01;
 
     //copy Chan Ident
-    val16 = (int16_t)aptInfo[i].ChannelId;
+    val16 = (int16_t)caps_ident(i);
     memcpy(txbuf+6,(char *)(&val16),2);
     val32 = (int32_t)fMinVel;
     memcpy(txbuf+8,(char *)(&val32),4);
@@ -508,7 +588,13 @@ long WINAPI MOT_SetVelParams(long lSerialNum, float fMinVel, float fAccn, float
     if (DEBUG) hexDump("MOT_SetVelParams txbuf",txbuf,20);
 
     if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
-    if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) goto end;
+    if ((ret = ftdi_write_data(ftdic, txbuf, 20)) < 0) goto end;
+
+    aptInfo[i].VelMin = fMinVel;
+    aptInfo[i].VelAccn = fAccn;
+    aptInfo[i].VelMax = fMaxVel;
+    aptInfo[i].Cached |= CACHED_VELPARAMS;
+    cache_store(i);
 
 end:
     if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
@@ -523,21 +609,24 @@ long WINAPI MOT_GetVelParams(long lSerialNum, float *pfMinVel, float *pfAccn, fl
 
     //MGMSG_MOT_REQ_VELPARAMS
     char txbuf[6] ={0x14,0x04,0x00,0x00,0x50,0x01};
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+
+    if (aptInfo[i].Cached & CACHED_VELPARAMS) {
+        *pfMinVel = aptInfo[i].VelMin;
+        *pfAccn = aptInfo[i].VelAccn;
+        *pfMaxVel = aptInfo[i].VelMax;
+        return 0;
+    }
 
-    txbuf[2] = aptInfo[i].ChannelId;
+    txbuf[2] = (char)caps_ident(i);
     txbuf[4] = aptInfo[i].DestinationByte;
     if (DEBUG) hexDump("MOT_GetVelParams txbuf",txbuf,6);
 
     if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
     if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) goto end;
 
-    sleep_ms(150);
-
-    if ((ret = ftdi_read_data(ftdic, rxbuf, 20)) <= 0)
-        goto end;
-
-    if (DEBUG) hexDump("MOT_GetVelParams rxbuf",rxbuf,ret);
+    //MGMSG_MOT_GET_VELPARAMS
+    if ((ret = read_get("MOT_GetVelParams rxbuf", 20, 0x0415)) != 0) goto end;
     val32 = *(int32_t *)(rxbuf+8);
     *pfMinVel = (float)val32;
 
@@ -547,6 +636,105 @@ long WINAPI MOT_GetVelParams(long lSerialNum, float *pfMinVel, float *pfAccn, fl
     val32 = *(int32_t *)(rxbuf+16);
     *pfMaxVel = (float)val32;
 
+    aptInfo[i].VelMin = *pfMinVel;
+    aptInfo[i].VelAccn = *pfAccn;
+    aptInfo[i].VelMax = *pfMaxVel;
+    aptInfo[i].Cached |= CACHED_VELPARAMS;
+    cache_store(i);
+
+    ret = 0;
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+long WINAPI MOT_SetDCProfileModeParams(long lSerialNum, long lProfMode, float fJerk) {
+    long i, ret = 0;
+
+    int16_t val16;
+    uint32_t uval32;
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if (!caps_has(i, APT_CAP_PROFILEMODE)) return ENOTSUP;
+    char txbuf[18];
+
+    //MGMSG_MOT_SET_DCPROFILEMODEPARAMS
+    memset(txbuf, 0, sizeof(txbuf));
+    txbuf[0] = 0xE3;
+    txbuf[1] = 0x04;
+    txbuf[2] = 0x0C;
+    txbuf[3] = 0x00;
+    txbuf[4] = aptInfo[i].DestinationByte | 0x80;
+    txbuf[5] = 0x01;
+
+    //copy Chan Ident
+    val16 = (int16_t)caps_ident(i);
+    memcpy(txbuf+6,(char *)(&val16),2);
+    val16 = (int16_t)lProfMode;
+    memcpy(txbuf+8,(char *)(&val16),2);
+    uval32 = (uint32_t)fJerk;
+    memcpy(txbuf+10,(char *)(&uval32),4);
+    //the last two words are reserved
+    if (DEBUG) hexDump("MOT_SetDCProfileModeParams txbuf",txbuf,18);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if ((ret = ftdi_write_data(ftdic, txbuf, 18)) < 0) goto end;
+
+    aptInfo[i].ProfMode = lProfMode;
+    aptInfo[i].Jerk = fJerk;
+    aptInfo[i].Cached |= CACHED_PROFILEMODE;
+    cache_store(i);
+
+    ret = 0;
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+long WINAPI MOT_GetDCProfileModeParams(long lSerialNum, long *plProfMode, float *pfJerk) {
+    long i, ret = 0;
+    int16_t val16;
+    uint32_t uval32;
+
+    //MGMSG_MOT_REQ_DCPROFILEMODEPARAMS
+    char txbuf[6] ={0xE4,0x04,0x00,0x00,0x50,0x01};
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+
+    //nothing to ask a controller that only does trapezoidal moves
+    if (!caps_has(i, APT_CAP_PROFILEMODE)) {
+        aptInfo[i].ProfMode = DC_PROFILEMODE_TRAPEZOIDAL;
+        aptInfo[i].Jerk = 0;
+        aptInfo[i].Cached |= CACHED_PROFILEMODE;
+    }
+
+    if (aptInfo[i].Cached & CACHED_PROFILEMODE) {
+        *plProfMode = aptInfo[i].ProfMode;
+        *pfJerk = aptInfo[i].Jerk;
+        return 0;
+    }
+
+    txbuf[2] = (char)caps_ident(i);
+    txbuf[4] = aptInfo[i].DestinationByte;
+    if (DEBUG) hexDump("MOT_GetDCProfileModeParams txbuf",txbuf,6);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) goto end;
+
+    //MGMSG_MOT_GET_DCPROFILEMODEPARAMS
+    if ((ret = read_get("MOT_GetDCProfileModeParams rxbuf", 18, 0x04E5)) != 0) goto end;
+
+    val16 = *(int16_t *)(rxbuf+8);
+    *plProfMode = (long)val16;
+
+    uval32 = *(uint32_t *)(rxbuf+10);
+    *pfJerk = (float)uval32;
+
+    aptInfo[i].ProfMode = *plProfMode;
+    aptInfo[i].Jerk = *pfJerk;
+    aptInfo[i].Cached |= CACHED_PROFILEMODE;
+    cache_store(i);
+
     ret = 0;
 end:
     if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
@@ -562,21 +750,17 @@ long WINAPI MOT_GetVelParamLimits(long lSerialNum, float *pfMaxAccn, float *pfMa
 
     //MGMSG_MOT_REQ_VELPARAMS
     char txbuf[6] ={0x14,0x04,0x00,0x00,0x50,0x01};
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
 
-    txbuf[2] = aptInfo[i].ChannelId;
+    txbuf[2] = (char)caps_ident(i);
     txbuf[4] = aptInfo[i].DestinationByte;
     if (DEBUG) hexDump("MOT_GetVelParams txbuf",txbuf,6);
 
     if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
     if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) goto end;
 
-    sleep_ms(150);
-
-    if ((ret = ftdi_read_data(ftdic, rxbuf, 20)) <= 0)
-        goto end;
-
-    if (DEBUG) hexDump("MOT_GetVelParams rxbuf",rxbuf,ret);
+    //MGMSG_MOT_GET_VELPARAMS
+    if ((ret = read_get("MOT_GetVelParams rxbuf", 20, 0x0415)) != 0) goto end;
     val32 = *(int32_t *)(rxbuf+8);
     *pfMinVel = (float)val32;
 
@@ -602,21 +786,26 @@ long WINAPI MOT_GetStageAxisInfo(long lSerialNum, float *pfMinPos, float *pfMaxP
 
     //MGMSG_MOT_REQ_PMDSTAGEAXISPARAMS
     char txbuf[6] ={0xF1,0x04,0x00,0x00,0x50,0x01};
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if (!caps_has(i, APT_CAP_STAGEAXIS)) return ENOTSUP;
+
+    if (aptInfo[i].Cached & CACHED_STAGEAXIS) {
+        *pfMinPos = (float)aptInfo[i].MinPos;
+        *pfMaxPos = (float)aptInfo[i].MaxPos;
+        *plUnits = aptInfo[i].Units;
+        *pfPitch = aptInfo[i].Pitch;
+        return 0;
+    }
 
-    txbuf[2] = aptInfo[i].ChannelId;
+    txbuf[2] = (char)caps_ident(i);
     txbuf[4] = aptInfo[i].DestinationByte;
     if (DEBUG) hexDump("MOT_GetStageAxisInfo txbuf",txbuf,6);
 
     if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
     if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) goto end;
 
-    sleep_ms(150);
-
-    if ((ret = ftdi_read_data(ftdic, rxbuf, 80)) <= 0)
-        goto end;
-
-    if (DEBUG) hexDump("MOT_GetStageAxisInfo rxbuf",rxbuf,ret);
+    //MGMSG_MOT_GET_PMDSTAGEAXISPARAMS
+    if ((ret = read_get("MOT_GetStageAxisInfo rxbuf", 80, 0x04F2)) != 0) goto end;
     val32 = *(int32_t *)(rxbuf+36);
     *pfMinPos = (float)val32;
 
@@ -628,6 +817,13 @@ long WINAPI MOT_GetStageAxisInfo(long lSerialNum, float *pfMinPos, float *pfMaxP
 
     *pfPitch = 0;
 
+    aptInfo[i].MinPos = (long)*pfMinPos;
+    aptInfo[i].MaxPos = (long)*pfMaxPos;
+    aptInfo[i].Units = *plUnits;
+    aptInfo[i].Pitch = *pfPitch;
+    aptInfo[i].Cached |= CACHED_STAGEAXIS;
+    cache_store(i);
+
     ret = 0;
 end:
     if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
@@ -641,23 +837,21 @@ long WINAPI MOT_GetPosition(long lSerialNum, float *pfPosition) {
 
     //MGMSG_MOT_REQ_POSCOUNTER
     char txbuf[6] ={0x11,0x04,0x00,0x00,0x50,0x01};
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
 
-    txbuf[2] = aptInfo[i].ChannelId;
+    txbuf[2] = (char)caps_ident(i);
     txbuf[4] = aptInfo[i].DestinationByte;
     if (DEBUG) hexDump("MOT_GetPosition txbuf",txbuf,6);
 
     if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
     if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) goto end;
 
-    sleep_ms(150);
-
-    if ((ret = ftdi_read_data(ftdic, rxbuf, 12)) <= 0)
-        goto end;
-
-    if (DEBUG) hexDump("MOT_GetPosition rxbuf",rxbuf,ret);
+    //MGMSG_MOT_GET_POSCOUNTER
+    if ((ret = read_get("MOT_GetPosition rxbuf", 12, 0x0412)) != 0) goto end;
     val32 = *(int32_t *)(rxbuf+8);
     *pfPosition = (float)val32;
+    aptInfo[i].Position = *pfPosition;
+    aptInfo[i].PositionValid = 1;
 
     ret = 0;
 end:
@@ -669,11 +863,18 @@ end:
 long WINAPI MOT_SetChannel(long lSerialNum, long lChanID) {
     long i, ret = -1;
 
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
 
     if (lChanID <= aptInfo[i].NumberChannels) {
         ret = 0;
-        aptInfo[i].ChannelId = lChanID;
+        if (aptInfo[i].ChannelId != lChanID) {
+            //the axis values belong to the previous channel
+            aptInfo[i].ChannelId = lChanID;
+            aptInfo[i].DestinationByte = (char)caps_dest(i, aptInfo[i].ChannelId);
+            aptInfo[i].Homed = 0;
+            aptInfo[i].PositionValid = 0;
+            if (cache_load(i) == 0) homed_confirm(i);
+        }
     }
 
 end:
@@ -681,26 +882,80 @@ end:
     return ret;
 }
 
+// MGMSG_MOT_MOVE_STOP (profiled) on the device already open. This one
+// goes out whatever the deadline, it's what a cancelled move ends with.
+static void move_stop(long i) {
+    char txbuf[6] ={0x65,0x04,0x00,0x02,0x50,0x01};
+
+    txbuf[2] = (char)caps_ident(i);
+    txbuf[4] = aptInfo[i].DestinationByte;
+    if (DEBUG) hexDump("move_stop txbuf",txbuf,6);
+
+    ftdic->usb_write_timeout = MOVE_TIMEOUT;
+    ftdi_write_data(ftdic, txbuf, 6);
+    aptInfo[i].PositionValid = 0;
+}
+
+// Waits for the message that ends a move (id), skipping any other on the
+// way, until the caller's deadline if there is one, and stops the move if
+// the wait was cancelled. Returns 0 once the move is over, ETIMEDOUT (or
+// ECANCELED) if it wasn't in time, or a negative libftdi error code.
+static long wait_move(long i, int id) {
+    long ret, timeout = deadline_remaining_ms();
+    double until;
+
+    if (timeout == LONG_MAX) timeout = MOVE_TIMEOUT;
+    until = apt_time() + timeout / 1e3;
+    while ((ret = read_frame(rxbuf, sizeof(rxbuf), (int)timeout)) > 0) {
+        if (DEBUG) hexDump("wait_move rxbuf",rxbuf,ret);
+        if ((unsigned char)rxbuf[0] == (id & 0xFF) && (unsigned char)rxbuf[1] == (id >> 8))
+            return 0;
+        if ((timeout = (long)((until - apt_time()) * 1e3)) <= 0) break;
+    }
+    if (ret < 0) return ret;
+
+    if (deadline_check() == ECANCELED) move_stop(i);
+    return deadline_check() != 0 ? deadline_check() : ETIMEDOUT;
+}
+
+long WINAPI MOT_StopProfiled(long lSerialNum) {
+    long i, ret = 0;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    move_stop(i);
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
 long WINAPI MOT_MoveHome(long lSerialNum, BOOL bWait) {
     long i, ret = 0;
 
     char txbuf[6] ={0x43,0x04,0x01,0x00,0x50,0x01};
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
 
-    txbuf[2] = aptInfo[i].ChannelId;
+    txbuf[2] = (char)caps_ident(i);
     txbuf[4] = aptInfo[i].DestinationByte;
     if (DEBUG) hexDump("MOT_MoveHome txbuf",txbuf,6);
 
     if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
     if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) goto end;
 
+    aptInfo[i].Homed = 0;
+    aptInfo[i].Cached |= CACHED_HOMED;
+    aptInfo[i].PositionValid = 0;
+
+    //MGMSG_MOT_MOVE_HOMED
     ret = 0;
-    i = 0;
-    while (bWait && ret == 0 && i++ < 10) {
-        sleep_ms(150);
-        ret = ftdi_read_data(ftdic, rxbuf, 6);
+    if (bWait && (ret = wait_move(i, 0x0444)) == 0) {
+        aptInfo[i].Homed = 1;
+        aptInfo[i].Position = 0;
+        aptInfo[i].PositionValid = 1;
     }
-    if (ret > 0 && DEBUG) hexDump("MOT_MoveHome rxbuf",rxbuf,ret);
+    cache_store(i);
 
 end:
     if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
@@ -710,10 +965,11 @@ end:
 
 long WINAPI MOT_MoveRelativeEx(long lSerialNum, float fRelDist, BOOL bWait) {
     long i, ret = 0;
+    double t0, dt = 0;
 
     int16_t val16;
     int32_t val32;
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
     char txbuf[12];
 
     //MGMSG_MOT_MOVE_RELATIVE
@@ -725,39 +981,43 @@ long WINAPI MOT_MoveRelativeEx(long lSerialNum, float fRelDist, BOOL bWait) {
     txbuf[5] = 0x01;
 
     //copy Chan Ident
-    val16 = (int16_t)aptInfo[i].ChannelId;
+    val16 = (int16_t)caps_ident(i);
     memcpy(txbuf+6,(char *)(&val16),2);
     val32 = (int32_t)fRelDist;
     memcpy(txbuf+8,(char *)(&val32),4);
     if (DEBUG) hexDump("MOT_MoveRelativeEx txbuf",txbuf,12);
 
     if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    t0 = apt_time();
     if ((ret = ftdi_write_data(ftdic, txbuf, 12)) < 0) goto end;
 
+    //MGMSG_MOT_MOVE_COMPLETED
     ret = 0;
-    i = 0;
-    while (bWait && ret == 0 && i++ < 10) {
-        sleep_ms(150);
-        ret = ftdi_read_data(ftdic, rxbuf, 6);
-    }
-    if (ret > 0 && DEBUG) hexDump("MOT_MoveRelativeEx rxbuf",rxbuf,ret);
+    if (bWait && (ret = wait_move(i, 0x0464)) == 0) {
+        dt = apt_time() - t0;
+        aptInfo[i].Position += fRelDist;
+    } else
+        aptInfo[i].PositionValid = 0;
 
 end:
     if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
     ftdi_usb_close(ftdic);
+    if (dt > 0) motion_observe(i, fRelDist, dt);
     return ret;
 }
 
 long WINAPI MOT_MoveAbsoluteEx(long lSerialNum, float fAbsPos, BOOL bWait) {
     long i, ret = 0;
+    double t0, dt = 0;
+    float fRelDist;
 
     int16_t val16;
     int32_t val32;
-    GetIndex(lSerialNum, &i);
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
     char txbuf[20];
 
-    //MGMSG_MOD_SET_CHANENABLESTATE
-    txbuf[0] = 0x48;
+    //MGMSG_MOT_MOVE_ABSOLUTE
+    txbuf[0] = 0x53;
     txbuf[1] = 0x04;
     txbuf[2] = 0x06;
     txbuf[3] = 0x00;
@@ -765,26 +1025,30 @@ long WINAPI MOT_MoveAbsoluteEx(long lSerialNum, float fAbsPos, BOOL bWait) {
     txbuf[5] = 0x01;
 
     //copy Chan Ident
-    val16 = (int16_t)aptInfo[i].ChannelId;
+    val16 = (int16_t)caps_ident(i);
     memcpy(txbuf+6,(char *)(&val16),2);
     val32 = (int32_t)fAbsPos;
     memcpy(txbuf+8,(char *)(&val32),4);
     if (DEBUG) hexDump("MOT_MoveAbsoluteEx txbuf",txbuf,12);
 
     if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    t0 = apt_time();
     if ((ret = ftdi_write_data(ftdic, txbuf, 12)) < 0) goto end;
 
+    //MGMSG_MOT_MOVE_COMPLETED, the distance is only known from a known start
+    fRelDist = fAbsPos - aptInfo[i].Position;
     ret = 0;
-    i = 0;
-    while (bWait && ret == 0 && i++ < 10) {
-        sleep_ms(150);
-        ret = ftdi_read_data(ftdic, rxbuf, 6);
-    }
-    if (ret > 0 && DEBUG) hexDump("MOT_MoveAbsoluteEx rxbuf",rxbuf,ret);
+    if (bWait && (ret = wait_move(i, 0x0464)) == 0) {
+        if (aptInfo[i].PositionValid) dt = apt_time() - t0;
+        aptInfo[i].Position = fAbsPos;
+        aptInfo[i].PositionValid = 1;
+    } else
+        aptInfo[i].PositionValid = 0;
 
 end:
     if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
     ftdi_usb_close(ftdic);
+    if (dt > 0) motion_observe(i, fRelDist, dt);
     return ret;
 }
 
@@ -0,0 +1,445 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// libapt extensions to the APT.DLL interface declared in APTAPI.h.
+// Like APTAPI.h, BOOL, TCHAR and WINAPI must be defined before inclusion.
+
+#ifndef LIBAPT_H
+#define LIBAPT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void SetDebug(int value);
+
+// Persistent device state cache.
+//
+// The cache is a small memory-mapped file keyed by serial number, channel
+// and firmware version. It holds the InitHWDevice information, the stage
+// axis and velocity parameters and the last known homed status, so that a
+// restarted process can skip re-reading them from the controllers.
+// A cached homed status is only kept once a status request confirms it.
+// The file is created readable by its owner only.
+// APTInit opens $LIBAPT_STATE_CACHE if set and no cache is open yet.
+long WINAPI APT_SetStateCache(const char *szPath);
+long WINAPI APT_ClearStateCache(long lSerialNum);  // 0 clears all the records
+long WINAPI APT_GetHomedStatus(long lSerialNum, long *plHomed);
+
+// Visit order planning for multi-point acquisitions.
+//
+// pfTargets holds lNumPoints rows of lNumAxes absolute positions, one column
+// per (plSerialNums[a], plChanIDs[a]) axis. plChanIDs may be NULL to use the
+// current channel of each device. The axes move in parallel, so the time
+// between two points is the time of the slowest axis given its velocity
+// parameters. APT_PlanVisitOrder fills plOrder with the point indices in
+// visiting order, starting from pfStart (or the current positions if NULL).
+// APT_ExecuteVisitOrder then moves through the points (plOrder may be NULL
+// for the given order), calling pfnCallback at each one once every axis has
+// stopped, which it follows through an axis handle of its own (see
+// APT_OpenAxis); a non-zero return value from the callback stops the run.
+// Axes still moving after twice the predicted time plus 1.5 s, or at the
+// deadline (see APT_SetDeadline), stop the run with ETIMEDOUT.
+#define APT_PLAN_MAX_AXES   8
+
+typedef long (WINAPI *APT_VISITCALLBACK)(long lPoint, void *pUserData);
+
+long WINAPI APT_PlanVisitOrder(long lNumAxes, const long *plSerialNums, const long *plChanIDs,
+        long lNumPoints, const float *pfTargets, const float *pfStart,
+        long *plOrder, float *pfTotalTime);
+long WINAPI APT_ExecuteVisitOrder(long lNumAxes, const long *plSerialNums, const long *plChanIDs,
+        long lNumPoints, const float *pfTargets, const long *plOrder,
+        APT_VISITCALLBACK pfnCallback, void *pUserData);
+
+// Motion model.
+//
+// Predicts the duration of a move and the position along the way, from the
+// channel's velocity parameters and profile mode (trapezoidal, or S-curve
+// with the jerk set by MOT_SetDCProfileModeParams). fTime is in seconds
+// from the move command. The model calibrates itself on every move done
+// with bWait, see APT_GetMotionModel for the current fit
+// (observed = scale * predicted + offset).
+long WINAPI APT_PredictMove(long lSerialNum, float fStartPos, float fEndPos, float *pfDuration);
+long WINAPI APT_PredictPosition(long lSerialNum, float fStartPos, float fEndPos, float fTime, float *pfPosition);
+long WINAPI APT_GetMotionModel(long lSerialNum, float *pfScale, float *pfOffset, long *plNumMoves);
+long WINAPI APT_ResetMotionModel(long lSerialNum);
+
+// FTDI transport settings.
+//
+// Each device has its own latency timer (ms), libftdi read/write chunk
+// sizes (bytes), flow control and libusb timeouts (ms), applied every time
+// the device is opened. APT_TRANSPORT_LOWLATENCY suits request/reply
+// polling, APT_TRANSPORT_BULK streaming status updates; APTInit picks the
+// profile named by $LIBAPT_TRANSPORT ("lowlatency" or "bulk"), or the
+// default one. APT_SetTransportProfile with lSerialNum 0 sets all devices.
+// APT_CalibrateTransport measures the position request round trip time
+// under a range of settings and keeps (and caches, see APT_SetStateCache)
+// the one with the lowest p99; the median and p99 are returned in ms.
+#define APT_TRANSPORT_DEFAULT       0
+#define APT_TRANSPORT_LOWLATENCY    1
+#define APT_TRANSPORT_BULK          2
+#define APT_TRANSPORT_CUSTOM        3
+#define APT_TRANSPORT_CALIBRATED    4
+
+#define APT_FLOW_NONE       0
+#define APT_FLOW_RTSCTS     1
+
+typedef struct {
+    long lProfile;
+    long lLatencyTimer;
+    long lReadChunkSize;
+    long lWriteChunkSize;
+    long lFlowControl;
+    long lReadTimeout;
+    long lWriteTimeout;
+} APT_TRANSPORT_SETTINGS;
+
+long WINAPI APT_SetTransport(long lSerialNum, const APT_TRANSPORT_SETTINGS *pSettings);
+long WINAPI APT_GetTransport(long lSerialNum, APT_TRANSPORT_SETTINGS *pSettings);
+long WINAPI APT_SetTransportProfile(long lSerialNum, long lProfile);
+long WINAPI APT_CalibrateTransport(long lSerialNum, long lNumRounds, APT_TRANSPORT_SETTINGS *pBest,
+        float *pfMedianRTT, float *pfTailRTT);
+
+// Configuration snapshots.
+//
+// APT_SaveConfig reads every motor parameter block the controller knows
+// about (velocity, backlash, homing, limit switches, PID, position and
+// current loops, motor output, track/settle, profile mode, joystick) for
+// the current channel, with all the requests sent in a single burst, and
+// writes them to szPath. APT_CONFIG_TEXT files have one "BLOCK value..."
+// line per block and can be edited by hand; APT_CONFIG_BINARY files hold
+// the raw MGMSG_MOT_SET_* frames. APT_LoadConfig (either format) sends all
+// the blocks to the current channel in one burst, reads them back and
+// returns in plMismatch how many blocks the controller didn't take as is.
+#define APT_CONFIG_TEXT     0
+#define APT_CONFIG_BINARY   1
+
+long WINAPI APT_SaveConfig(long lSerialNum, const char *szPath, long lFormat);
+long WINAPI APT_LoadConfig(long lSerialNum, const char *szPath, long *plMismatch);
+
+// Deadlines and cancellation.
+//
+// The *Dl variants take an absolute deadline on the APT_Now() clock
+// (seconds, 0 for none) and an optional cancellation flag that another
+// thread sets to non-zero. Opening the device, writing and waiting for the
+// reply all stop at the deadline, and the call then returns ETIMEDOUT
+// (ECANCELED if cancelled). With a deadline, bWait moves wait until the
+// deadline rather than the default 1.5 s, and with or without one they
+// return 0 once the move completed (or homed) and ETIMEDOUT if it didn't in
+// time; a cancelled move is stopped with MGMSG_MOT_MOVE_STOP, one that runs
+// past the deadline keeps going.
+// APT_SetDeadline applies a deadline and flag to every call the thread
+// makes until it is cleared with APT_SetDeadline(0, NULL), for the calls
+// without a *Dl variant; APT_GetDeadlineStatus then tells whether one of
+// them ran out.
+double WINAPI APT_Now(void);
+long WINAPI APT_SetDeadline(double dDeadline, volatile long *plCancel);
+long WINAPI APT_GetDeadlineStatus(void);
+
+long WINAPI InitHWDeviceDl(long lSerialNum, double dDeadline, volatile long *plCancel);
+long WINAPI GetHWInfoDl(long lSerialNum, TCHAR *szModel, long lModelLen, TCHAR *szSWVer, long lSWVerLen, TCHAR *szHWNotes, long lHWNotesLen, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_IdentifyDl(long lSerialNum, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_EnableHWChannelDl(long lSerialNum, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_DisableHWChannelDl(long lSerialNum, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetVelParamsDl(long lSerialNum, float fMinVel, float fAccn, float fMaxVel, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetVelParamsDl(long lSerialNum, float *pfMinVel, float *pfAccn, float *pfMaxVel, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetHomeParamsDl(long lSerialNum, long lDirection, long lLimSwitch, float fHomeVel, float fZeroOffset, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetHomeParamsDl(long lSerialNum, long *plDirection, long *plLimSwitch, float *pfHomeVel, float *pfZeroOffset, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetBLashDistDl(long lSerialNum, float fBLashDist, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetBLashDistDl(long lSerialNum, float *pfBLashDist, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetStageAxisInfoDl(long lSerialNum, float *pfMinPos, float *pfMaxPos, long *plUnits, float *pfPitch, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetHWLimSwitchesDl(long lSerialNum, long lRevLimSwitch, long lFwdLimSwitch, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetHWLimSwitchesDl(long lSerialNum, long *plRevLimSwitch, long *plFwdLimSwitch, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetPIDParamsDl(long lSerialNum, long lProp, long lInt, long lDeriv, long lIntLimit, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetPIDParamsDl(long lSerialNum, long *plProp, long *plInt, long *plDeriv, long *plIntLimit, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetPositionDl(long lSerialNum, float *pfPosition, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_MoveHomeDl(long lSerialNum, BOOL bWait, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_MoveRelativeExDl(long lSerialNum, float fRelDist, BOOL bWait, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_MoveAbsoluteExDl(long lSerialNum, float fAbsPos, BOOL bWait, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_StopProfiledDl(long lSerialNum, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetDCCurrentLoopParamsDl(long lSerialNum, long lProp, long lInt, long lIntLim, long lIntDeadBand, long lFFwd, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetDCCurrentLoopParamsDl(long lSerialNum, long *plProp, long *plInt, long *plIntLim, long *plIntDeadBand, long *plFFwd, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetDCPositionLoopParamsDl(long lSerialNum, long lProp, long lInt, long lIntLim, long lDeriv, long lDerivTime, long lLoopGain, long lVelFFwd, long lAccFFwd, long lPosErrLim, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetDCPositionLoopParamsDl(long lSerialNum, long *plProp, long *plInt, long *plIntLim, long *plDeriv, long *plDerivTime, long *plLoopGain, long *plVelFFwd, long *plAccFFwd, long *plPosErrLim, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetDCMotorOutputParamsDl(long lSerialNum, float fContCurrLim, float fEnergyLim, float fMotorLim, float fMotorBias, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetDCMotorOutputParamsDl(long lSerialNum, float *pfContCurrLim, float *pfEnergyLim, float *pfMotorLim, float *pfMotorBias, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetDCTrackSettleParamsDl(long lSerialNum, long lSettleTime, long lSettleWnd, long lTrackWnd, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetDCTrackSettleParamsDl(long lSerialNum, long *plSettleTime, long *plSettleWnd, long *plTrackWnd, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetDCProfileModeParamsDl(long lSerialNum, long lProfMode, float fJerk, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetDCProfileModeParamsDl(long lSerialNum, long *plProfMode, float *pfJerk, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetDCJoystickParamsDl(long lSerialNum, float fMaxVelLO, float fMaxVelHI, float fAccnLO, float fAccnHI, long lDirSense, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetDCJoystickParamsDl(long lSerialNum, float *pfMaxVelLO, float *pfMaxVelHI, float *pfAccnLO, float *pfAccnHI, long *plDirSense, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_SetDCSettledCurrentLoopParamsDl(long lSerialNum, long lSettledProp, long lSettledInt, long lSettledIntLim, long lSettledIntDeadBand, long lSettledFFwd, double dDeadline, volatile long *plCancel);
+long WINAPI MOT_GetDCSettledCurrentLoopParamsDl(long lSerialNum, long *plSettledProp, long *plSettledInt, long *plSettledIntLim, long *plSettledIntDeadBand, long *plSettledFFwd, double dDeadline, volatile long *plCancel);
+
+// Device capabilities.
+//
+// What libapt knows about each controller family, from a table keyed by
+// serial number prefix (lSerialNum / 1000000) and hardware type: the model,
+// channel count, addressing (0x50 for standalone controllers, or a 0x11
+// motherboard with the channels in bays 0x21, 0x22...), which message
+// groups the controller answers and the encoder scaling. Requests outside
+// ulMessages return ENOTSUP straight away rather than waiting for a reply
+// that never comes. dVelScale, dAccnScale and dJerkScale convert encoder
+// counts per second (per second squared, cubed) to the controller's units,
+// 0 when not known.
+// APT_AddDeviceCaps adds (or overrides) a table row at run time, for
+// hardware libapt doesn't know about yet; devices already found pick it up
+// straight away. HWTYPE_ values from 100 on are libapt's own, APTAPI.h has
+// none for these controllers.
+#define HWTYPE_BMS001       100 // 1 Ch legacy mini stepper driver
+#define HWTYPE_BMS002       101 // 2 Ch legacy mini stepper driver
+#define HWTYPE_KST101       102 // 1 Ch stepper driver K-Cube
+#define HWTYPE_KDC101       103 // 1 Ch DC servo driver K-Cube
+#define HWTYPE_KBD101       104 // 1 Ch brushless DC servo driver K-Cube
+#define HWTYPE_TBD001       105 // 1 Ch brushless DC servo driver T-Cube
+#define HWTYPE_K10CR1       106 // K10CR1 integrated rotation mount
+
+#define APT_CAP_VELPARAMS           0x00000001
+#define APT_CAP_BACKLASH            0x00000002
+#define APT_CAP_HOMEPARAMS          0x00000004
+#define APT_CAP_LIMSWITCH           0x00000008
+#define APT_CAP_DCPID               0x00000010
+#define APT_CAP_POSITIONLOOP        0x00000020
+#define APT_CAP_CURRENTLOOP         0x00000040
+#define APT_CAP_SETTLEDCURRENTLOOP  0x00000080
+#define APT_CAP_MOTOROUTPUT         0x00000100
+#define APT_CAP_TRACKSETTLE         0x00000200
+#define APT_CAP_PROFILEMODE         0x00000400
+#define APT_CAP_JOYSTICK            0x00000800
+#define APT_CAP_STAGEAXIS           0x00001000  // MGMSG_MOT_REQ_PMDSTAGEAXISPARAMS
+#define APT_CAP_TRIGGER             0x00002000  // MGMSG_MOT_SET_TRIGGER
+#define APT_CAP_KCUBETRIGGER        0x00004000  // MGMSG_MOT_SET_KCUBETRIGIOCONFIG / POSTRIGPARAMS
+#define APT_CAP_DCSTATUS            0x00008000  // status updates are MGMSG_MOT_GET_DCSTATUSUPDATE
+#define APT_CAP_ALL                 0xFFFFFFFF
+
+typedef struct {
+    long lSerialPrefix;         // 0 to match on lHWType only
+    long lHWType;
+    char szModel[16];
+    long lNumChannels;
+    long lDestByte;
+    long lNumBays;              // 0 unless the channels are addressed as bays
+    unsigned long ulMessages;   // APT_CAP_* bits
+    double dVelScale;
+    double dAccnScale;
+    double dJerkScale;
+    double dCountsPerUnit;      // per mm or degree, 0 if it depends on the stage
+} APT_DEVICE_CAPS;
+
+long WINAPI APT_GetDeviceCaps(long lSerialNum, APT_DEVICE_CAPS *pCaps);
+long WINAPI APT_AddDeviceCaps(const APT_DEVICE_CAPS *pCaps);
+
+// Axis handles.
+//
+// APT_OpenAxis gives a handle to one channel of a controller, addressed
+// the way the controller wants it: the bay (0x21, 0x22...) of a rack
+// controller such as the BSC103 or BBD103, or the channel ident of the
+// older multi-channel ones. The APT_Axis* calls take an array of handles,
+// which must all be channels of the same controller: the commands go out
+// back to back in one write and the replies are routed to their axis by
+// source byte (and channel ident), so the channels move, home and report
+// their positions together. With bWait the moves wait for every axis to
+// finish; a deadline (see APT_SetDeadline) applies as for MOT_MoveAbsoluteEx.
+// An axis that stops short of its move (a stop command, a limit switch)
+// makes the call return ECANCELED, with its position and homed status unknown.
+#define APT_MAX_AXES    32
+
+long WINAPI APT_OpenAxis(long lSerialNum, long lChanID, long *plAxis);
+long WINAPI APT_CloseAxis(long lAxis);
+long WINAPI APT_AxisGetInfo(long lAxis, long *plSerialNum, long *plChanID, long *plDestByte);
+long WINAPI APT_AxisGetPositions(long lNumAxes, const long *plAxes, float *pfPositions);
+long WINAPI APT_AxisMoveAbsolute(long lNumAxes, const long *plAxes, const float *pfPositions, BOOL bWait);
+long WINAPI APT_AxisMoveRelative(long lNumAxes, const long *plAxes, const float *pfDistances, BOOL bWait);
+long WINAPI APT_AxisMoveHome(long lNumAxes, const long *plAxes, BOOL bWait);
+long WINAPI APT_AxisStop(long lNumAxes, const long *plAxes);
+
+// The status bits of the axes (MGMSG_MOT_GET_STATUSUPDATE, or
+// MGMSG_MOT_GET_DCSTATUSUPDATE for DC servo and brushless controllers)
+// and their positions (pfPositions may be NULL). Commands to a controller
+// are carried out in order, so the status asked for right after a move
+// command already shows the move.
+#define APT_STATUS_FWD_HWLIMIT      0x00000001
+#define APT_STATUS_REV_HWLIMIT      0x00000002
+#define APT_STATUS_INMOTION_FWD     0x00000010
+#define APT_STATUS_INMOTION_REV     0x00000020
+#define APT_STATUS_JOGGING_FWD      0x00000040
+#define APT_STATUS_JOGGING_REV      0x00000080
+#define APT_STATUS_HOMING           0x00000200
+#define APT_STATUS_HOMED            0x00000400
+#define APT_STATUS_ENABLED          0x80000000
+#define APT_STATUS_MOVING           (APT_STATUS_INMOTION_FWD | APT_STATUS_INMOTION_REV \
+                                    | APT_STATUS_JOGGING_FWD | APT_STATUS_JOGGING_REV | APT_STATUS_HOMING)
+
+long WINAPI APT_AxisGetStatus(long lNumAxes, const long *plAxes, unsigned long *pulStatusBits, float *pfPositions);
+
+// The positions of axes of any number of controllers, taken together:
+// every controller is opened first, then each gets the MGMSG_MOT_REQ_POSCOUNTER
+// for all its axes in one write, one controller right after the other, and
+// the replies are collected once they have all gone out. The whole
+// snapshot takes about one round trip rather than one per controller.
+// pdTimes[k] is when the request for axis k went out (APT_Now() clock,
+// 0 if it didn't answer), which is when the controller latched its
+// counter give or take the USB latency, and *pdSkew (may be NULL) the
+// spread of those times over the axes that answered.
+long WINAPI APT_SnapshotPositions(long lNumAxes, const long *plAxes, float *pfPositions, double *pdTimes, double *pdSkew);
+
+// Position compare, for fly scans.
+//
+// Events at given positions of an axis: a list of points
+// (APT_CompareSetPoints) or lNumPoints equally spaced ones from fStart
+// (APT_CompareSetInterval), in the order the scan crosses them.
+// APT_CompareRun starts the moves of the axes (all of one controller, as
+// for the APT_Axis* calls) to pfTargets, or follows moves already under way
+// if pfTargets is NULL, and asks for their status back to back with the
+// controller kept open until every point has been crossed (0), the axes
+// stop short of some of them (ERANGE), the callback returns non-zero (that
+// value) or the deadline (see APT_SetDeadline). A cancelled run, or one
+// stopped by the callback, stops the axes.
+// Every crossing is timed by interpolating between the samples on either
+// side of the point (points the axis is on or already past, going the way
+// it moves, at the first sample count as crossed then) and delivered at
+// once: to pfnCallback (may be NULL),
+// called from within APT_CompareRun, so it must be quick and must not call
+// libapt, and to a lock-free queue which one other thread can empty with
+// APT_ComparePoll (EAGAIN when empty) while the run goes on; a full queue
+// drops the event. On a K-Cube (APT_CAP_KCUBETRIGGER), equally spaced
+// points with a pulse width are also programmed into the controller, whose
+// TRIG1 output then pulses at the exact encoder counts
+// (MGMSG_MOT_SET_KCUBEPOSTRIGPARAMS); the events still come from the status
+// samples, with lHardware set. APT_CompareGetStats gives, per axis and for
+// the last run, the latency between crossing and detection and its jitter
+// (standard deviation), and how far past the points the stage was seen.
+#define APT_COMPARE_QUEUE   1024
+
+typedef struct {
+    long lAxis;
+    long lPoint;            // which point, from 0
+    float fTarget;          // the point
+    float fPosition;        // the first sample past it
+    double dCrossing;       // APT_Now() when the axis crossed it, interpolated
+    double dDetected;       // APT_Now() of the sample past it
+    long lHardware;         // the trigger output pulsed there too
+} APT_COMPARE_EVENT;
+
+typedef struct {
+    long lNumPoints;
+    long lNumCrossed;
+    long lHardware;
+    long lDropped;          // events the queue had no room for
+    double dMeanLatency;    // seconds
+    double dMaxLatency;
+    double dJitter;
+    float fMeanError;       // |fPosition - fTarget|, encoder counts
+    float fMaxError;
+} APT_COMPARE_STATS;
+
+typedef long (WINAPI *APT_COMPARECALLBACK)(const APT_COMPARE_EVENT *pEvent, void *pUserData);
+
+long WINAPI APT_CompareSetPoints(long lAxis, long lNumPoints, const float *pfPoints);
+long WINAPI APT_CompareSetInterval(long lAxis, float fStart, float fInterval, long lNumPoints, long lPulseWidthUs);
+long WINAPI APT_CompareClear(long lAxis);
+long WINAPI APT_CompareRun(long lNumAxes, const long *plAxes, const float *pfTargets,
+        APT_COMPARECALLBACK pfnCallback, void *pUserData);
+long WINAPI APT_ComparePoll(APT_COMPARE_EVENT *pEvent);
+long WINAPI APT_CompareGetStats(long lAxis, APT_COMPARE_STATS *pStats);
+
+// Synchronized start across controllers.
+//
+// APT_SyncPrepare opens each controller (on its current channel) and loads
+// its target position with MGMSG_MOT_SET_MOVEABSPARAMS, which doesn't move
+// anything yet. The controllers stay open until APT_SyncStart or
+// APT_SyncRelease, so the other calls can't talk to them in between; a
+// second APT_SyncPrepare releases the first group. APT_SyncStart then sends
+// each of them the 6 byte MGMSG_MOT_MOVE_ABSOLUTE back to back, and gives
+// the time between the first and the last trigger in *pdSkew (seconds) and
+// when each went out in pdStartTimes (APT_Now() clock, may be NULL). With
+// bWait it waits for every move to end, returning ETIMEDOUT if some didn't;
+// a deadline (see APT_SetDeadline) applies as for MOT_MoveAbsoluteEx.
+#define APT_SYNC_MAX    16
+
+long WINAPI APT_SyncPrepare(long lNumDevices, const long *plSerialNums, const float *pfAbsPos);
+long WINAPI APT_SyncStart(BOOL bWait, double *pdSkew, double *pdStartTimes);
+long WINAPI APT_SyncRelease(void);
+
+// Loop gain auto-tuning.
+//
+// APT_MeasureStep makes a relative move of fStep encoder counts with the
+// gains as they are, sampling the position as fast as the controller
+// answers, and gives the 10-90% rise time and the settle time (from the
+// move command until the stage stays within fSettleBand counts, -1 if it
+// never did) in seconds, and the overshoot as a fraction of the step.
+// APT_TunePID steps back and forth with different proportional and
+// derivative gains (the DC PID block, or the position loop of brushless
+// controllers) and keeps the gains with the shortest settle time whose
+// overshoot stays under fMaxOvershoot. The controller is left with those
+// gains, or the ones it had if nothing met the limit (ERANGE); save them
+// with APT_SaveConfig. pOptions may be NULL for the defaults: 20000 count
+// steps, 5% overshoot, a 20 count band, 2 s per step and 24 trials.
+#define APT_TUNE_MAX_TRIALS 64
+
+typedef struct {
+    float fStep;
+    float fMaxOvershoot;
+    float fSettleBand;
+    double dMaxStepTime;
+    long lMaxTrials;
+} APT_TUNE_OPTIONS;
+
+typedef struct {
+    long lProp;
+    long lInt;
+    long lDeriv;
+    double dRiseTime;           // the worse of the two steps
+    double dOvershoot;
+    double dSettleTime;
+} APT_TUNE_TRIAL;
+
+typedef struct {
+    long lProp;
+    long lInt;
+    long lDeriv;
+    long lIntLimit;
+    APT_TUNE_TRIAL Start;       // with the gains we started from
+    APT_TUNE_TRIAL Best;        // with the gains we ended up with
+    long lNumTrials;
+    APT_TUNE_TRIAL Trials[APT_TUNE_MAX_TRIALS];
+} APT_TUNE_RESULT;
+
+long WINAPI APT_MeasureStep(long lSerialNum, float fStep, const APT_TUNE_OPTIONS *pOptions,
+        double *pdRiseTime, double *pdOvershoot, double *pdSettleTime);
+long WINAPI APT_TunePID(long lSerialNum, const APT_TUNE_OPTIONS *pOptions, APT_TUNE_RESULT *pResult);
+
+// In-position moves.
+//
+// Move and wait like MOT_MoveAbsoluteEx / MOT_MoveRelativeEx with bWait,
+// but return as soon as the position counter has stayed within fTolerance
+// encoder counts of the target for fDwellMs, rather than waiting for the
+// controller's own MGMSG_MOT_MOVE_COMPLETED and its settle window. The
+// position is streamed from the controller while the stage moves. Return
+// 0 once in position, with the time from the move command in *pfSettleMs
+// (may be NULL), or ETIMEDOUT if it never got there: by the deadline (see
+// APT_SetDeadline) or, without one, twice the predicted move time plus
+// 1.5 s. A cancelled move is stopped.
+long WINAPI APT_MoveAbsoluteInPos(long lSerialNum, float fAbsPos, float fTolerance, float fDwellMs, float *pfSettleMs);
+long WINAPI APT_MoveRelativeInPos(long lSerialNum, float fRelDist, float fTolerance, float fDwellMs, float *pfSettleMs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
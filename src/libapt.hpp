@@ -0,0 +1,433 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Optional C++20 layer over libapt, header only.
+//
+//     apt::Session session;                       // APTInit ... APTCleanUp
+//     apt::Device stage(session, 83000001);       // InitHWDevice
+//     apt::Axis x = stage.axis();                 // APT_OpenAxis ... APT_CloseAxis
+//
+//     apt::task scan(apt::Axis &x) {
+//         co_await x.home();
+//         for (float p = 0; p < 1e5; p += 1e4) {
+//             co_await x.move_to(p, 2s);
+//             float at = co_await x.position();
+//         }
+//     }
+//
+// libapt is not re-entrant, so every call goes through the session's lock
+// (Session::call for the blocking ones). The awaitables don't block: a move
+// is started without waiting, and the session's dispatch thread then polls
+// the status of every move in progress (APT_AxisGetStatus) and resumes each
+// coroutine, on the dispatch thread, as soon as its move is over. Many
+// stages can so move at once with one thread doing the talking. The
+// operation state lives in the awaiter, that is in the coroutine frame, so
+// there is no heap allocation per call. Errors are thrown as apt::error,
+// with the libapt return code; a timeout stops the move and throws
+// ETIMEDOUT.
+
+#ifndef LIBAPT_HPP
+#define LIBAPT_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <cerrno>
+
+#ifndef WIN32
+    typedef int BOOL;
+    typedef char TCHAR;
+    #define WINAPI
+#endif
+
+#include "APTAPI.h"
+#include "libapt.h"
+
+namespace apt {
+
+using seconds = std::chrono::duration<double>;
+
+class error : public std::runtime_error {
+public:
+    error(const char *what, long code)
+        : std::runtime_error(std::string(what) + " failed (" + std::to_string(code) + ")"), code_(code) {}
+    long code() const noexcept { return code_; }
+private:
+    long code_;
+};
+
+inline void check(long ret, const char *what) {
+    if (ret != 0) throw error(what, ret);
+}
+
+class Session;
+
+namespace detail {
+
+// One call in flight: started and polled on the dispatch thread, with the
+// session's lock held.
+struct op {
+    op *next = nullptr;
+    std::coroutine_handle<> handle;
+    double deadline = 0;
+    long ret = 0;
+
+    // 0 and done, 0 and not done yet, or an error
+    virtual long start(bool &done) = 0;
+    virtual long poll(bool &done) { done = true; return 0; }
+    virtual void stop() {}
+    virtual ~op() = default;
+};
+
+} // namespace detail
+
+class Session {
+public:
+    explicit Session(std::chrono::milliseconds pollInterval = std::chrono::milliseconds(5))
+        : poll_(pollInterval) {
+        check(APTInit(), "APTInit");
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~Session() {
+        {
+            std::lock_guard<std::mutex> l(queueLock_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+        APTCleanUp();
+    }
+
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    // Runs a blocking libapt call with the session's lock held.
+    template <class F>
+    auto call(F &&f) -> decltype(f()) {
+        std::lock_guard<std::mutex> l(aptLock_);
+        return f();
+    }
+
+    // for detail::op users only
+    void submit(detail::op *o) {
+        {
+            std::lock_guard<std::mutex> l(queueLock_);
+            o->next = incoming_;
+            incoming_ = o;
+        }
+        wake_.notify_one();
+    }
+
+private:
+    void finish(detail::op *o, long ret, detail::op *&done) {
+        o->ret = ret;
+        o->next = done;
+        done = o;
+    }
+
+    void run() {
+        detail::op *active = nullptr;
+
+        while (true) {
+            detail::op *fresh, *done = nullptr, **pp;
+            bool stopping;
+            {
+                std::unique_lock<std::mutex> l(queueLock_);
+                if (incoming_ == nullptr && !stopping_)
+                    wake_.wait_for(l, active != nullptr ? poll_ : std::chrono::milliseconds(1000));
+                fresh = incoming_;
+                incoming_ = nullptr;
+                stopping = stopping_;
+            }
+
+            {
+                std::lock_guard<std::mutex> l(aptLock_);
+
+                // new calls
+                while (fresh != nullptr) {
+                    detail::op *o = fresh;
+                    bool over = false;
+                    long ret;
+
+                    fresh = o->next;
+                    APT_SetDeadline(o->deadline, nullptr);
+                    ret = o->start(over);
+                    APT_SetDeadline(0, nullptr);
+                    if (ret != 0 || over) {
+                        finish(o, ret, done);
+                    } else {
+                        o->next = active;
+                        active = o;
+                    }
+                }
+
+                // the moves in progress
+                for (pp = &active; *pp != nullptr;) {
+                    detail::op *o = *pp;
+                    bool over = false;
+                    long ret;
+
+                    if (stopping) {
+                        o->stop();
+                        ret = ECANCELED;
+                    } else if (o->deadline > 0 && APT_Now() >= o->deadline) {
+                        o->stop();
+                        ret = ETIMEDOUT;
+                    } else {
+                        ret = o->poll(over);
+                        if (ret == 0 && !over) {
+                            pp = &o->next;
+                            continue;
+                        }
+                    }
+                    *pp = o->next;
+                    finish(o, ret, done);
+                }
+            }
+
+            // resumed outside the locks, they may well submit again
+            while (done != nullptr) {
+                detail::op *o = done;
+                done = o->next;
+                o->handle.resume();
+            }
+            if (stopping && active == nullptr) {
+                std::lock_guard<std::mutex> l(queueLock_);
+                if (incoming_ == nullptr) break;
+            }
+        }
+    }
+
+    std::chrono::milliseconds poll_;
+    std::mutex aptLock_;
+    std::mutex queueLock_;
+    std::condition_variable wake_;
+    detail::op *incoming_ = nullptr;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+// The awaitable for one call: Op is the detail::op with the call itself,
+// whose result() gives what co_await evaluates to.
+template <class Op>
+class awaitable : public Op {
+public:
+    template <class... Args>
+    awaitable(Session &s, seconds timeout, Args &&...args)
+        : Op(std::forward<Args>(args)...), session_(s) {
+        if (timeout.count() > 0) this->deadline = APT_Now() + timeout.count();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        this->handle = h;
+        session_.submit(this);
+    }
+    auto await_resume() {
+        check(this->ret, Op::name);
+        return this->result();
+    }
+
+private:
+    Session &session_;
+};
+
+namespace detail {
+
+struct axis_op : op {
+    long axis;
+    explicit axis_op(long a) : axis(a) {}
+
+    // over once the status no longer shows any motion
+    long poll(bool &done) override {
+        unsigned long bits = 0;
+        long ret = APT_AxisGetStatus(1, &axis, &bits, nullptr);
+        if (ret == ETIMEDOUT) return 0;     // a lost reply, ask again next time
+        done = ret == 0 && !(bits & APT_STATUS_MOVING);
+        return ret;
+    }
+    void stop() override { APT_AxisStop(1, &axis); }
+    void result() {}
+};
+
+struct move_op : axis_op {
+    static constexpr const char *name = "move";
+    float value;
+    bool relative;
+    move_op(long a, float v, bool rel) : axis_op(a), value(v), relative(rel) {}
+    long start(bool &) override {
+        return relative ? APT_AxisMoveRelative(1, &axis, &value, false)
+                        : APT_AxisMoveAbsolute(1, &axis, &value, false);
+    }
+};
+
+struct home_op : axis_op {
+    static constexpr const char *name = "home";
+    explicit home_op(long a) : axis_op(a) {}
+    long start(bool &) override { return APT_AxisMoveHome(1, &axis, false); }
+};
+
+struct position_op : op {
+    static constexpr const char *name = "position";
+    long axis;
+    float pos = 0;
+    explicit position_op(long a) : axis(a) {}
+    long start(bool &done) override {
+        done = true;
+        return APT_AxisGetPositions(1, &axis, &pos);
+    }
+    float result() { return pos; }
+};
+
+} // namespace detail
+
+class Axis;
+
+class Device {
+public:
+    Device(Session &s, long serial) : session_(s), serial_(serial) {
+        check(s.call([&] { return InitHWDevice(serial); }), "InitHWDevice");
+    }
+
+    long serial() const noexcept { return serial_; }
+    Session &session() const noexcept { return session_; }
+
+    APT_DEVICE_CAPS caps() const {
+        APT_DEVICE_CAPS c;
+        check(session_.call([&] { return APT_GetDeviceCaps(serial_, &c); }), "APT_GetDeviceCaps");
+        return c;
+    }
+
+    Axis axis(long chan = 0);
+
+private:
+    Session &session_;
+    long serial_;
+};
+
+class Axis {
+public:
+    Axis(Device &d, long chan) : session_(&d.session()) {
+        check(session_->call([&] { return APT_OpenAxis(d.serial(), chan, &axis_); }), "APT_OpenAxis");
+    }
+    ~Axis() {
+        if (axis_ >= 0) session_->call([&] { return APT_CloseAxis(axis_); });
+    }
+
+    Axis(Axis &&o) noexcept : session_(o.session_), axis_(std::exchange(o.axis_, -1)) {}
+    Axis &operator=(Axis &&o) noexcept {
+        std::swap(session_, o.session_);
+        std::swap(axis_, o.axis_);
+        return *this;
+    }
+    Axis(const Axis &) = delete;
+    Axis &operator=(const Axis &) = delete;
+
+    long handle() const noexcept { return axis_; }
+
+    // timeouts of 0 (or less) wait for ever
+    awaitable<detail::move_op> move_to(float pos, seconds timeout = std::chrono::seconds(60)) {
+        return {*session_, timeout, axis_, pos, false};
+    }
+    awaitable<detail::move_op> move_by(float dist, seconds timeout = std::chrono::seconds(60)) {
+        return {*session_, timeout, axis_, dist, true};
+    }
+    awaitable<detail::home_op> home(seconds timeout = std::chrono::seconds(120)) {
+        return {*session_, timeout, axis_};
+    }
+    awaitable<detail::position_op> position(seconds timeout = std::chrono::seconds(1)) {
+        return {*session_, timeout, axis_};
+    }
+
+    // blocking, for use outside coroutines
+    void stop() {
+        check(session_->call([&] { return APT_AxisStop(1, &axis_); }), "APT_AxisStop");
+    }
+
+private:
+    Session *session_;
+    long axis_ = -1;
+};
+
+inline Axis Device::axis(long chan) {
+    return Axis(*this, chan);
+}
+
+// A minimal coroutine type to run the awaitables with: starts at once,
+// wait() blocks until it is over and rethrows what it threw.
+class task {
+public:
+    struct promise_type {
+        std::mutex lock;
+        std::condition_variable cv;
+        bool over = false;
+        std::exception_ptr error;
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept {
+            struct signal {
+                bool await_ready() noexcept { return false; }
+                void await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    promise_type &p = h.promise();
+                    std::lock_guard<std::mutex> l(p.lock);
+                    p.over = true;
+                    p.cv.notify_all();
+                }
+                void await_resume() noexcept {}
+            };
+            return signal{};
+        }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    task(task &&o) noexcept : h_(std::exchange(o.h_, {})) {}
+    task(const task &) = delete;
+    ~task() {
+        if (h_) {
+            wait_over();
+            h_.destroy();
+        }
+    }
+
+    void wait() {
+        wait_over();
+        if (h_.promise().error) std::rethrow_exception(h_.promise().error);
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+
+    void wait_over() {
+        std::unique_lock<std::mutex> l(h_.promise().lock);
+        h_.promise().cv.wait(l, [&] { return h_.promise().over; });
+    }
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+} // namespace apt
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Internal declarations shared by the libapt source files, not installed.
+
+#ifndef LIBAPT_PRIVATE_H
+#define LIBAPT_PRIVATE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftdi.h>
+#include <errno.h>
+#include <limits.h>
+#include "hexdump.h"
+
+#define VENDOR_ID 0x403
+#define PRODUCT_ID 0xfaf0
+
+//how long a bWait move waits for the end of the move without a deadline (ms)
+#define MOVE_TIMEOUT 1500
+
+#ifdef WIN32
+    #include <windows.h>
+#elif _POSIX_C_SOURCE >= 199309L
+    #include <time.h>   // for nanosleep
+#else
+    #include <unistd.h> // for usleep
+#endif
+
+#ifndef WIN32
+    #include <time.h>   // for clock_gettime
+#endif
+
+#ifndef WIN32
+    typedef enum { false, true } BOOL;
+    typedef char TCHAR;
+    #define WINAPI
+#endif
+
+#include "APTAPI.h"
+#include "libapt.h"
+
+// what's in aptInfo[i] that came from (or was saved to) the state cache
+#define CACHED_INFO         0x01
+#define CACHED_STAGEAXIS    0x02
+#define CACHED_VELPARAMS    0x04
+#define CACHED_HOMED        0x08
+#define CACHED_PROFILEMODE  0x10
+#define CACHED_TRANSPORT    0x20
+
+// channel limits in encoder counts, per second (squared, cubed)
+typedef struct {
+     double vmax;
+     double accn;
+     double jerk;   //0 for a trapezoidal profile
+} MOTION_LIMITS;
+
+// running sums for the predicted vs observed move time fit
+typedef struct {
+     double n;
+     double sp;
+     double so;
+     double spp;
+     double spo;
+     long count;
+} MOTION_CALIB;
+
+typedef struct {
+     long SerialNumber;
+     char ModelNumber[9];
+     long Type;
+     long HardwareType;
+     char DestinationByte; //depends on type of controller (and channel, for bays)
+     const APT_DEVICE_CAPS *Caps;
+     char FirmwareVersion[13];
+     char Notes[49];
+     long HardwareVersion;
+     long ModState;
+     long NumberChannels;
+     long ChannelId;
+
+     //these are the axis value (changed when changing channel);
+     long StageId;
+     long AxisId;
+     char PartNoAxis[17];
+     long SerialNumAxis;
+     long CntsPerUnit;
+     long MinPos;
+     long MaxPos;
+     long MaxAccn;
+     long MaxDec;
+     long MaxVel;
+     long Units;
+     float Pitch;
+
+     //velocity params, as last read from or written to the channel
+     float VelMin;
+     float VelAccn;
+     float VelMax;
+
+     //profile mode params (DC_PROFILEMODE_*)
+     long ProfMode;
+     float Jerk;
+
+     //last known position, and how well the motion model did so far
+     float Position;
+     long PositionValid;
+     MOTION_CALIB Calib;
+
+     //FTDI settings used when opening the device
+     APT_TRANSPORT_SETTINGS Transport;
+
+     long Homed;
+     long Cached;   //CACHED_* bits
+} MY_APT_INFO;
+
+extern int DEBUG;
+extern int numDevs;
+extern struct ftdi_context *ftdic;
+extern MY_APT_INFO *aptInfo;
+
+void sleep_ms(int milliseconds);
+double apt_time(void);
+long read_reply(char *buf, long len, int timeout_ms);
+long read_frame(char *buf, long maxlen, int timeout_ms);
+long GetIndex(long lSerialNum, long *index);
+long ftdi_open_apt_index(long i);
+void homed_confirm(long i);
+long chan_get(long i, long lChanID, unsigned short req, char *buf, long len);
+
+// caps.c
+long caps_init(long i);
+void caps_refine(long i);
+long caps_has(long i, unsigned long ulCap);
+long caps_dest(long i, long lChanID);
+long caps_ident(long i);
+long caps_chan_ident(long i, long lChanID);
+
+// statecache.c
+long cache_open(const char *szPath);
+void cache_close(void);
+long cache_load(long i);
+void cache_store(long i);
+
+// deadline.c
+typedef struct {
+     double deadline;           //apt_time(), 0 for none
+     volatile long *cancel;
+     long status;               //0, ETIMEDOUT or ECANCELED
+} DEADLINE;
+
+long deadline_check(void);
+long deadline_remaining_ms(void);
+void deadline_push(double dDeadline, volatile long *plCancel, DEADLINE *saved);
+long deadline_pop(DEADLINE *saved, long ret);
+void deadline_suspend(DEADLINE *saved);
+
+// transport.c
+void transport_init(long i);
+long transport_apply(const APT_TRANSPORT_SETTINGS *s);
+
+// motion.c
+long motion_limits(long lSerialNum, long lChanID, MOTION_LIMITS *lim);
+double motion_time(const MOTION_LIMITS *lim, double d);
+double motion_predict(long i, const MOTION_LIMITS *lim, double d);
+void motion_observe(long i, double dDistance, double dSeconds);
+
+// inpos.c
+long write_short(unsigned short id, long i, char param2);
+long poll_position(long i, double *pdPos, long *plCompleted);
+
+// router.c
+long axis_check(long lNumAxes, const long *plAxes, long *pi);
+void axis_address(long lAxis, char *pcDest, char *pcChanIdent);
+long axis_status(long lNumAxes, const long *plAxes, long i, unsigned long *pulStatusBits, float *pfPositions);
+
+#endif
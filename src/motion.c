@@ -0,0 +1,305 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Motion model: predicts how long a move takes and where the stage is along
+// the way, from the channel's velocity and profile mode parameters.
+//
+// A trapezoidal move accelerates at Accn up to MaxVel, cruises, then
+// decelerates. An S-curve move also limits the jerk, which turns each
+// acceleration ramp into three segments (jerk up, constant acceleration,
+// jerk down). Short moves never reach MaxVel (or even Accn) and the
+// profile is shrunk accordingly.
+//
+// The predictions are calibrated against the moves that actually complete:
+// MOT_MoveRelativeEx and MOT_MoveAbsoluteEx (from a known position) report
+// the time from the move command to MOVE_COMPLETED, and a least squares fit
+// observed = scale * predicted + offset is kept per device, with older
+// moves slowly forgotten.
+
+#include "libapt_private.h"
+
+#include <float.h>
+#include <math.h>
+
+// The controller units come from the capability table (caps.c). Where it
+// doesn't know them, assume a DC servo controller like the TDC001:
+// velocities and accelerations in encoder counts per sampling interval,
+// scaled by 65536, and the jerk per sampling interval cubed, by 2^32.
+#define DC_SAMPLE_INTERVAL  (2048.0 / 6e6)
+
+// weight of the older moves in the calibration, applied at every new one
+#define CALIB_FORGET        0.98
+
+// up to seven segments of constant jerk
+typedef struct {
+    int n;
+    double dt[7];
+    double j[7];
+    double a0[7];
+    double v0[7];
+    double p0[7];
+    double total;
+} PROFILE;
+
+long motion_limits(long lSerialNum, long lChanID, MOTION_LIMITS *lim) {
+    long i, lProfMode = DC_PROFILEMODE_TRAPEZOIDAL, ret;
+    float fMinVel = 0, fAccn = 0, fMaxVel = 0, fJerk = 0;
+    char buf[20];
+    double T = DC_SAMPLE_INTERVAL, vs, as, js;
+
+    memset(lim, 0, sizeof(MOTION_LIMITS));
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+
+    vs = aptInfo[i].Caps->dVelScale > 0 ? aptInfo[i].Caps->dVelScale : T * 65536.0;
+    as = aptInfo[i].Caps->dAccnScale > 0 ? aptInfo[i].Caps->dAccnScale : T * T * 65536.0;
+    js = aptInfo[i].Caps->dJerkScale > 0 ? aptInfo[i].Caps->dJerkScale : T * T * T * 4294967296.0;
+
+    // another channel is asked directly, switching to it would lose the
+    // device's homed status and cached parameters
+    if (lChanID >= 0 && lChanID != aptInfo[i].ChannelId) {
+        //MGMSG_MOT_REQ_VELPARAMS
+        if ((ret = chan_get(i, lChanID, 0x0414, buf, 20)) == 0) {
+            lim->vmax = *(int32_t *)(buf+16) / vs;
+            lim->accn = *(int32_t *)(buf+12) / as;
+        }
+        //MGMSG_MOT_REQ_DCPROFILEMODEPARAMS
+        if (caps_has(i, APT_CAP_PROFILEMODE) && chan_get(i, lChanID, 0x04E4, buf, 18) == 0
+                && *(int16_t *)(buf+8) == DC_PROFILEMODE_SCURVE)
+            lim->jerk = *(uint32_t *)(buf+10) / js;
+        return ret;
+    }
+
+    if ((ret = MOT_GetVelParams(lSerialNum, &fMinVel, &fAccn, &fMaxVel)) == 0) {
+        lim->vmax = fMaxVel / vs;
+        lim->accn = fAccn / as;
+        ret = 0;
+    }
+
+    // a controller the table doesn't know may still not answer this one,
+    // don't ask again once we know
+    if (!(aptInfo[i].Cached & CACHED_PROFILEMODE)) {
+        MOT_GetDCProfileModeParams(lSerialNum, &lProfMode, &fJerk);
+        if (!(aptInfo[i].Cached & CACHED_PROFILEMODE)) {
+            aptInfo[i].ProfMode = DC_PROFILEMODE_TRAPEZOIDAL;
+            aptInfo[i].Jerk = 0;
+            aptInfo[i].Cached |= CACHED_PROFILEMODE;
+        }
+    }
+    if (aptInfo[i].ProfMode == DC_PROFILEMODE_SCURVE && aptInfo[i].Jerk > 0)
+        lim->jerk = aptInfo[i].Jerk / js;
+    return ret;
+}
+
+// Fills p with the profile of a move of distance d >= 0.
+static void profile(const MOTION_LIMITS *lim, double d, PROFILE *p) {
+    double v = lim->vmax, a = lim->accn, j = lim->jerk, tj, ta, tc, dacc;
+    int k;
+
+    memset(p, 0, sizeof(PROFILE));
+    if (d <= 0 || v <= 0 || a <= 0) return;
+
+    if (j <= 0) {
+        // trapezoidal, or triangular if MaxVel can't be reached
+        if (d * a < v * v) v = sqrt(d * a);
+        ta = v / a;
+        tc = (d - v * ta) / v;
+        p->n = 3;
+        p->dt[0] = ta; p->j[0] = 0; p->a0[0] = a;
+        p->dt[1] = tc; p->j[1] = 0; p->a0[1] = 0;
+        p->dt[2] = ta; p->j[2] = 0; p->a0[2] = -a;
+    } else {
+        // S-curve: can Accn be reached before MaxVel?
+        if (v * j < a * a) a = sqrt(v * j);
+        tj = a / j;
+        ta = v / a - tj;
+        dacc = v * (2 * tj + ta) / 2;
+
+        if (2 * dacc > d) {
+            // MaxVel isn't reached, solve for the peak velocity
+            if (d < 2 * a * a * a / (j * j)) {
+                // nor is Accn
+                v = pow(d * sqrt(j) / 2, 2.0 / 3.0);
+                a = sqrt(v * j);
+                tj = a / j;
+                ta = 0;
+            } else {
+                v = (-(a / j) + sqrt((a / j) * (a / j) + 4 * d / a)) * a / 2;
+                tj = a / j;
+                ta = v / a - tj;
+                if (ta < 0) ta = 0;
+            }
+            dacc = v * (2 * tj + ta) / 2;
+        }
+        tc = (d - 2 * dacc) / v;
+        if (tc < 0) tc = 0;
+
+        p->n = 7;
+        p->dt[0] = tj; p->j[0] = j;  p->a0[0] = 0;
+        p->dt[1] = ta; p->j[1] = 0;  p->a0[1] = a;
+        p->dt[2] = tj; p->j[2] = -j; p->a0[2] = a;
+        p->dt[3] = tc; p->j[3] = 0;  p->a0[3] = 0;
+        p->dt[4] = tj; p->j[4] = -j; p->a0[4] = 0;
+        p->dt[5] = ta; p->j[5] = 0;  p->a0[5] = -a;
+        p->dt[6] = tj; p->j[6] = j;  p->a0[6] = -a;
+    }
+
+    // integrate the segments for the starting velocity and position of each
+    for (k = 0; k < p->n; k++) {
+        if (k > 0) {
+            double t = p->dt[k - 1];
+            p->v0[k] = p->v0[k - 1] + p->a0[k - 1] * t + p->j[k - 1] * t * t / 2;
+            p->p0[k] = p->p0[k - 1] + p->v0[k - 1] * t + p->a0[k - 1] * t * t / 2 + p->j[k - 1] * t * t * t / 6;
+        }
+        p->total += p->dt[k];
+    }
+}
+
+static double profile_position(const PROFILE *p, double d, double t) {
+    int k;
+
+    if (t <= 0) return 0;
+    for (k = 0; k < p->n; k++) {
+        if (t <= p->dt[k])
+            return p->p0[k] + p->v0[k] * t + p->a0[k] * t * t / 2 + p->j[k] * t * t * t / 6;
+        t -= p->dt[k];
+    }
+    return d;
+}
+
+double motion_time(const MOTION_LIMITS *lim, double d) {
+    PROFILE p;
+    double v = lim->vmax, a = lim->accn, j = lim->jerk, tj;
+
+    if (d <= 0) return 0;
+    if (v <= 0) return DBL_MAX;
+
+    // closed form for the common cases, the planner calls this a lot
+    if (j <= 0 && a > 0) {
+        if (d * a <= v * v) return 2 * sqrt(d / a);
+        return d / v + v / a;
+    }
+    if (a > 0 && v * j >= a * a) {
+        tj = a / j;
+        if (v * (v / a + tj) <= d) return d / v + v / a + tj;
+    }
+
+    profile(lim, d, &p);
+    return p.total;
+}
+
+// Feeds one completed move to the calibration of device i.
+void motion_observe(long i, double dDistance, double dSeconds) {
+    MOTION_LIMITS lim;
+    MOTION_CALIB *c = &aptInfo[i].Calib;
+    double pred;
+
+    if (motion_limits(aptInfo[i].SerialNumber, -1, &lim) != 0 || lim.vmax <= 0)
+        return;
+    pred = motion_time(&lim, fabs(dDistance));
+
+    c->n = c->n * CALIB_FORGET + 1;
+    c->sp = c->sp * CALIB_FORGET + pred;
+    c->so = c->so * CALIB_FORGET + dSeconds;
+    c->spp = c->spp * CALIB_FORGET + pred * pred;
+    c->spo = c->spo * CALIB_FORGET + pred * dSeconds;
+    c->count++;
+
+    if (DEBUG) printf("Move of %.0f counts: predicted %.3f s, took %.3f s\n", dDistance, pred, dSeconds);
+}
+
+// observed = scale * predicted + offset. With too few or too similar moves,
+// only the offset is fitted.
+static void calib_fit(const MOTION_CALIB *c, double *scale, double *offset) {
+    double det;
+
+    *scale = 1;
+    *offset = 0;
+    if (c->count == 0) return;
+
+    det = c->n * c->spp - c->sp * c->sp;
+    if (c->count >= 3 && det > 1e-9 * c->n * c->spp) {
+        *scale = (c->n * c->spo - c->sp * c->so) / det;
+        *offset = (c->so - *scale * c->sp) / c->n;
+    }
+    if (*scale <= 0.1 || *scale >= 10 || c->count < 3) {
+        *scale = 1;
+        *offset = (c->so - c->sp) / c->n;
+    }
+}
+
+// How long a move of d counts takes on device i, with limits already read
+// (so without a word to the controller, it may be open for something else).
+double motion_predict(long i, const MOTION_LIMITS *lim, double d) {
+    double scale, offset, t;
+
+    t = motion_time(lim, d);
+    calib_fit(&aptInfo[i].Calib, &scale, &offset);
+    if (t > 0) t = scale * t + offset;
+    return t > 0 ? t : 0;
+}
+
+
+long WINAPI APT_PredictMove(long lSerialNum, float fStartPos, float fEndPos, float *pfDuration) {
+    MOTION_LIMITS lim;
+    long i, ret;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if ((ret = motion_limits(lSerialNum, -1, &lim)) != 0) return ret;
+    if (lim.vmax <= 0 || lim.accn <= 0) return EINVAL;
+
+    *pfDuration = (float)motion_predict(i, &lim, fabs(fEndPos - fStartPos));
+    return 0;
+}
+
+long WINAPI APT_PredictPosition(long lSerialNum, float fStartPos, float fEndPos, float fTime, float *pfPosition) {
+    MOTION_LIMITS lim;
+    PROFILE p;
+    double scale, offset, d = fabs(fEndPos - fStartPos), s;
+    long i, ret;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if ((ret = motion_limits(lSerialNum, -1, &lim)) != 0) return ret;
+    if (lim.vmax <= 0 || lim.accn <= 0) return EINVAL;
+
+    // map the wall clock time back onto the ideal profile
+    calib_fit(&aptInfo[i].Calib, &scale, &offset);
+    profile(&lim, d, &p);
+    s = profile_position(&p, d, (fTime - offset) / scale);
+
+    *pfPosition = fEndPos >= fStartPos ? (float)(fStartPos + s) : (float)(fStartPos - s);
+    return 0;
+}
+
+long WINAPI APT_GetMotionModel(long lSerialNum, float *pfScale, float *pfOffset, long *plNumMoves) {
+    double scale, offset;
+    long i;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    calib_fit(&aptInfo[i].Calib, &scale, &offset);
+    *pfScale = (float)scale;
+    *pfOffset = (float)offset;
+    *plNumMoves = aptInfo[i].Calib.count;
+    return 0;
+}
+
+long WINAPI APT_ResetMotionModel(long lSerialNum) {
+    long i;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    memset(&aptInfo[i].Calib, 0, sizeof(MOTION_CALIB));
+    return 0;
+}
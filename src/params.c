@@ -0,0 +1,593 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Motor parameter blocks (MOT_Set/GetPIDParams, MOT_Set/GetHomeParams...)
+// and the configuration snapshots, see APT_SaveConfig in libapt.h.
+//
+// Every parameter block is a SET / REQ / GET message triplet whose data
+// packet is the channel ident followed by a few words and longs, so the
+// blocks are described once in a table and the APTAPI.h functions only map
+// their arguments onto the fields. The snapshots send all the requests (or
+// all the settings) back to back in a single write and then sort out the
+// replies as they come, rather than waiting after every message.
+
+#include "libapt_private.h"
+
+// w: 16 bit word, l: 32 bit long, x: unused word (0 when set, not saved)
+typedef struct {
+    const char *name;
+    unsigned short set, req, get;
+    const char *layout;     // after the channel ident
+    unsigned long cap;      // APT_CAP_* bit of the controllers that know it
+} PARAM_BLOCK;
+
+enum {
+    PB_VELPARAMS,
+    PB_BACKLASH,
+    PB_HOMEPARAMS,
+    PB_LIMSWITCH,
+    PB_DCPID,
+    PB_POSITIONLOOP,
+    PB_CURRENTLOOP,
+    PB_SETTLEDCURRENTLOOP,
+    PB_MOTOROUTPUT,
+    PB_TRACKSETTLE,
+    PB_PROFILEMODE,
+    PB_JOYSTICK,
+    PB_COUNT
+};
+
+static const PARAM_BLOCK blocks[PB_COUNT] = {
+    {"VELPARAMS",           0x0413, 0x0414, 0x0415, "lll",          APT_CAP_VELPARAMS},
+    {"BACKLASH",            0x043A, 0x043B, 0x043C, "l",            APT_CAP_BACKLASH},
+    {"HOMEPARAMS",          0x0440, 0x0441, 0x0442, "wwll",         APT_CAP_HOMEPARAMS},
+    {"LIMSWITCH",           0x0423, 0x0424, 0x0425, "wwllw",        APT_CAP_LIMSWITCH},
+    {"DCPID",               0x04A0, 0x04A1, 0x04A2, "llllw",        APT_CAP_DCPID},
+    {"POSITIONLOOP",        0x04A6, 0x04A7, 0x04A8, "wwlwwwwwlxx",  APT_CAP_POSITIONLOOP},
+    {"CURRENTLOOP",         0x04D4, 0x04D5, 0x04D6, "wwwwwwxx",     APT_CAP_CURRENTLOOP},
+    {"SETTLEDCURRENTLOOP",  0x04E9, 0x04EA, 0x04EB, "wwwwwwxx",     APT_CAP_SETTLEDCURRENTLOOP},
+    {"MOTOROUTPUT",         0x04DA, 0x04DB, 0x04DC, "wwwwxx",       APT_CAP_MOTOROUTPUT},
+    {"TRACKSETTLE",         0x04E0, 0x04E1, 0x04E2, "wwwxx",        APT_CAP_TRACKSETTLE},
+    {"PROFILEMODE",         0x04E3, 0x04E4, 0x04E5, "wlxx",         APT_CAP_PROFILEMODE},
+    {"JOYSTICK",            0x04E6, 0x04E7, 0x04E8, "llllw",        APT_CAP_JOYSTICK},
+};
+
+#define PARAM_MAX_FIELDS    12
+#define PARAM_MAX_FRAME     (6 + 2 + 4 * PARAM_MAX_FIELDS)
+
+// current loop phases, as used by MOT_SetDCCurrentLoopParams
+#define PHASE_AB            2
+
+// DC motor output limits are 0 to 32767 for 0 to 100%
+#define OUTPUT_SCALE        (32767.0 / 100.0)
+
+// config file magic for the binary format ("APTF"), followed by a version
+// word, a frame count word and the MGMSG_MOT_SET_* frames themselves
+#define CONFIG_MAGIC        0x46545041
+#define CONFIG_VERSION      1
+
+static long data_length(const PARAM_BLOCK *b) {
+    long len = 2;
+    const char *f;
+
+    for (f = b->layout; *f; f++) len += (*f == 'l') ? 4 : 2;
+    return len;
+}
+
+// number of values a block carries (what's in the text configs)
+static long num_values(const PARAM_BLOCK *b) {
+    long n = 0;
+    const char *f;
+
+    for (f = b->layout; *f; f++) if (*f != 'x') n++;
+    return n;
+}
+
+static const PARAM_BLOCK *find_get(unsigned short id) {
+    int k;
+
+    for (k = 0; k < PB_COUNT; k++)
+        if (blocks[k].get == id) return &blocks[k];
+    return NULL;
+}
+
+static long frame_req(long i, const PARAM_BLOCK *b, char *buf) {
+    buf[0] = b->req & 0xFF;
+    buf[1] = b->req >> 8;
+    buf[2] = (char)caps_ident(i);
+    buf[3] = 0x00;
+    buf[4] = aptInfo[i].DestinationByte;
+    buf[5] = 0x01;
+    return 6;
+}
+
+static long frame_set(long i, const PARAM_BLOCK *b, const long *v, char *buf) {
+    long len = data_length(b), n = 8;
+    int16_t val16;
+    int32_t val32;
+    const char *f;
+
+    buf[0] = b->set & 0xFF;
+    buf[1] = b->set >> 8;
+    buf[2] = len & 0xFF;
+    buf[3] = len >> 8;
+    buf[4] = aptInfo[i].DestinationByte | 0x80;
+    buf[5] = 0x01;
+
+    //copy Chan Ident
+    val16 = (int16_t)caps_ident(i);
+    memcpy(buf+6,(char *)(&val16),2);
+
+    for (f = b->layout; *f; f++) {
+        if (*f == 'l') {
+            val32 = (int32_t)*v++;
+            memcpy(buf+n,(char *)(&val32),4);
+            n += 4;
+        } else {
+            val16 = (*f == 'x') ? 0 : (int16_t)*v++;
+            memcpy(buf+n,(char *)(&val16),2);
+            n += 2;
+        }
+    }
+    return n;
+}
+
+// Decodes the values of a GET frame. Returns -1 if the frame is too short.
+static long frame_decode(const PARAM_BLOCK *b, const char *buf, long len, long *v) {
+    long n = 8;
+    const char *f;
+
+    if (len < 6 + data_length(b)) return -1;
+    for (f = b->layout; *f; f++) {
+        if (*f == 'l') {
+            *v++ = *(int32_t *)(buf+n);
+            n += 4;
+        } else {
+            if (*f == 'w') *v++ = *(int16_t *)(buf+n);
+            n += 2;
+        }
+    }
+    return 0;
+}
+
+// Sends the nReq requests in txbuf and gathers the GET replies into v (one
+// row of PARAM_MAX_FIELDS per block, marking the blocks found in got).
+// Stops once every block has answered or nothing came for timeout_ms.
+static long gather(const char *txbuf, long txlen, long nReq, long *v, int *got, int timeout_ms) {
+    char buf[PARAM_MAX_FRAME];
+    const PARAM_BLOCK *b;
+    long ret, n = 0;
+    unsigned short id;
+
+    if (txlen > 0 && (ret = ftdi_write_data(ftdic, (unsigned char *)txbuf, txlen)) < 0) return ret;
+
+    while (n < nReq) {
+        if ((ret = read_frame(buf, sizeof(buf), timeout_ms)) < 0) return ret;
+        if (ret == 0) break;
+
+        id = (unsigned char)buf[0] | ((unsigned char)buf[1] << 8);
+        if ((b = find_get(id)) == NULL) {
+            if (DEBUG) hexDump("gather, ignoring", buf, ret);
+            continue;
+        }
+        if (DEBUG) hexDump((char *)b->name, buf, ret);
+        if (!got[b - blocks] && frame_decode(b, buf, ret, v + (b - blocks) * PARAM_MAX_FIELDS) == 0) {
+            got[b - blocks] = 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+static long param_get(long lSerialNum, int k, long *v) {
+    long i, ret;
+    long rows[PB_COUNT * PARAM_MAX_FIELDS];
+    int got[PB_COUNT] = {0};
+    char txbuf[6];
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if (!caps_has(i, blocks[k].cap)) return ENOTSUP;
+    frame_req(i, &blocks[k], txbuf);
+    if (DEBUG) hexDump("param_get txbuf", txbuf, 6);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if ((ret = gather(txbuf, 6, 1, rows, got, 150)) < 0) goto end;
+
+    ret = 0;
+    if (!got[k]) {
+        ret = ETIMEDOUT;
+        goto end;
+    }
+    memcpy(v, rows + k * PARAM_MAX_FIELDS, num_values(&blocks[k]) * sizeof(long));
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+static long param_set(long lSerialNum, int k, const long *v) {
+    long i, len, ret;
+    char txbuf[PARAM_MAX_FRAME];
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if (!caps_has(i, blocks[k].cap)) return ENOTSUP;
+    len = frame_set(i, &blocks[k], v, txbuf);
+    if (DEBUG) hexDump("param_set txbuf", txbuf, len);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if ((ret = ftdi_write_data(ftdic, (unsigned char *)txbuf, len)) < 0) goto end;
+    ret = 0;
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+// The velocity and profile mode parameters are cached (libapt.c), a
+// configuration load must not leave stale values behind.
+static void param_forget(long lSerialNum) {
+    long i;
+
+    if (GetIndex(lSerialNum, &i) < 0) return;
+    aptInfo[i].Cached &= ~(CACHED_VELPARAMS | CACHED_PROFILEMODE);
+    cache_store(i);
+}
+
+
+long WINAPI MOT_SetHomeParams(long lSerialNum, long lDirection, long lLimSwitch, float fHomeVel, float fZeroOffset) {
+    long v[4] = {lDirection, lLimSwitch, (long)fHomeVel, (long)fZeroOffset};
+    return param_set(lSerialNum, PB_HOMEPARAMS, v);
+}
+
+long WINAPI MOT_GetHomeParams(long lSerialNum, long *plDirection, long *plLimSwitch, float *pfHomeVel, float *pfZeroOffset) {
+    long v[PARAM_MAX_FIELDS], ret;
+
+    if ((ret = param_get(lSerialNum, PB_HOMEPARAMS, v)) != 0) return ret;
+    *plDirection = v[0];
+    *plLimSwitch = v[1];
+    *pfHomeVel = (float)v[2];
+    *pfZeroOffset = (float)v[3];
+    return 0;
+}
+
+long WINAPI MOT_SetBLashDist(long lSerialNum, float fBLashDist) {
+    long v[1] = {(long)fBLashDist};
+    return param_set(lSerialNum, PB_BACKLASH, v);
+}
+
+long WINAPI MOT_GetBLashDist(long lSerialNum, float *pfBLashDist) {
+    long v[PARAM_MAX_FIELDS], ret;
+
+    if ((ret = param_get(lSerialNum, PB_BACKLASH, v)) != 0) return ret;
+    *pfBLashDist = (float)v[0];
+    return 0;
+}
+
+long WINAPI MOT_SetHWLimSwitches(long lSerialNum, long lRevLimSwitch, long lFwdLimSwitch) {
+    long v[PARAM_MAX_FIELDS];
+
+    // keep the software limits and limit mode as they are, CW is forward
+    if (param_get(lSerialNum, PB_LIMSWITCH, v) != 0) {
+        memset(v, 0, sizeof(v));
+        v[4] = 1;   //ignore the software limits
+    }
+    v[0] = lFwdLimSwitch;
+    v[1] = lRevLimSwitch;
+    return param_set(lSerialNum, PB_LIMSWITCH, v);
+}
+
+long WINAPI MOT_GetHWLimSwitches(long lSerialNum, long *plRevLimSwitch, long *plFwdLimSwitch) {
+    long v[PARAM_MAX_FIELDS], ret;
+
+    if ((ret = param_get(lSerialNum, PB_LIMSWITCH, v)) != 0) return ret;
+    *plFwdLimSwitch = v[0];
+    *plRevLimSwitch = v[1];
+    return 0;
+}
+
+long WINAPI MOT_SetPIDParams(long lSerialNum, long lProp, long lInt, long lDeriv, long lIntLimit) {
+    //the filter control word enables all four terms
+    long v[5] = {lProp, lInt, lDeriv, lIntLimit, 0x0F};
+    return param_set(lSerialNum, PB_DCPID, v);
+}
+
+long WINAPI MOT_GetPIDParams(long lSerialNum, long *plProp, long *plInt, long *plDeriv, long *plIntLimit) {
+    long v[PARAM_MAX_FIELDS], ret;
+
+    if ((ret = param_get(lSerialNum, PB_DCPID, v)) != 0) return ret;
+    *plProp = v[0];
+    *plInt = v[1];
+    *plDeriv = v[2];
+    *plIntLimit = v[3];
+    return 0;
+}
+
+long WINAPI MOT_SetDCCurrentLoopParams(long lSerialNum, long lProp, long lInt, long lIntLim, long lIntDeadBand, long lFFwd) {
+    long v[6] = {PHASE_AB, lProp, lInt, lIntLim, lIntDeadBand, lFFwd};
+    return param_set(lSerialNum, PB_CURRENTLOOP, v);
+}
+
+long WINAPI MOT_GetDCCurrentLoopParams(long lSerialNum, long *plProp, long *plInt, long *plIntLim, long *plIntDeadBand, long *plFFwd) {
+    long v[PARAM_MAX_FIELDS], ret;
+
+    if ((ret = param_get(lSerialNum, PB_CURRENTLOOP, v)) != 0) return ret;
+    *plProp = v[1];
+    *plInt = v[2];
+    *plIntLim = v[3];
+    *plIntDeadBand = v[4];
+    *plFFwd = v[5];
+    return 0;
+}
+
+long WINAPI MOT_SetDCSettledCurrentLoopParams(long lSerialNum, long lSettledProp, long lSettledInt, long lSettledIntLim, long lSettledIntDeadBand, long lSettledFFwd) {
+    long v[6] = {PHASE_AB, lSettledProp, lSettledInt, lSettledIntLim, lSettledIntDeadBand, lSettledFFwd};
+    return param_set(lSerialNum, PB_SETTLEDCURRENTLOOP, v);
+}
+
+long WINAPI MOT_GetDCSettledCurrentLoopParams(long lSerialNum, long *plSettledProp, long *plSettledInt, long *plSettledIntLim, long *plSettledIntDeadBand, long *plSettledFFwd) {
+    long v[PARAM_MAX_FIELDS], ret;
+
+    if ((ret = param_get(lSerialNum, PB_SETTLEDCURRENTLOOP, v)) != 0) return ret;
+    *plSettledProp = v[1];
+    *plSettledInt = v[2];
+    *plSettledIntLim = v[3];
+    *plSettledIntDeadBand = v[4];
+    *plSettledFFwd = v[5];
+    return 0;
+}
+
+long WINAPI MOT_SetDCPositionLoopParams(long lSerialNum, long lProp, long lInt, long lIntLim, long lDeriv, long lDerivTime, long lLoopGain, long lVelFFwd, long lAccFFwd, long lPosErrLim) {
+    long v[9] = {lProp, lInt, lIntLim, lDeriv, lDerivTime, lLoopGain, lVelFFwd, lAccFFwd, lPosErrLim};
+    return param_set(lSerialNum, PB_POSITIONLOOP, v);
+}
+
+long WINAPI MOT_GetDCPositionLoopParams(long lSerialNum, long *plProp, long *plInt, long *plIntLim, long *plDeriv, long *plDerivTime, long *plLoopGain, long *plVelFFwd, long *plAccFFwd, long *plPosErrLim) {
+    long v[PARAM_MAX_FIELDS], ret;
+
+    if ((ret = param_get(lSerialNum, PB_POSITIONLOOP, v)) != 0) return ret;
+    *plProp = v[0];
+    *plInt = v[1];
+    *plIntLim = v[2];
+    *plDeriv = v[3];
+    *plDerivTime = v[4];
+    *plLoopGain = v[5];
+    *plVelFFwd = v[6];
+    *plAccFFwd = v[7];
+    *plPosErrLim = v[8];
+    return 0;
+}
+
+long WINAPI MOT_SetDCMotorOutputParams(long lSerialNum, float fContCurrLim, float fEnergyLim, float fMotorLim, float fMotorBias) {
+    long v[4] = {(long)(fContCurrLim * OUTPUT_SCALE), (long)(fEnergyLim * OUTPUT_SCALE),
+            (long)(fMotorLim * OUTPUT_SCALE), (long)(fMotorBias * OUTPUT_SCALE)};
+    return param_set(lSerialNum, PB_MOTOROUTPUT, v);
+}
+
+long WINAPI MOT_GetDCMotorOutputParams(long lSerialNum,  float *pfContCurrLim, float *pfEnergyLim, float *pfMotorLim, float *pfMotorBias) {
+    long v[PARAM_MAX_FIELDS], ret;
+
+    if ((ret = param_get(lSerialNum, PB_MOTOROUTPUT, v)) != 0) return ret;
+    *pfContCurrLim = (float)(v[0] / OUTPUT_SCALE);
+    *pfEnergyLim = (float)(v[1] / OUTPUT_SCALE);
+    *pfMotorLim = (float)(v[2] / OUTPUT_SCALE);
+    *pfMotorBias = (float)(v[3] / OUTPUT_SCALE);
+    return 0;
+}
+
+long WINAPI MOT_SetDCTrackSettleParams(long lSerialNum, long lSettleTime, long lSettleWnd, long lTrackWnd) {
+    long v[3] = {lSettleTime, lSettleWnd, lTrackWnd};
+    return param_set(lSerialNum, PB_TRACKSETTLE, v);
+}
+
+long WINAPI MOT_GetDCTrackSettleParams(long lSerialNum, long *plSettleTime, long *plSettleWnd, long *plTrackWnd) {
+    long v[PARAM_MAX_FIELDS], ret;
+
+    if ((ret = param_get(lSerialNum, PB_TRACKSETTLE, v)) != 0) return ret;
+    *plSettleTime = v[0];
+    *plSettleWnd = v[1];
+    *plTrackWnd = v[2];
+    return 0;
+}
+
+long WINAPI MOT_SetDCJoystickParams(long lSerialNum, float fMaxVelLO, float fMaxVelHI, float fAccnLO, float fAccnHI, long lDirSense) {
+    long v[5] = {(long)fMaxVelLO, (long)fMaxVelHI, (long)fAccnLO, (long)fAccnHI, lDirSense};
+    return param_set(lSerialNum, PB_JOYSTICK, v);
+}
+
+long WINAPI MOT_GetDCJoystickParams(long lSerialNum, float *pfMaxVelLO, float *pfMaxVelHI, float *pfAccnLO, float *pfAccnHI, long *plDirSense) {
+    long v[PARAM_MAX_FIELDS], ret;
+
+    if ((ret = param_get(lSerialNum, PB_JOYSTICK, v)) != 0) return ret;
+    *pfMaxVelLO = (float)v[0];
+    *pfMaxVelHI = (float)v[1];
+    *pfAccnLO = (float)v[2];
+    *pfAccnHI = (float)v[3];
+    *plDirSense = v[4];
+    return 0;
+}
+
+
+long WINAPI APT_SaveConfig(long lSerialNum, const char *szPath, long lFormat) {
+    long i, k, n, nReq = 0, len = 0, ret = 0;
+    long rows[PB_COUNT * PARAM_MAX_FIELDS];
+    int got[PB_COUNT] = {0};
+    char txbuf[PB_COUNT * PARAM_MAX_FRAME];
+    uint32_t magic = CONFIG_MAGIC;
+    uint16_t hdr[2];
+    FILE *fp = NULL;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if (lFormat != APT_CONFIG_TEXT && lFormat != APT_CONFIG_BINARY) return EINVAL;
+
+    //every request the controller knows about in one go, so that the
+    //gathering stops with the last reply rather than on a timeout
+    for (k = 0; k < PB_COUNT; k++) {
+        if (!caps_has(i, blocks[k].cap)) continue;
+        len += frame_req(i, &blocks[k], txbuf + len);
+        nReq++;
+    }
+    if (DEBUG) hexDump("APT_SaveConfig txbuf", txbuf, len);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if ((ret = gather(txbuf, len, nReq, rows, got, 150)) < 0) goto end;
+    n = ret;
+    ret = 0;
+    if (n == 0) {
+        ret = ETIMEDOUT;
+        goto end;
+    }
+
+    if ((fp = fopen(szPath, lFormat == APT_CONFIG_BINARY ? "wb" : "w")) == NULL) {
+        ret = errno;
+        goto end;
+    }
+
+    if (lFormat == APT_CONFIG_BINARY) {
+        hdr[0] = CONFIG_VERSION;
+        hdr[1] = (uint16_t)n;
+        fwrite(&magic, 4, 1, fp);
+        fwrite(hdr, 2, 2, fp);
+        for (k = 0; k < PB_COUNT; k++) {
+            if (!got[k]) continue;
+            len = frame_set(i, &blocks[k], rows + k * PARAM_MAX_FIELDS, txbuf);
+            fwrite(txbuf, 1, len, fp);
+        }
+    } else {
+        fprintf(fp, "# libapt configuration, serial %ld channel %ld firmware %s\n",
+                aptInfo[i].SerialNumber, aptInfo[i].ChannelId, aptInfo[i].FirmwareVersion);
+        for (k = 0; k < PB_COUNT; k++) {
+            if (!got[k]) continue;
+            fprintf(fp, "%s", blocks[k].name);
+            for (len = 0; len < num_values(&blocks[k]); len++)
+                fprintf(fp, " %ld", rows[k * PARAM_MAX_FIELDS + len]);
+            fprintf(fp, "\n");
+        }
+    }
+    if (fclose(fp) != 0) ret = errno;
+    if (DEBUG) printf("Saved %ld parameter blocks of %ld to %s\n", n, lSerialNum, szPath);
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+// Reads a config file into rows / got, in either format.
+static long config_read(const char *szPath, long *rows, int *got) {
+    char line[256], *tok, *p, buf[PARAM_MAX_FRAME];
+    const PARAM_BLOCK *b;
+    uint32_t magic;
+    uint16_t hdr[2], id, len;
+    long n, k;
+    FILE *fp;
+
+    if ((fp = fopen(szPath, "rb")) == NULL) return errno;
+
+    if (fread(&magic, 4, 1, fp) == 1 && magic == CONFIG_MAGIC) {
+        if (fread(hdr, 2, 2, fp) != 2 || hdr[0] != CONFIG_VERSION) goto bad;
+        for (n = 0; n < hdr[1]; n++) {
+            if (fread(buf, 1, 6, fp) != 6) goto bad;
+            len = (unsigned char)buf[2] | ((unsigned char)buf[3] << 8);
+            if (!(buf[4] & 0x80) || len > PARAM_MAX_FRAME - 6 || fread(buf + 6, 1, len, fp) != len) goto bad;
+
+            // stored as SET frames, decoded like the GET ones
+            id = (unsigned char)buf[0] | ((unsigned char)buf[1] << 8);
+            for (k = 0; k < PB_COUNT && blocks[k].set != id; k++);
+            if (k == PB_COUNT) continue;
+            if (frame_decode(&blocks[k], buf, len + 6, rows + k * PARAM_MAX_FIELDS) < 0) goto bad;
+            got[k] = 1;
+        }
+        fclose(fp);
+        return 0;
+    }
+
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || (tok = strtok(line, " \t\r\n")) == NULL) continue;
+        for (k = 0; k < PB_COUNT && strcmp(blocks[k].name, tok) != 0; k++);
+        if (k == PB_COUNT) {
+            fprintf(stderr, "Error: unknown parameter block %s in %s\n", tok, szPath);
+            continue;
+        }
+        b = &blocks[k];
+        for (n = 0; n < num_values(b); n++) {
+            if ((tok = strtok(NULL, " \t\r\n")) == NULL) goto bad;
+            rows[k * PARAM_MAX_FIELDS + n] = strtol(tok, &p, 0);
+            if (*p != 0) goto bad;
+        }
+        got[k] = 1;
+    }
+    fclose(fp);
+    return 0;
+
+bad:
+    fprintf(stderr, "Error: %s is not a valid configuration\n", szPath);
+    fclose(fp);
+    return EINVAL;
+}
+
+long WINAPI APT_LoadConfig(long lSerialNum, const char *szPath, long *plMismatch) {
+    long i, k, f, n = 0, len = 0, ret = 0, nMismatch = 0;
+    long rows[PB_COUNT * PARAM_MAX_FIELDS], back[PB_COUNT * PARAM_MAX_FIELDS];
+    int got[PB_COUNT] = {0}, gotBack[PB_COUNT] = {0};
+    char txbuf[PB_COUNT * (PARAM_MAX_FRAME + 6)];
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if ((ret = config_read(szPath, rows, got)) != 0) return ret;
+
+    for (k = 0; k < PB_COUNT; k++) {
+        if (got[k] && !caps_has(i, blocks[k].cap)) {
+            if (DEBUG) printf("%s not supported by %ld, skipped\n", blocks[k].name, lSerialNum);
+            got[k] = 0;
+        }
+    }
+
+    //all the settings, then the matching requests to read them back
+    for (k = 0; k < PB_COUNT; k++) {
+        if (!got[k]) continue;
+        len += frame_set(i, &blocks[k], rows + k * PARAM_MAX_FIELDS, txbuf + len);
+        n++;
+    }
+    for (k = 0; k < PB_COUNT; k++)
+        if (got[k]) len += frame_req(i, &blocks[k], txbuf + len);
+    if (DEBUG) hexDump("APT_LoadConfig txbuf", txbuf, len);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if ((ret = gather(txbuf, len, n, back, gotBack, 150)) < 0) goto end;
+    ret = 0;
+
+    for (k = 0; k < PB_COUNT; k++) {
+        if (!got[k] || !gotBack[k]) continue;
+        for (f = 0; f < num_values(&blocks[k]); f++) {
+            if (rows[k * PARAM_MAX_FIELDS + f] != back[k * PARAM_MAX_FIELDS + f]) {
+                if (DEBUG) printf("%s field %ld: set %ld, read back %ld\n", blocks[k].name, f,
+                        rows[k * PARAM_MAX_FIELDS + f], back[k * PARAM_MAX_FIELDS + f]);
+                nMismatch++;
+                break;
+            }
+        }
+    }
+    if (plMismatch != NULL) *plMismatch = nMismatch;
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    param_forget(lSerialNum);
+    return ret;
+}
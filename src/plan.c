@@ -0,0 +1,436 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Visit order planning for multi-point acquisitions, see APT_PlanVisitOrder.
+//
+// The time to go from one point to the next is the time of the slowest
+// axis, since the axes move in parallel, each one following the velocity
+// profile of the motion model (motion.c). The order is built greedily
+// (nearest next point), then improved with 2-opt moves restricted to the
+// few nearest neighbours of each point. Both searches go through a uniform
+// grid over the first one or two axes so that planning stays well under a
+// second for 10k points.
+
+#include "libapt_private.h"
+
+#include <float.h>
+#include <math.h>
+
+#define PLAN_NEIGHBOURS 8   // candidates per point for the 2-opt moves
+#define PLAN_MAX_PASSES 50
+
+typedef struct {
+    long nAxes;
+    long nPoints;
+    double *x;          // (nPoints + 1) x nAxes, the last row is the start
+    MOTION_LIMITS lim[APT_PLAN_MAX_AXES];
+
+    // grid over the first gAxes axes, in time at full speed
+    int gAxes;
+    long gx, gy;
+    double gmin[2];
+    double cs;
+    long *cellStart;    // first slot of each cell in cellPts
+    long *cellCount;    // points not yet visited in each cell
+    long *cellPts;
+    long *slot;         // where each point sits in cellPts
+} PLAN;
+
+static double cost(const PLAN *p, long from, long to) {
+    const double *a = p->x + from * p->nAxes, *b = p->x + to * p->nAxes;
+    double t, tmax = 0;
+    long k;
+
+    for (k = 0; k < p->nAxes; k++) {
+        t = motion_time(&p->lim[k], fabs(b[k] - a[k]));
+        if (t > tmax) tmax = t;
+    }
+    return tmax;
+}
+
+static void cell_of(const PLAN *p, long pt, long *cx, long *cy) {
+    const double *a = p->x + pt * p->nAxes;
+
+    *cx = (long)((a[0] / p->lim[0].vmax - p->gmin[0]) / p->cs);
+    if (*cx < 0) *cx = 0;
+    if (*cx >= p->gx) *cx = p->gx - 1;
+    *cy = 0;
+    if (p->gAxes > 1) {
+        *cy = (long)((a[1] / p->lim[1].vmax - p->gmin[1]) / p->cs);
+        if (*cy < 0) *cy = 0;
+        if (*cy >= p->gy) *cy = p->gy - 1;
+    }
+}
+
+static long grid_init(PLAN *p) {
+    double y, gmax[2] = {0, 0}, area;
+    long k, a, c, cx, cy, nCells;
+
+    p->gAxes = p->nAxes > 1 ? 2 : 1;
+    for (a = 0; a < p->gAxes; a++) {
+        p->gmin[a] = DBL_MAX;
+        gmax[a] = -DBL_MAX;
+        for (k = 0; k <= p->nPoints; k++) {
+            y = p->x[k * p->nAxes + a] / p->lim[a].vmax;
+            if (y < p->gmin[a]) p->gmin[a] = y;
+            if (y > gmax[a]) gmax[a] = y;
+        }
+    }
+
+    // about two points per cell
+    if (p->gAxes == 1) {
+        p->cs = (gmax[0] - p->gmin[0]) / (p->nPoints / 2.0 + 1);
+    } else {
+        area = (gmax[0] - p->gmin[0]) * (gmax[1] - p->gmin[1]);
+        p->cs = sqrt(area / (p->nPoints / 2.0 + 1));
+        if (p->cs <= 0) p->cs = fmax(gmax[0] - p->gmin[0], gmax[1] - p->gmin[1]) / (p->nPoints / 2.0 + 1);
+    }
+    if (p->cs <= 0) p->cs = 1;
+
+    p->gx = (long)((gmax[0] - p->gmin[0]) / p->cs) + 1;
+    p->gy = p->gAxes > 1 ? (long)((gmax[1] - p->gmin[1]) / p->cs) + 1 : 1;
+    if (p->gx > 4 * p->nPoints + 1) p->gx = 4 * p->nPoints + 1;
+    if (p->gy > 4 * p->nPoints + 1) p->gy = 4 * p->nPoints + 1;
+    nCells = p->gx * p->gy;
+
+    p->cellStart = calloc(nCells + 1, sizeof(long));
+    p->cellCount = calloc(nCells, sizeof(long));
+    p->cellPts = malloc(p->nPoints * sizeof(long));
+    p->slot = malloc(p->nPoints * sizeof(long));
+    if (!p->cellStart || !p->cellCount || !p->cellPts || !p->slot) return ENOMEM;
+
+    for (k = 0; k < p->nPoints; k++) {
+        cell_of(p, k, &cx, &cy);
+        p->cellCount[cy * p->gx + cx]++;
+    }
+    for (c = 0; c < nCells; c++)
+        p->cellStart[c + 1] = p->cellStart[c] + p->cellCount[c];
+    memset(p->cellCount, 0, nCells * sizeof(long));
+    for (k = 0; k < p->nPoints; k++) {
+        cell_of(p, k, &cx, &cy);
+        c = cy * p->gx + cx;
+        p->slot[k] = p->cellStart[c] + p->cellCount[c]++;
+        p->cellPts[p->slot[k]] = k;
+    }
+    return 0;
+}
+
+static void grid_remove(PLAN *p, long pt) {
+    long cx, cy, c, last, moved;
+
+    cell_of(p, pt, &cx, &cy);
+    c = cy * p->gx + cx;
+    last = p->cellStart[c] + --p->cellCount[c];
+    moved = p->cellPts[last];
+    p->cellPts[p->slot[pt]] = moved;
+    p->slot[moved] = p->slot[pt];
+    p->cellPts[last] = pt;
+    p->slot[pt] = last;
+}
+
+// Finds up to k points closest (in time) to pt among those still in the
+// grid, nearest first. Returns how many were found.
+static long grid_nearest(const PLAN *p, long pt, long k, long *found, double *fcost) {
+    long n = 0, r, cx, cy, x, y, c, s, j, q, rmax = p->gx > p->gy ? p->gx : p->gy;
+    double t;
+
+    cell_of(p, pt, &cx, &cy);
+    for (r = 0; r <= rmax; r++) {
+        // every point further out is at least (r - 1) cells away
+        if (n == k && (r - 1) * p->cs >= fcost[n - 1]) break;
+
+        for (y = cy - r; y <= cy + r; y++) {
+            if (y < 0 || y >= p->gy) continue;
+            for (x = cx - r; x <= cx + r; x++) {
+                if (x < 0 || x >= p->gx) continue;
+                if (y != cy - r && y != cy + r && x != cx - r && x != cx + r) continue;
+
+                c = y * p->gx + x;
+                for (s = p->cellStart[c]; s < p->cellStart[c] + p->cellCount[c]; s++) {
+                    q = p->cellPts[s];
+                    if (q == pt) continue;
+                    t = cost(p, pt, q);
+                    if (n == k && t >= fcost[n - 1]) continue;
+
+                    // insertion into the sorted candidates
+                    j = n < k ? n++ : n - 1;
+                    while (j > 0 && fcost[j - 1] > t) {
+                        found[j] = found[j - 1];
+                        fcost[j] = fcost[j - 1];
+                        j--;
+                    }
+                    found[j] = q;
+                    fcost[j] = t;
+                }
+            }
+        }
+    }
+    return n;
+}
+
+// start -> tour[0] -> ... -> tour[n-1]
+static double tour_time(const PLAN *p, const long *tour) {
+    double t;
+    long k;
+
+    if (p->nPoints == 0) return 0;
+    t = cost(p, p->nPoints, tour[0]);
+    for (k = 1; k < p->nPoints; k++)
+        t += cost(p, tour[k - 1], tour[k]);
+    return t;
+}
+
+static void reverse(long *tour, long *pos, long i, long j) {
+    long tmp;
+
+    while (i < j) {
+        tmp = tour[i];
+        tour[i] = tour[j];
+        tour[j] = tmp;
+        pos[tour[i]] = i;
+        pos[tour[j]] = j;
+        i++;
+        j--;
+    }
+}
+
+// 2-opt on an open path with a fixed start. Reversing tour[i..j] replaces
+// the edges (prev(i), i) and (j, j+1) with (prev(i), j) and (i, j+1).
+static void two_opt(const PLAN *p, long *tour, const long *nbr) {
+    long n = p->nPoints, *pos, i, j, c, a, b, e, pass, improved;
+    double dOld, dNew;
+
+    if ((pos = malloc(n * sizeof(long))) == NULL) return;
+    for (i = 0; i < n; i++) pos[tour[i]] = i;
+
+    for (pass = 0; pass < PLAN_MAX_PASSES; pass++) {
+        improved = 0;
+        for (i = 0; i < n; i++) {
+            a = i > 0 ? tour[i - 1] : n;
+            b = tour[i];
+
+            for (c = 0; c < PLAN_NEIGHBOURS; c++) {
+                // new edge (a, tour[j])
+                if (a < n && (e = nbr[a * PLAN_NEIGHBOURS + c]) >= 0 && (j = pos[e]) > i) {
+                    dOld = cost(p, a, b) + (j + 1 < n ? cost(p, tour[j], tour[j + 1]) : 0);
+                    dNew = cost(p, a, tour[j]) + (j + 1 < n ? cost(p, b, tour[j + 1]) : 0);
+                    if (dNew < dOld - 1e-9) {
+                        reverse(tour, pos, i, j);
+                        b = tour[i];
+                        improved++;
+                    }
+                }
+
+                // new edge (b, tour[j + 1])
+                if ((e = nbr[b * PLAN_NEIGHBOURS + c]) >= 0 && (j = pos[e] - 1) > i) {
+                    dOld = cost(p, a, b) + cost(p, tour[j], tour[j + 1]);
+                    dNew = cost(p, a, tour[j]) + cost(p, b, tour[j + 1]);
+                    if (dNew < dOld - 1e-9) {
+                        reverse(tour, pos, i, j);
+                        b = tour[i];
+                        improved++;
+                    }
+                }
+            }
+        }
+        if (improved == 0) break;
+    }
+    free(pos);
+}
+
+static void plan_free(PLAN *p) {
+    free(p->x);
+    free(p->cellStart);
+    free(p->cellCount);
+    free(p->cellPts);
+    free(p->slot);
+}
+
+
+long WINAPI APT_PlanVisitOrder(long lNumAxes, const long *plSerialNums, const long *plChanIDs,
+        long lNumPoints, const float *pfTargets, const float *pfStart,
+        long *plOrder, float *pfTotalTime) {
+    PLAN p;
+    long *nbr = NULL, found[PLAN_NEIGHBOURS];
+    double fcost[PLAN_NEIGHBOURS];
+    float fPos;
+    long k, a, n, ax, cur, ret = 0;
+
+    if (lNumAxes < 1 || lNumAxes > APT_PLAN_MAX_AXES || lNumPoints < 0) return EINVAL;
+
+    memset(&p, 0, sizeof(p));
+    p.nAxes = lNumAxes;
+    p.nPoints = lNumPoints;
+
+    p.x = malloc((lNumPoints + 1) * lNumAxes * sizeof(double));
+    if (p.x == NULL) {
+        ret = ENOMEM;
+        goto end;
+    }
+    for (k = 0; k < lNumPoints * lNumAxes; k++)
+        p.x[k] = pfTargets[k];
+
+    for (a = 0; a < lNumAxes; a++) {
+        motion_limits(plSerialNums[a], plChanIDs ? plChanIDs[a] : -1, &p.lim[a]);
+
+        // without usable parameters, plan on distance alone
+        if (p.lim[a].vmax <= 0 || p.lim[a].accn <= 0) {
+            p.lim[a].vmax = 1;
+            p.lim[a].accn = DBL_MAX;
+            p.lim[a].jerk = 0;
+        }
+
+        if (pfStart != NULL) {
+            p.x[lNumPoints * lNumAxes + a] = pfStart[a];
+        } else {
+            //another channel through an axis handle, the device's own channel stays as it is
+            fPos = 0;
+            if (plChanIDs == NULL) {
+                MOT_GetPosition(plSerialNums[a], &fPos);
+            } else if (APT_OpenAxis(plSerialNums[a], plChanIDs[a], &ax) == 0) {
+                APT_AxisGetPositions(1, &ax, &fPos);
+                APT_CloseAxis(ax);
+            }
+            p.x[lNumPoints * lNumAxes + a] = fPos;
+        }
+    }
+
+    if (lNumPoints == 0) goto end;
+    if ((ret = grid_init(&p)) != 0) goto end;
+
+    // nearest neighbours for the 2-opt moves, before the grid is emptied
+    if ((nbr = malloc(lNumPoints * PLAN_NEIGHBOURS * sizeof(long))) == NULL) {
+        ret = ENOMEM;
+        goto end;
+    }
+    for (k = 0; k < lNumPoints; k++) {
+        n = grid_nearest(&p, k, PLAN_NEIGHBOURS, found, fcost);
+        for (a = 0; a < PLAN_NEIGHBOURS; a++)
+            nbr[k * PLAN_NEIGHBOURS + a] = a < n ? found[a] : -1;
+    }
+
+    // greedy construction, always go to the closest point left
+    cur = lNumPoints;
+    for (k = 0; k < lNumPoints; k++) {
+        grid_nearest(&p, cur, 1, found, fcost);
+        plOrder[k] = found[0];
+        grid_remove(&p, found[0]);
+        cur = found[0];
+    }
+
+    two_opt(&p, plOrder, nbr);
+
+end:
+    if (ret == 0 && pfTotalTime != NULL)
+        *pfTotalTime = (float)tour_time(&p, plOrder);
+    if (ret == 0 && DEBUG)
+        printf("APT_PlanVisitOrder: %ld points, %ld axes, %.3f s\n", lNumPoints, lNumAxes, tour_time(&p, plOrder));
+    if (ret != 0) fprintf(stderr, "Error: APT_PlanVisitOrder %ld (%s)\n", ret, strerror(ret));
+    free(nbr);
+    plan_free(&p);
+    return ret;
+}
+
+// Waits until none of the axes is moving any more, asking each for its
+// status in turn, until the caller's deadline or else until dUntil.
+// Returns 0, ETIMEDOUT, ECANCELED or an error.
+static long wait_axes(long lNumAxes, const long *plAxes, double dUntil) {
+    unsigned long bits;
+    long a, moving, ret;
+
+    while (1) {
+        for (a = 0, moving = 0; a < lNumAxes; a++) {
+            ret = APT_AxisGetStatus(1, &plAxes[a], &bits, NULL);
+
+            //a lost reply, ask again next time round
+            if (ret == ETIMEDOUT && deadline_check() == 0) {
+                moving = 1;
+                continue;
+            }
+            if (ret != 0) return ret;
+            if (bits & APT_STATUS_MOVING) moving = 1;
+        }
+        if (!moving) return 0;
+        if ((ret = deadline_check()) != 0) return ret;
+        if (dUntil > 0 && apt_time() > dUntil) return ETIMEDOUT;
+        sleep_ms(1);
+    }
+}
+
+long WINAPI APT_ExecuteVisitOrder(long lNumAxes, const long *plSerialNums, const long *plChanIDs,
+        long lNumPoints, const float *pfTargets, const long *plOrder,
+        APT_VISITCALLBACK pfnCallback, void *pUserData) {
+    MOTION_LIMITS lim[APT_PLAN_MAX_AXES];
+    double t, tmax, until;
+    float fLast[APT_PLAN_MAX_AXES], fPos;
+    long ax[APT_PLAN_MAX_AXES];
+    DEADLINE saved;
+    long i, k = 0, a, numOpen = 0, pt, ret = 0;
+
+    if (lNumAxes < 1 || lNumAxes > APT_PLAN_MAX_AXES) return EINVAL;
+
+    // a handle per axis, to start them all and then follow each one's status
+    for (a = 0; a < lNumAxes; a++) {
+        if (GetIndex(plSerialNums[a], &i) < 0) {
+            ret = ENODEV;
+            goto end;
+        }
+        motion_limits(plSerialNums[a], plChanIDs ? plChanIDs[a] : -1, &lim[a]);
+        if ((ret = APT_OpenAxis(plSerialNums[a], plChanIDs ? plChanIDs[a] : aptInfo[i].ChannelId, &ax[a])) != 0) goto end;
+        numOpen++;
+        fLast[a] = 0;
+        APT_AxisGetPositions(1, &ax[a], &fLast[a]);
+    }
+
+    for (k = 0; k < lNumPoints; k++) {
+        pt = plOrder != NULL ? plOrder[k] : k;
+
+        // start every axis, then wait for all of them, for up to twice the
+        // time the slowest one should take
+        tmax = 0;
+        for (a = 0; a < lNumAxes; a++) {
+            fPos = pfTargets[pt * lNumAxes + a];
+            t = lim[a].vmax > 0 ? motion_time(&lim[a], fabs(fPos - fLast[a])) : 0;
+            if (t > tmax) tmax = t;
+            if ((ret = APT_AxisMoveAbsolute(1, &ax[a], &fPos, false)) != 0) goto end;
+        }
+        until = deadline_remaining_ms() == LONG_MAX ? apt_time() + 2 * tmax + MOVE_TIMEOUT / 1e3 : 0;
+        if ((ret = wait_axes(lNumAxes, ax, until)) != 0) {
+            if (ret == ECANCELED) {
+                //stop them rather than leave them going when we gave up on them
+                deadline_suspend(&saved);
+                for (a = 0; a < lNumAxes; a++)
+                    APT_AxisStop(1, &ax[a]);
+                deadline_pop(&saved, 0);
+            }
+            goto end;
+        }
+
+        for (a = 0; a < lNumAxes; a++)
+            fLast[a] = pfTargets[pt * lNumAxes + a];
+
+        if (pfnCallback != NULL && (ret = pfnCallback(pt, pUserData)) != 0)
+            goto end;
+    }
+    ret = 0;
+
+end:
+    if (ret != 0) fprintf(stderr, "Error: APT_ExecuteVisitOrder %ld at point %ld\n", ret, k);
+    for (a = 0; a < numOpen; a++)
+        APT_CloseAxis(ax[a]);
+    return ret;
+}
@@ -0,0 +1,464 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Axis handles for the channels of multi-channel controllers, see
+// APT_OpenAxis in libapt.h.
+//
+// A rack controller (BSC102/103, BBD102/103) is one USB device with a
+// motherboard at 0x11 and a card per bay at 0x21, 0x22, 0x23. Each card is
+// a single channel controller of its own, so a command goes to the bay's
+// destination byte with channel ident 1, and the replies come back with
+// the bay as their source byte. The older multi-channel controllers
+// (BSC002, BMS002) answer from 0x50 and tell the channels apart by the
+// channel ident instead. Either way, a call on several axes of the same
+// controller sends all the commands in one write and then routes each
+// reply to its axis as it comes, so the channels move and report at the
+// same time rather than one after the other.
+
+#include "libapt_private.h"
+
+typedef struct {
+    long SerialNumber;      // 0 if the handle is free
+    long ChanId;            // as given to APT_OpenAxis
+    char DestinationByte;
+    char ChanIdent;
+    long Bay;               // replies are told apart by source byte only
+
+    //what the last replies said
+    float Position;
+    long PositionValid;
+    long Homed;
+    unsigned long StatusBits;
+} AXIS;
+
+static AXIS axes[APT_MAX_AXES];
+
+//MGMSG_MOT_MOVE_HOMED, MGMSG_MOT_MOVE_COMPLETED, MGMSG_MOT_MOVE_STOPPED, MGMSG_MOT_GET_POSCOUNTER
+#define MSG_HOMED       0x0444
+#define MSG_COMPLETED   0x0464
+#define MSG_STOPPED     0x0466
+#define MSG_POSCOUNTER  0x0412
+
+//MGMSG_MOT_GET_STATUSUPDATE, MGMSG_MOT_GET_DCSTATUSUPDATE
+#define MSG_STATUS      0x0481
+#define MSG_DCSTATUS    0x0491
+
+// Checks the handles and that they all belong to the one controller (whose
+// index goes in *pi), once each.
+static long check_axes(long lNumAxes, const long *plAxes, long *pi) {
+    long k, l;
+
+    if (lNumAxes < 1 || lNumAxes > APT_MAX_AXES) return EINVAL;
+    for (k = 0; k < lNumAxes; k++) {
+        if (plAxes[k] < 0 || plAxes[k] >= APT_MAX_AXES || axes[plAxes[k]].SerialNumber == 0) return EINVAL;
+        if (axes[plAxes[k]].SerialNumber != axes[plAxes[0]].SerialNumber) return EINVAL;
+        for (l = 0; l < k; l++)
+            if (plAxes[l] == plAxes[k]) return EINVAL;
+    }
+    if (GetIndex(axes[plAxes[0]].SerialNumber, pi) < 0) return ENODEV;
+    return 0;
+}
+
+static long frame_short(const AXIS *a, unsigned short id, char param2, char *buf) {
+    buf[0] = id & 0xFF;
+    buf[1] = id >> 8;
+    buf[2] = a->ChanIdent;
+    buf[3] = param2;
+    buf[4] = a->DestinationByte;
+    buf[5] = 0x01;
+    return 6;
+}
+
+static long frame_long(const AXIS *a, unsigned short id, int32_t value, char *buf) {
+    int16_t val16 = a->ChanIdent;
+
+    buf[0] = id & 0xFF;
+    buf[1] = id >> 8;
+    buf[2] = 0x06;
+    buf[3] = 0x00;
+    buf[4] = a->DestinationByte | 0x80;
+    buf[5] = 0x01;
+    memcpy(buf+6,(char *)(&val16),2);
+    memcpy(buf+8,(char *)(&value),4);
+    return 12;
+}
+
+// Which of the axes a reply comes from, -1 if none of them.
+static long route(long lNumAxes, const long *plAxes, const char *buf, long len) {
+    const AXIS *a;
+    long k, chan;
+
+    chan = (buf[4] & 0x80) ? (len >= 8 ? (unsigned char)buf[6] : -1) : (unsigned char)buf[2];
+    for (k = 0; k < lNumAxes; k++) {
+        a = &axes[plAxes[k]];
+        if (buf[5] != a->DestinationByte) continue;
+        if (a->Bay || chan == a->ChanIdent) return k;
+    }
+    return -1;
+}
+
+// Sends txbuf (unless txlen is 0), then reads the replies until each axis
+// has sent one of the ids (0 terminated), or for dTimeout seconds. got[k] is
+// the id axis k answered with, 0 if none. Returns how many axes answered.
+static long collect(long lNumAxes, const long *plAxes, const char *txbuf, long txlen,
+        const unsigned short *ids, unsigned short *got, double dTimeout) {
+    char buf[64];
+    double tEnd = apt_time() + dTimeout;
+    long k, n = 0, len, ms;
+    unsigned short id;
+    AXIS *a;
+    int m;
+
+    if (txlen > 0 && (len = ftdi_write_data(ftdic, (unsigned char *)txbuf, txlen)) < 0) return len;
+
+    while (n < lNumAxes && (ms = (long)((tEnd - apt_time()) * 1e3)) > 0) {
+        if ((len = read_frame(buf, sizeof(buf), (int)ms)) < 0) return len;
+        if (len == 0) break;
+
+        id = (unsigned char)buf[0] | ((unsigned char)buf[1] << 8);
+        for (m = 0; ids[m] != 0 && ids[m] != id; m++);
+        if (ids[m] == 0 || (k = route(lNumAxes, plAxes, buf, len)) < 0 || got[k] != 0) {
+            if (DEBUG) hexDump("collect, ignoring", buf, len);
+            continue;
+        }
+        if (DEBUG) hexDump("collect", buf, len);
+
+        a = &axes[plAxes[k]];
+        if (id == MSG_HOMED) {
+            a->Position = 0;
+            a->PositionValid = 1;
+            a->Homed = 1;
+        } else if (len >= 12 && id != MSG_STOPPED) {
+            //the position counter, or the status the move ended with (a
+            //stopped move's isn't where it was going, leave it unknown)
+            a->Position = (float)*(int32_t *)(buf+8);
+            a->PositionValid = 1;
+        }
+        if ((id == MSG_STATUS || id == MSG_DCSTATUS) && len >= 20)
+            a->StatusBits = *(uint32_t *)(buf+16);
+        got[k] = id;
+        n++;
+    }
+    return n;
+}
+
+// Starts the same kind of move on every axis (pfValues NULL for homing)
+// and with bWait, waits for them all to end.
+static long axis_move(long lNumAxes, const long *plAxes, unsigned short msg, const float *pfValues, BOOL bWait) {
+    static const unsigned short moveEnd[] = {MSG_COMPLETED, MSG_STOPPED, 0};
+    static const unsigned short homeEnd[] = {MSG_HOMED, MSG_STOPPED, 0};
+    char txbuf[APT_MAX_AXES * 12];
+    unsigned short got[APT_MAX_AXES] = {0};
+    long i, k, len = 0, ret, timeout;
+    AXIS *a;
+
+    if ((ret = check_axes(lNumAxes, plAxes, &i)) != 0) return ret;
+
+    for (k = 0; k < lNumAxes; k++) {
+        a = &axes[plAxes[k]];
+        if (pfValues == NULL) {
+            len += frame_short(a, msg, 0x00, txbuf + len);
+            a->Homed = 0;
+        } else
+            len += frame_long(a, msg, (int32_t)pfValues[k], txbuf + len);
+        a->PositionValid = 0;
+    }
+    if (DEBUG) hexDump("axis_move txbuf", txbuf, len);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if (!bWait) {
+        if ((ret = ftdi_write_data(ftdic, (unsigned char *)txbuf, len)) < 0) goto end;
+        ret = 0;
+        goto end;
+    }
+
+    if ((timeout = deadline_remaining_ms()) == LONG_MAX) timeout = MOVE_TIMEOUT;
+    if ((ret = collect(lNumAxes, plAxes, txbuf, len, pfValues == NULL ? homeEnd : moveEnd, got, timeout / 1e3)) < 0) goto end;
+
+    if (ret < lNumAxes && deadline_check() == ECANCELED) {
+        //stop whatever is still moving
+        for (k = 0, len = 0; k < lNumAxes; k++)
+            if (got[k] == 0) len += frame_short(&axes[plAxes[k]], 0x0465, 0x02, txbuf + len);
+        ftdic->usb_write_timeout = MOVE_TIMEOUT;
+        ftdi_write_data(ftdic, (unsigned char *)txbuf, len);
+    }
+
+    if (ret < lNumAxes) {
+        ret = deadline_check() != 0 ? deadline_check() : ETIMEDOUT;
+        goto end;
+    }
+
+    //stopped short, by a stop command or a limit switch
+    for (k = 0, ret = 0; k < lNumAxes; k++)
+        if (got[k] == MSG_STOPPED) ret = ECANCELED;
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+// For compare.c: the checks of the APT_Axis* calls, where the commands
+// for an axis go, and its status with the device (index i) already open.
+long axis_check(long lNumAxes, const long *plAxes, long *pi) {
+    return check_axes(lNumAxes, plAxes, pi);
+}
+
+void axis_address(long lAxis, char *pcDest, char *pcChanIdent) {
+    *pcDest = axes[lAxis].DestinationByte;
+    *pcChanIdent = axes[lAxis].ChanIdent;
+}
+
+long axis_status(long lNumAxes, const long *plAxes, long i, unsigned long *pulStatusBits, float *pfPositions) {
+    static const unsigned short ids[] = {MSG_STATUS, MSG_DCSTATUS, 0};
+    char txbuf[APT_MAX_AXES * 6];
+    unsigned short got[APT_MAX_AXES] = {0};
+    unsigned short req;
+    long k, len = 0, ret;
+
+    //MGMSG_MOT_REQ_DCSTATUSUPDATE for the DC servo and brushless controllers,
+    //MGMSG_MOT_REQ_STATUSUPDATE for the others
+    req = caps_has(i, APT_CAP_DCSTATUS) ? 0x0490 : 0x0480;
+    for (k = 0; k < lNumAxes; k++)
+        len += frame_short(&axes[plAxes[k]], req, 0x00, txbuf + len);
+    if (DEBUG) hexDump("axis_status txbuf", txbuf, len);
+
+    if ((ret = collect(lNumAxes, plAxes, txbuf, len, ids, got, 0.15)) < 0) return ret;
+
+    for (k = 0; k < lNumAxes; k++) {
+        pulStatusBits[k] = axes[plAxes[k]].StatusBits;
+        if (pfPositions != NULL) pfPositions[k] = axes[plAxes[k]].Position;
+    }
+    return (ret == lNumAxes) ? 0 : ETIMEDOUT;
+}
+
+
+long WINAPI APT_OpenAxis(long lSerialNum, long lChanID, long *plAxis) {
+    long i, k;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if (lChanID < 0 || lChanID > aptInfo[i].Caps->lNumChannels) return EINVAL;
+
+    for (k = 0; k < APT_MAX_AXES && axes[k].SerialNumber != 0; k++);
+    if (k == APT_MAX_AXES) return ENOMEM;
+
+    memset(&axes[k], 0, sizeof(AXIS));
+    axes[k].SerialNumber = lSerialNum;
+    axes[k].ChanId = lChanID;
+    axes[k].DestinationByte = (char)caps_dest(i, lChanID);
+    axes[k].Bay = aptInfo[i].Caps->lNumBays > 0;
+
+    //a card in a bay is channel 1 of its own, the others count from 1 too
+    axes[k].ChanIdent = (axes[k].Bay || lChanID == 0) ? 1 : (char)lChanID;
+
+    if (DEBUG) printf("Axis %ld: %ld channel %ld, destination 0x%02x\n",
+            k, lSerialNum, lChanID, (unsigned char)axes[k].DestinationByte);
+    *plAxis = k;
+    return 0;
+}
+
+long WINAPI APT_CloseAxis(long lAxis) {
+    if (lAxis < 0 || lAxis >= APT_MAX_AXES || axes[lAxis].SerialNumber == 0) return EINVAL;
+    axes[lAxis].SerialNumber = 0;
+    return 0;
+}
+
+long WINAPI APT_AxisGetPositions(long lNumAxes, const long *plAxes, float *pfPositions) {
+    static const unsigned short ids[] = {MSG_POSCOUNTER, 0};
+    char txbuf[APT_MAX_AXES * 6];
+    unsigned short got[APT_MAX_AXES] = {0};
+    long i, k, len = 0, ret;
+
+    if ((ret = check_axes(lNumAxes, plAxes, &i)) != 0) return ret;
+
+    //MGMSG_MOT_REQ_POSCOUNTER
+    for (k = 0; k < lNumAxes; k++)
+        len += frame_short(&axes[plAxes[k]], 0x0411, 0x00, txbuf + len);
+    if (DEBUG) hexDump("APT_AxisGetPositions txbuf", txbuf, len);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if ((ret = collect(lNumAxes, plAxes, txbuf, len, ids, got, 0.15)) < 0) goto end;
+
+    for (k = 0; k < lNumAxes; k++)
+        pfPositions[k] = axes[plAxes[k]].Position;
+    ret = (ret == lNumAxes) ? 0 : ETIMEDOUT;
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+long WINAPI APT_AxisGetStatus(long lNumAxes, const long *plAxes, unsigned long *pulStatusBits, float *pfPositions) {
+    long i, ret;
+
+    if ((ret = check_axes(lNumAxes, plAxes, &i)) != 0) return ret;
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    ret = axis_status(lNumAxes, plAxes, i, pulStatusBits, pfPositions);
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+long WINAPI APT_SnapshotPositions(long lNumAxes, const long *plAxes, float *pfPositions, double *pdTimes, double *pdSkew) {
+    static const unsigned short ids[] = {MSG_POSCOUNTER, 0};
+    struct {
+        long i;                         // index in aptInfo
+        struct ftdi_context *ctx;
+        long n;
+        long ax[APT_MAX_AXES];          // its axes, as handles
+        long k[APT_MAX_AXES];           // and where they are in plAxes
+        double sent;                    // when its requests went out
+        unsigned short got[APT_MAX_AXES];
+        long numGot;
+    } dev[APT_MAX_AXES];
+    struct ftdi_context *old = ftdic;
+    char txbuf[APT_MAX_AXES * 6];
+    long d, k, l, len, numDev = 0, n = 0, ret = 0;
+    double until, first = 0, last = 0;
+
+    if (lNumAxes < 1 || lNumAxes > APT_MAX_AXES) return EINVAL;
+    for (k = 0; k < lNumAxes; k++) {
+        if (plAxes[k] < 0 || plAxes[k] >= APT_MAX_AXES || axes[plAxes[k]].SerialNumber == 0) return EINVAL;
+        for (l = 0; l < k; l++)
+            if (plAxes[l] == plAxes[k]) return EINVAL;
+    }
+
+    //the axes by controller
+    for (k = 0; k < lNumAxes; k++) {
+        for (d = 0; d < numDev && axes[dev[d].ax[0]].SerialNumber != axes[plAxes[k]].SerialNumber; d++);
+        if (d == numDev) {
+            if (GetIndex(axes[plAxes[k]].SerialNumber, &dev[d].i) < 0) return ENODEV;
+            dev[d].ctx = NULL;
+            dev[d].n = 0;
+            dev[d].sent = 0;
+            dev[d].numGot = 0;
+            memset(dev[d].got, 0, sizeof(dev[d].got));
+            numDev++;
+        }
+        dev[d].ax[dev[d].n] = plAxes[k];
+        dev[d].k[dev[d].n++] = k;
+        pdTimes[k] = 0;
+    }
+
+    //every controller open in a context of its own before anything goes out
+    for (d = 0; d < numDev; d++) {
+        if ((dev[d].ctx = ftdi_new()) == NULL) {
+            ret = ENOMEM;
+            goto end;
+        }
+        ftdic = dev[d].ctx;
+        if ((ret = ftdi_open_apt_index(dev[d].i)) < 0) goto end;
+    }
+
+    //MGMSG_MOT_REQ_POSCOUNTER, all the channels of a controller in one write
+    for (d = 0; d < numDev; d++) {
+        for (l = 0, len = 0; l < dev[d].n; l++)
+            len += frame_short(&axes[dev[d].ax[l]], 0x0411, 0x00, txbuf + len);
+        if (DEBUG) hexDump("APT_SnapshotPositions txbuf", txbuf, len);
+
+        ftdic = dev[d].ctx;
+        if ((ret = ftdi_write_data(ftdic, (unsigned char *)txbuf, len)) < 0) goto end;
+        dev[d].sent = apt_time();
+    }
+
+    //the replies have been on their way all this time, one timeout for them
+    //all: take what each controller has in turn until they're all in, so
+    //that a slow one doesn't leave the others' unread, and look at every
+    //controller at least once even when the time is up
+    until = dev[0].sent + 0.15;
+    do {
+        for (d = 0; d < numDev; d++) {
+            if (dev[d].numGot == dev[d].n) continue;
+            ftdic = dev[d].ctx;
+            if ((ret = collect(dev[d].n, dev[d].ax, NULL, 0, ids, dev[d].got, 0.002)) < 0) goto end;
+            dev[d].numGot += ret;
+            n += ret;
+        }
+    } while (n < lNumAxes && apt_time() < until && deadline_check() == 0);
+
+    for (d = 0; d < numDev; d++) {
+        for (l = 0; l < dev[d].n; l++) {
+            k = dev[d].k[l];
+            pfPositions[k] = axes[dev[d].ax[l]].Position;
+            if (!dev[d].got[l]) continue;
+            pdTimes[k] = dev[d].sent;
+            if (first == 0 || dev[d].sent < first) first = dev[d].sent;
+            if (dev[d].sent > last) last = dev[d].sent;
+        }
+    }
+    if (pdSkew != NULL) *pdSkew = last - first;
+    ret = (n == lNumAxes) ? 0 : (deadline_check() != 0 ? deadline_check() : ETIMEDOUT);
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    for (d = 0; d < numDev; d++) {
+        if (dev[d].ctx == NULL) continue;
+        ftdi_usb_close(dev[d].ctx);
+        ftdi_free(dev[d].ctx);
+    }
+    ftdic = old;
+    return ret;
+}
+
+long WINAPI APT_AxisMoveAbsolute(long lNumAxes, const long *plAxes, const float *pfPositions, BOOL bWait) {
+    //MGMSG_MOT_MOVE_ABSOLUTE
+    return axis_move(lNumAxes, plAxes, 0x0453, pfPositions, bWait);
+}
+
+long WINAPI APT_AxisMoveRelative(long lNumAxes, const long *plAxes, const float *pfDistances, BOOL bWait) {
+    //MGMSG_MOT_MOVE_RELATIVE
+    return axis_move(lNumAxes, plAxes, 0x0448, pfDistances, bWait);
+}
+
+long WINAPI APT_AxisMoveHome(long lNumAxes, const long *plAxes, BOOL bWait) {
+    //MGMSG_MOT_MOVE_HOME
+    return axis_move(lNumAxes, plAxes, 0x0443, NULL, bWait);
+}
+
+long WINAPI APT_AxisStop(long lNumAxes, const long *plAxes) {
+    char txbuf[APT_MAX_AXES * 6];
+    long i, k, len = 0, ret;
+
+    if ((ret = check_axes(lNumAxes, plAxes, &i)) != 0) return ret;
+
+    //MGMSG_MOT_MOVE_STOP, profiled
+    for (k = 0; k < lNumAxes; k++) {
+        len += frame_short(&axes[plAxes[k]], 0x0465, 0x02, txbuf + len);
+        axes[plAxes[k]].PositionValid = 0;
+    }
+    if (DEBUG) hexDump("APT_AxisStop txbuf", txbuf, len);
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if ((ret = ftdi_write_data(ftdic, (unsigned char *)txbuf, len)) < 0) goto end;
+    ret = 0;
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    return ret;
+}
+
+long WINAPI APT_AxisGetInfo(long lAxis, long *plSerialNum, long *plChanID, long *plDestByte) {
+    if (lAxis < 0 || lAxis >= APT_MAX_AXES || axes[lAxis].SerialNumber == 0) return EINVAL;
+    *plSerialNum = axes[lAxis].SerialNumber;
+    *plChanID = axes[lAxis].ChanId;
+    *plDestByte = (unsigned char)axes[lAxis].DestinationByte;
+    return 0;
+}
@@ -0,0 +1,679 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Simulated APT controllers, see aptsoak.c and apttune.c.
+//
+// This file provides the libftdi functions libapt uses, so that aptsoak
+// and apttune-sim link the library sources against it instead of
+// libftdi1. Each
+// controller answers the hardware information, position counter, move and
+// motor parameter messages, with the replies queued with a ready time
+// like they would sit in the FTDI chip. The faults are applied to the
+// replies as they are queued: a frame can be lost, cut short, have a byte
+// flipped or be held back by a latency spike, and a USB transfer can find
+// the controller gone, in which case it stays away for a while and the
+// next open after that sees it again.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <ftdi.h>
+
+#include "soaksim.h"
+
+#define SIM_MAX         256
+#define SIM_QUEUE       64
+#define SIM_STORE       32
+
+// time from a request to its reply, and the speed of the stages
+#define SIM_LATENCY     0.0002
+#define SIM_SPEED       2e6
+
+// libftdi's "USB device unavailable"
+#define SIM_EGONE       -666
+
+// The plant, when there is one (soaksim_set_plant): a mass with the PID
+// loop's force on it, x'' = KP Prop e + KI Int (integral of e) - KD Deriv x'
+// for a following error e, the derivative acting on the measured velocity.
+// The shipped gains (Prop 100, Deriv 300) make a 5 Hz loop, well
+// overdamped. The loop tracks a ramp from the start to the
+// target at SIM_SPEED, and the move completes once the stage is within
+// PLANT_INPOS counts and nearly still.
+#define PLANT_DT        1e-4
+#define PLANT_KP        9.87
+#define PLANT_KI        0.5
+#define PLANT_KD        0.31
+#define PLANT_INPOS     10
+#define PLANT_STILL     2000.0
+
+typedef struct {
+    double x, v, integ;
+    double from, to;            // the reference ramp
+    double start, end;
+    double t;                   // integrated up to then
+} SIM_PLANT;
+
+typedef struct {
+    double ready;
+    int len;
+    unsigned char b[96];
+} SIM_FRAME;
+
+typedef struct {
+    long serial;
+    const char *model;
+    int hwtype;
+    int bays;                   // 0 for a standalone controller
+    double downUntil;           // disconnected until then
+    double reconnect;           // back since then, not noticed yet
+    int32_t pos[3];
+    double moveEnd[3];          // 0 when not moving
+    int32_t absTarget[3];       // MGMSG_MOT_SET_MOVEABSPARAMS
+    int homed[3];
+    SIM_PLANT plant[3];
+    struct ftdi_context *owner; // the context that has it open
+    unsigned char store[256][SIM_STORE];    // MGMSG_MOT_SET_* data, by id & 0xFF
+    int storelen[256];
+    SIM_FRAME q[SIM_QUEUE];
+    int qhead, qn;
+    unsigned char rx[512];      // bytes ready for the host
+    int rxn;
+} SIM_CTRL;
+
+static SIM_CTRL *ctrl = NULL;
+static int numCtrl = 0;
+static SOAK_FAULTS faults;
+static int plantOn = 0;
+static SOAK_COUNTS counts;
+static uint32_t rng = 1;
+static struct ftdi_device_list devs[SIM_MAX];
+
+// serial prefix, model, hardware type, bays: a TDC001, a KDC101 and a
+// three bay BBD103 in turn
+static const struct { long prefix; const char *model; int hwtype; int bays; } families[] = {
+    {83, "TDC001", 0, 0},
+    {27, "KDC101", 0, 0},
+    {73, "BBD103", 45, 3},
+};
+
+// same clock as APT_Now()
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double uniform(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return (rng >> 8) / 16777216.0;
+}
+
+static int happens(double p) {
+    return p > 0 && uniform() < p;
+}
+
+// the controller a context has open, like libftdi's own usb_dev handle
+static SIM_CTRL *opened(struct ftdi_context *ftdi) {
+    return (SIM_CTRL *)ftdi->usb_dev;
+}
+
+static SIM_CTRL *find(long serial) {
+    int k;
+
+    for (k = 0; k < numCtrl; k++)
+        if (ctrl[k].serial == serial) return &ctrl[k];
+    return NULL;
+}
+
+// Queues a reply from source src, with the faults applied.
+static void emit(SIM_CTRL *c, unsigned short id, char src, char p1, char p2, const unsigned char *data, int dl) {
+    SIM_FRAME *f, *last;
+    double ready = now() + SIM_LATENCY;
+    int k;
+
+    counts.frames++;
+    if (c->qn == SIM_QUEUE || happens(faults.drop)) {
+        counts.dropped++;
+        return;
+    }
+
+    f = &c->q[(c->qhead + c->qn) % SIM_QUEUE];
+    f->b[0] = id & 0xFF;
+    f->b[1] = id >> 8;
+    if (data != NULL) {
+        f->b[2] = dl & 0xFF;
+        f->b[3] = dl >> 8;
+        f->b[4] = 0x81;
+        memcpy(f->b + 6, data, dl);
+    } else {
+        f->b[2] = p1;
+        f->b[3] = p2;
+        f->b[4] = 0x01;
+        dl = 0;
+    }
+    f->b[5] = src;
+    f->len = 6 + dl;
+
+    if (happens(faults.corrupt)) {
+        k = (int)(uniform() * f->len);
+        f->b[k] ^= 1 + (int)(uniform() * 255);
+        counts.corrupted++;
+    }
+    if (f->len > 1 && happens(faults.truncate)) {
+        f->len = 1 + (int)(uniform() * (f->len - 1));
+        counts.truncated++;
+    }
+    if (happens(faults.spike)) {
+        ready += faults.spikeMs * (0.5 + uniform()) / 1e3;
+        counts.spikes++;
+    }
+
+    // the chip hands the bytes over in order
+    if (c->qn > 0) {
+        last = &c->q[(c->qhead + c->qn - 1) % SIM_QUEUE];
+        if (ready < last->ready) ready = last->ready;
+    }
+    f->ready = ready;
+    c->qn++;
+}
+
+// The loop gains: the DC PID block, or the position loop of the brushless
+// controllers.
+static void plant_gains(SIM_CTRL *c, double *kp, double *ki, double *kd) {
+    int32_t p, i, d;
+    uint16_t w;
+
+    if (c->bays) {
+        memcpy(&w, c->store[0xA6] + 2, 2); p = w;
+        memcpy(&w, c->store[0xA6] + 4, 2); i = w;
+        memcpy(&w, c->store[0xA6] + 10, 2); d = w;
+    } else {
+        memcpy(&p, c->store[0xA0] + 2, 4);
+        memcpy(&i, c->store[0xA0] + 6, 4);
+        memcpy(&d, c->store[0xA0] + 10, 4);
+    }
+    *kp = PLANT_KP * p;
+    *ki = PLANT_KI * i;
+    *kd = PLANT_KD * d;
+}
+
+static void plant_run(SIM_CTRL *c, int b, double t) {
+    SIM_PLANT *p = &c->plant[b];
+    double kp, ki, kd, r, e, dir;
+
+    plant_gains(c, &kp, &ki, &kd);
+    dir = p->to >= p->from ? 1 : -1;
+
+    // nobody looked for a long while, the loop has long settled or blown up
+    if (t - p->t > 1.0) p->t = t - 1.0;
+    for (; p->t < t; p->t += PLANT_DT) {
+        r = p->t >= p->end ? p->to : p->from + dir * SIM_SPEED * (p->t - p->start);
+        e = r - p->x;
+        p->integ += e * PLANT_DT;
+        p->v += (kp * e + ki * p->integ - kd * p->v) * PLANT_DT;
+        p->x += p->v * PLANT_DT;
+    }
+    if (p->x > INT32_MAX || p->x < INT32_MIN || p->x != p->x) {
+        p->x = p->to;
+        p->v = p->integ = 0;
+    }
+    c->pos[b] = (int32_t)(p->x >= 0 ? p->x + 0.5 : p->x - 0.5);
+}
+
+static int plant_settled(SIM_CTRL *c, int b, double t) {
+    SIM_PLANT *p = &c->plant[b];
+
+    return t >= p->end && fabs(p->to - p->x) <= PLANT_INPOS && fabs(p->v) < PLANT_STILL;
+}
+
+static void plant_move(SIM_CTRL *c, int b, int32_t target) {
+    SIM_PLANT *p = &c->plant[b];
+    double t = now();
+
+    plant_run(c, b, t);
+    p->from = p->x;
+    p->to = target;
+    p->start = t;
+    p->end = t + fabs(p->to - p->from) / SIM_SPEED;
+    p->integ = 0;
+    c->moveEnd[b] = p->end;
+}
+
+// Moves ending, and the replies whose time has come, into rx.
+static void update(SIM_CTRL *c) {
+    unsigned char status[14];
+    double t = now();
+    SIM_FRAME *f;
+    int b;
+
+    for (b = 0; b < (c->bays ? c->bays : 1); b++) {
+        if (plantOn) plant_run(c, b, t);
+        if (c->moveEnd[b] == 0 || t < c->moveEnd[b]) continue;
+        if (plantOn && !plant_settled(c, b, t)) continue;
+        c->moveEnd[b] = 0;
+
+        //MGMSG_MOT_MOVE_COMPLETED, with the status
+        memset(status, 0, sizeof(status));
+        status[0] = 0x01;
+        memcpy(status + 2, &c->pos[b], 4);
+        emit(c, 0x0464, c->bays ? 0x21 + b : 0x50, 0, 0, status, 14);
+    }
+
+    while (c->qn > 0) {
+        f = &c->q[c->qhead];
+        if (f->ready > t || c->rxn + f->len > (int)sizeof(c->rx)) break;
+        memcpy(c->rx + c->rxn, f->b, f->len);
+        c->rxn += f->len;
+        c->qhead = (c->qhead + 1) % SIM_QUEUE;
+        c->qn--;
+    }
+}
+
+// A USB transfer, which fails once the controller is gone. Writes may
+// also be the ones that find it gone.
+static int transfer(SIM_CTRL *c, int write) {
+    if (c->downUntil != 0) return SIM_EGONE;
+    if (write && happens(faults.disconnect)) {
+        c->downUntil = now() + faults.downMs / 1e3;
+        c->rxn = c->qn = 0;
+        counts.disconnects++;
+        return SIM_EGONE;
+    }
+    return 0;
+}
+
+static void request(SIM_CTRL *c, const unsigned char *b, int len) {
+    unsigned short id = b[0] | (b[1] << 8);
+    unsigned char r[84];
+    char dst = b[4] & 0x7F, src;
+    int bay = 0, dl = 0;
+    int32_t val32;
+    const unsigned char *d = NULL;
+
+    if (b[4] & 0x80) {
+        dl = len - 6;
+        d = b + 6;
+    }
+    if (c->bays) {
+        // the motherboard only answers the hardware information
+        if (dst == 0x11 ? id != 0x0005 : (dst < 0x21 || dst >= 0x21 + c->bays)) return;
+        bay = dst == 0x11 ? 0 : dst - 0x21;
+    }
+    src = c->bays ? dst : 0x50;
+
+    switch (id) {
+        case 0x0005:
+            //MGMSG_HW_REQ_INFO
+            memset(r, 0, sizeof(r));
+            val32 = (int32_t)c->serial;
+            memcpy(r, &val32, 4);
+            memcpy(r + 4, c->model, strlen(c->model));
+            r[12] = c->hwtype;
+            r[14] = 3;
+            r[82] = c->bays ? c->bays : 1;
+            emit(c, 0x0006, src, 0, 0, r, 84);
+            break;
+        case 0x0411:
+            //MGMSG_MOT_REQ_POSCOUNTER
+            r[0] = 0x01;
+            r[1] = 0x00;
+            memcpy(r + 2, &c->pos[bay], 4);
+            emit(c, 0x0412, src, 0, 0, r, 6);
+            break;
+        case 0x0480:
+        case 0x0490:
+            //MGMSG_MOT_REQ_STATUSUPDATE, MGMSG_MOT_REQ_DCSTATUSUPDATE
+            update(c);
+            memset(r, 0, 14);
+            r[0] = 0x01;
+            memcpy(r + 2, &c->pos[bay], 4);
+            val32 = (int32_t)0x80000000 | (c->moveEnd[bay] != 0 ? 0x10 : 0) | (c->homed[bay] ? 0x400 : 0);
+            memcpy(r + 10, &val32, 4);
+            emit(c, id + 1, src, 0, 0, r, 14);
+            break;
+        case 0x0443:
+            //MGMSG_MOT_MOVE_HOME
+            c->pos[bay] = 0;
+            c->moveEnd[bay] = 0;
+            c->homed[bay] = 1;
+            memset(&c->plant[bay], 0, sizeof(SIM_PLANT));
+            c->plant[bay].t = now();
+            emit(c, 0x0444, src, 0x01, 0x00, NULL, 0);
+            break;
+        case 0x0450:
+            //MGMSG_MOT_SET_MOVEABSPARAMS
+            if (dl >= 6) memcpy(&c->absTarget[bay], d + 2, 4);
+            break;
+        case 0x0451:
+            //MGMSG_MOT_REQ_MOVEABSPARAMS
+            r[0] = 0x01;
+            r[1] = 0x00;
+            memcpy(r + 2, &c->absTarget[bay], 4);
+            emit(c, 0x0452, src, 0, 0, r, 6);
+            break;
+        case 0x0448:
+        case 0x0453:
+            //MGMSG_MOT_MOVE_RELATIVE, MGMSG_MOT_MOVE_ABSOLUTE (the short form
+            //goes to the MOVEABSPARAMS target)
+            if (id == 0x0453 && dl == 0) val32 = c->absTarget[bay];
+            else if (dl < 6) break;
+            else memcpy(&val32, d + 2, 4);
+            if (plantOn) {
+                if (id == 0x0448) val32 += (int32_t)c->plant[bay].to;
+                plant_move(c, bay, val32);
+                break;
+            }
+            if (id == 0x0448) val32 += c->pos[bay];
+            c->moveEnd[bay] = now() + labs((long)val32 - c->pos[bay]) / SIM_SPEED + SIM_LATENCY;
+            c->pos[bay] = val32;
+            break;
+        case 0x0465:
+            //MGMSG_MOT_MOVE_STOP
+            if (c->moveEnd[bay] == 0) break;
+            c->moveEnd[bay] = 0;
+            if (plantOn) {
+                plant_run(c, bay, now());
+                c->plant[bay].from = c->plant[bay].to = c->plant[bay].x;
+                c->plant[bay].end = now();
+            }
+            memset(r, 0, 14);
+            r[0] = 0x01;
+            memcpy(r + 2, &c->pos[bay], 4);
+            emit(c, 0x0466, src, 0, 0, r, 14);
+            break;
+        default:
+            //the motor parameter blocks: SET, REQ (SET + 1) and GET (SET + 2)
+            if ((id >> 8) != 0x04) break;
+            if (dl > 0 && dl <= SIM_STORE) {
+                memcpy(c->store[id & 0xFF], d, dl);
+                c->storelen[id & 0xFF] = dl;
+            } else if (dl == 0 && c->storelen[(id - 1) & 0xFF] > 0)
+                emit(c, id + 1, src, 0, 0, c->store[(id - 1) & 0xFF], c->storelen[(id - 1) & 0xFF]);
+            break;
+    }
+}
+
+
+void soaksim_init(int nControllers, unsigned int uSeed) {
+    static const int32_t vel[7] = {0x0001, 0, 4000, 100000};
+    static const int32_t pid[6] = {0x0001, 100, 20, 300, 50, 0x0F};
+    SIM_CTRL *c;
+    int k, f;
+
+    if (nControllers > SIM_MAX) nControllers = SIM_MAX;
+    free(ctrl);
+    ctrl = calloc(nControllers, sizeof(SIM_CTRL));
+    numCtrl = ctrl != NULL ? nControllers : 0;
+    rng = uSeed != 0 ? uSeed : 1;
+    memset(&faults, 0, sizeof(faults));
+    memset(&counts, 0, sizeof(counts));
+
+    for (k = 0; k < numCtrl; k++) {
+        c = &ctrl[k];
+        f = k % (int)(sizeof(families) / sizeof(families[0]));
+        c->serial = families[f].prefix * 1000000 + k + 1;
+        c->model = families[f].model;
+        c->hwtype = families[f].hwtype;
+        c->bays = families[f].bays;
+
+        // velocity and PID parameters to read back (chan ident, then the values)
+        memcpy(c->store[0x13], vel, 2);
+        memcpy(c->store[0x13] + 2, vel + 1, 12);
+        c->storelen[0x13] = 14;
+        memcpy(c->store[0xA0], pid, 2);
+        memcpy(c->store[0xA0] + 2, pid + 1, 16);
+        memcpy(c->store[0xA0] + 18, pid + 5, 2);
+        c->storelen[0xA0] = 20;
+
+        // and a position loop block for the brushless ones, all zeros
+        c->store[0xA6][0] = 0x01;
+        c->storelen[0xA6] = 28;
+    }
+}
+
+void soaksim_set_plant(int on) {
+    double t = now();
+    int k, b;
+
+    plantOn = on;
+    for (k = 0; k < numCtrl; k++)
+        for (b = 0; b < 3; b++) {
+            memset(&ctrl[k].plant[b], 0, sizeof(SIM_PLANT));
+            ctrl[k].plant[b].x = ctrl[k].plant[b].from = ctrl[k].plant[b].to = ctrl[k].pos[b];
+            ctrl[k].plant[b].t = t;
+        }
+}
+
+void soaksim_set_faults(const SOAK_FAULTS *f) {
+    if (f == NULL) memset(&faults, 0, sizeof(faults));
+    else memcpy(&faults, f, sizeof(faults));
+}
+
+int soaksim_count(void) {
+    return numCtrl;
+}
+
+long soaksim_serial(int k) {
+    return k >= 0 && k < numCtrl ? ctrl[k].serial : 0;
+}
+
+long soaksim_bays(int k) {
+    return k >= 0 && k < numCtrl ? ctrl[k].bays : 0;
+}
+
+void soaksim_counts(SOAK_COUNTS *c) {
+    memcpy(c, &counts, sizeof(counts));
+}
+
+double soaksim_reconnected(long lSerialNum) {
+    SIM_CTRL *c = find(lSerialNum);
+    double t;
+
+    if (c == NULL || c->reconnect == 0) return 0;
+    t = c->reconnect;
+    c->reconnect = 0;
+    return t;
+}
+
+long soaksim_position(int k, int bay) {
+    if (k < 0 || k >= numCtrl || bay < 0 || bay >= 3) return 0;
+    return ctrl[k].pos[bay];
+}
+
+void soaksim_velparams(int k, float *pfMinVel, float *pfAccn, float *pfMaxVel) {
+    int32_t v[3] = {0, 0, 0};
+
+    //MGMSG_MOT_SET_VELPARAMS: chan ident, then min velocity, acceleration, max velocity
+    if (k >= 0 && k < numCtrl) memcpy(v, ctrl[k].store[0x13] + 2, 12);
+    *pfMinVel = (float)v[0];
+    *pfAccn = (float)v[1];
+    *pfMaxVel = (float)v[2];
+}
+
+
+// The libftdi API, as much of it as libapt uses.
+
+struct ftdi_context *ftdi_new(void) {
+    return calloc(1, sizeof(struct ftdi_context));
+}
+
+int ftdi_init(struct ftdi_context *ftdi) {
+    (void)ftdi;
+    return 0;
+}
+
+void ftdi_deinit(struct ftdi_context *ftdi) {
+    (void)ftdi;
+}
+
+void ftdi_free(struct ftdi_context *ftdi) {
+    free(ftdi);
+}
+
+struct ftdi_version_info ftdi_get_library_version(void) {
+    struct ftdi_version_info v;
+
+    memset(&v, 0, sizeof(v));
+    v.version_str = "soaksim";
+    v.snapshot_str = "soaksim";
+    return v;
+}
+
+const char *ftdi_get_error_string(struct ftdi_context *ftdi) {
+    (void)ftdi;
+    return "simulated controller";
+}
+
+int ftdi_usb_find_all(struct ftdi_context *ftdi, struct ftdi_device_list **devlist, int vendor, int product) {
+    int k;
+
+    (void)ftdi; (void)vendor; (void)product;
+    for (k = 0; k < numCtrl; k++) {
+        devs[k].next = (k + 1 < numCtrl) ? &devs[k + 1] : NULL;
+        devs[k].dev = (struct libusb_device *)&ctrl[k];
+    }
+    *devlist = numCtrl > 0 ? &devs[0] : NULL;
+    return numCtrl;
+}
+
+void ftdi_list_free(struct ftdi_device_list **devlist) {
+    *devlist = NULL;
+}
+
+int ftdi_usb_get_strings(struct ftdi_context *ftdi, struct libusb_device *dev,
+        char *manufacturer, int mnf_len, char *description, int desc_len, char *serial, int serial_len) {
+    SIM_CTRL *c = (SIM_CTRL *)dev;
+
+    (void)ftdi;
+    if (manufacturer != NULL) snprintf(manufacturer, mnf_len, "Thorlabs");
+    if (description != NULL) snprintf(description, desc_len, "Simulated %s", c->model);
+    if (serial != NULL) snprintf(serial, serial_len, "%ld", c->serial);
+    return 0;
+}
+
+int ftdi_usb_open_desc_index(struct ftdi_context *ftdi, int vendor, int product,
+        const char *description, const char *serial, unsigned int index) {
+    SIM_CTRL *c = serial != NULL ? find(atol(serial)) : NULL;
+
+    (void)vendor; (void)product; (void)description; (void)index;
+    ftdi->usb_dev = NULL;
+    if (c == NULL) return -3;
+    // one open at a time, as with a real device
+    if (c->owner != NULL && c->owner != ftdi) return -5;
+    if (c->downUntil != 0) {
+        if (now() < c->downUntil) return -3;
+        c->reconnect = c->downUntil;
+        c->downUntil = 0;
+    }
+    c->owner = ftdi;
+    ftdi->usb_dev = (struct libusb_device_handle *)c;
+    return 0;
+}
+
+int ftdi_usb_close(struct ftdi_context *ftdi) {
+    if (opened(ftdi) != NULL) opened(ftdi)->owner = NULL;
+    ftdi->usb_dev = NULL;
+    return 0;
+}
+
+int ftdi_set_interface(struct ftdi_context *ftdi, enum ftdi_interface interface) {
+    (void)ftdi; (void)interface;
+    return 0;
+}
+
+int ftdi_set_line_property(struct ftdi_context *ftdi, enum ftdi_bits_type bits,
+        enum ftdi_stopbits_type sbit, enum ftdi_parity_type parity) {
+    (void)bits; (void)sbit; (void)parity;
+    return opened(ftdi) != NULL ? transfer(opened(ftdi), 0) : SIM_EGONE;
+}
+
+int ftdi_set_baudrate(struct ftdi_context *ftdi, int baudrate) {
+    (void)baudrate;
+    return opened(ftdi) != NULL ? transfer(opened(ftdi), 0) : SIM_EGONE;
+}
+
+int ftdi_set_latency_timer(struct ftdi_context *ftdi, unsigned char latency) {
+    (void)latency;
+    return opened(ftdi) != NULL ? transfer(opened(ftdi), 0) : SIM_EGONE;
+}
+
+int ftdi_setflowctrl(struct ftdi_context *ftdi, int flowctrl) {
+    (void)flowctrl;
+    return opened(ftdi) != NULL ? transfer(opened(ftdi), 0) : SIM_EGONE;
+}
+
+int ftdi_read_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize) {
+    (void)ftdi; (void)chunksize;
+    return 0;
+}
+
+int ftdi_write_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize) {
+    (void)ftdi; (void)chunksize;
+    return 0;
+}
+
+int ftdi_usb_purge_rx_buffer(struct ftdi_context *ftdi) {
+    SIM_CTRL *c = opened(ftdi);
+    int ret;
+
+    if (c == NULL) return SIM_EGONE;
+    if ((ret = transfer(c, 0)) < 0) return ret;
+    update(c);
+    c->rxn = 0;
+    return 0;
+}
+
+int ftdi_usb_purge_tx_buffer(struct ftdi_context *ftdi) {
+    return opened(ftdi) != NULL ? transfer(opened(ftdi), 0) : SIM_EGONE;
+}
+
+int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size) {
+    SIM_CTRL *c = opened(ftdi);
+    int ret;
+
+    if (c == NULL) return SIM_EGONE;
+    if ((ret = transfer(c, 0)) < 0) return ret;
+    update(c);
+
+    if (size > c->rxn) size = c->rxn;
+    memcpy(buf, c->rx, size);
+    memmove(c->rx, c->rx + size, c->rxn - size);
+    c->rxn -= size;
+    return size;
+}
+
+int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size) {
+    SIM_CTRL *c = opened(ftdi);
+    int k = 0, len, ret;
+
+    if (c == NULL) return SIM_EGONE;
+    if ((ret = transfer(c, 1)) < 0) return ret;
+
+    while (k + 6 <= size) {
+        len = 6;
+        if (buf[k + 4] & 0x80) len += buf[k + 2] | (buf[k + 3] << 8);
+        if (k + len > size) break;
+        request(c, buf + k, len);
+        k += len;
+    }
+    return size;
+}
@@ -0,0 +1,68 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Simulated APT controllers behind the libftdi API, for aptsoak and
+// apttune-sim.
+// Not thread-safe: like libapt itself, it must be called with the
+// caller's lock held.
+
+#ifndef SOAKSIM_H
+#define SOAKSIM_H
+
+// fault rates, as probabilities per reply frame (per write for the
+// disconnects)
+typedef struct {
+    double drop;
+    double truncate;
+    double corrupt;
+    double spike;
+    double spikeMs;         // extra latency of a spike
+    double disconnect;
+    double downMs;          // how long a disconnected controller stays away
+} SOAK_FAULTS;
+
+typedef struct {
+    long frames;
+    long dropped;
+    long truncated;
+    long corrupted;
+    long spikes;
+    long disconnects;
+} SOAK_COUNTS;
+
+void soaksim_init(int nControllers, unsigned int uSeed);
+void soaksim_set_faults(const SOAK_FAULTS *f);     // NULL for none
+
+// With a plant, the stages follow a second order response to their PID
+// (or position loop) gains instead of arriving at once, for apttune.
+void soaksim_set_plant(int on);
+int soaksim_count(void);
+long soaksim_serial(int k);
+long soaksim_bays(int k);
+void soaksim_counts(SOAK_COUNTS *c);
+
+// When lSerialNum came back after a disconnect that nobody has noticed
+// yet, returns the time (apt clock) it came back and forgets about it,
+// 0 otherwise.
+double soaksim_reconnected(long lSerialNum);
+
+// What controller k really has, to check the replies against: the position
+// of a bay (0 for a standalone controller) and the velocity parameters.
+long soaksim_position(int k, int bay);
+void soaksim_velparams(int k, float *pfMinVel, float *pfAccn, float *pfMaxVel);
+
+#endif
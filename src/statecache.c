@@ -0,0 +1,298 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Persistent device state cache, see APT_SetStateCache in libapt.h.
+//
+// The file is a fixed-size table of records mapped in memory. A record is
+// only used if the serial number, channel and firmware version of the
+// device all match, so a firmware update or swapping a controller simply
+// misses the cache. Processes sharing the file take turns with flock(), a
+// shared lock to read a record and an exclusive one to write.
+
+#include "libapt_private.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC     0x41505443  // "APTC"
+#define CACHE_VERSION   3
+#define CACHE_RECORDS   64
+
+typedef struct {
+    int32_t SerialNumber;           // 0 if the record is free
+    int32_t ChannelId;
+    char FirmwareVersion[13];
+    char ModelNumber[9];
+    char Notes[49];
+    char pad[1];
+    int32_t Cached;                 // CACHED_* bits
+    int32_t HardwareType;
+    int32_t HardwareVersion;
+    int32_t ModState;
+    int32_t NumberChannels;
+    int32_t MinPos;
+    int32_t MaxPos;
+    int32_t Units;
+    float Pitch;
+    float VelMin;
+    float VelAccn;
+    float VelMax;
+    int32_t ProfMode;
+    float Jerk;
+    int32_t Homed;
+    int32_t Transport[7];           // APT_TRANSPORT_SETTINGS
+    int32_t pad2;
+    int64_t Updated;                // time() of the last write
+} CACHE_RECORD;
+
+typedef struct {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t NumRecords;
+    uint32_t pad;
+    CACHE_RECORD Record[CACHE_RECORDS];
+} CACHE_FILE;
+
+static CACHE_FILE *cache = NULL;
+static int cacheFd = -1;            // kept open for flock()
+
+long cache_open(const char *szPath) {
+    int fd;
+    long ret = 0;
+    struct stat st;
+
+    cache_close();
+
+    //only the user may read or change it
+    if ((fd = open(szPath, O_RDWR | O_CREAT, 0600)) < 0)
+        return errno;
+
+    if (fstat(fd, &st) < 0) {
+        ret = errno;
+        goto end;
+    }
+    if (st.st_size != sizeof(CACHE_FILE) && ftruncate(fd, sizeof(CACHE_FILE)) < 0) {
+        ret = errno;
+        goto end;
+    }
+
+    cache = mmap(NULL, sizeof(CACHE_FILE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cache == MAP_FAILED) {
+        cache = NULL;
+        ret = errno;
+        goto end;
+    }
+
+    // new, truncated or older layout: start afresh
+    flock(fd, LOCK_EX);
+    if (cache->Magic != CACHE_MAGIC || cache->Version != CACHE_VERSION
+            || cache->NumRecords != CACHE_RECORDS) {
+        memset(cache, 0, sizeof(CACHE_FILE));
+        cache->Magic = CACHE_MAGIC;
+        cache->Version = CACHE_VERSION;
+        cache->NumRecords = CACHE_RECORDS;
+    }
+    flock(fd, LOCK_UN);
+    cacheFd = fd;
+
+end:
+    if (ret != 0) {
+        close(fd);
+        fprintf(stderr, "Error: state cache %s (%s)\n", szPath, strerror(ret));
+    }
+    return ret;
+}
+
+void cache_close(void) {
+    if (cache == NULL) return;
+    msync(cache, sizeof(CACHE_FILE), MS_ASYNC);
+    munmap(cache, sizeof(CACHE_FILE));
+    cache = NULL;
+    close(cacheFd);
+    cacheFd = -1;
+}
+
+static CACHE_RECORD *cache_find(long lSerialNum, long lChanID) {
+    int i;
+
+    for (i = 0; i < CACHE_RECORDS; i++) {
+        if (cache->Record[i].SerialNumber == lSerialNum && cache->Record[i].ChannelId == lChanID)
+            return &cache->Record[i];
+    }
+    return NULL;
+}
+
+// Fills aptInfo[i] for its current channel from a matching record. Must be
+// called once the firmware version has been read from the device.
+// Returns 0 on a hit, -1 on a miss.
+long cache_load(long i) {
+    CACHE_RECORD *rec;
+
+    aptInfo[i].Cached = 0;
+    if (cache == NULL) return -1;
+
+    flock(cacheFd, LOCK_SH);
+    rec = cache_find(aptInfo[i].SerialNumber, aptInfo[i].ChannelId);
+    if (rec == NULL || strcmp(rec->FirmwareVersion, aptInfo[i].FirmwareVersion) != 0) {
+        flock(cacheFd, LOCK_UN);
+        return -1;
+    }
+
+    aptInfo[i].Cached = rec->Cached;
+    if (rec->Cached & CACHED_STAGEAXIS) {
+        aptInfo[i].MinPos = rec->MinPos;
+        aptInfo[i].MaxPos = rec->MaxPos;
+        aptInfo[i].Units = rec->Units;
+        aptInfo[i].Pitch = rec->Pitch;
+    }
+    if (rec->Cached & CACHED_VELPARAMS) {
+        aptInfo[i].VelMin = rec->VelMin;
+        aptInfo[i].VelAccn = rec->VelAccn;
+        aptInfo[i].VelMax = rec->VelMax;
+    }
+    if (rec->Cached & CACHED_PROFILEMODE) {
+        aptInfo[i].ProfMode = rec->ProfMode;
+        aptInfo[i].Jerk = rec->Jerk;
+    }
+    if (rec->Cached & CACHED_HOMED)
+        aptInfo[i].Homed = rec->Homed;
+    if (rec->Cached & CACHED_TRANSPORT) {
+        aptInfo[i].Transport.lProfile = rec->Transport[0];
+        aptInfo[i].Transport.lLatencyTimer = rec->Transport[1];
+        aptInfo[i].Transport.lReadChunkSize = rec->Transport[2];
+        aptInfo[i].Transport.lWriteChunkSize = rec->Transport[3];
+        aptInfo[i].Transport.lFlowControl = rec->Transport[4];
+        aptInfo[i].Transport.lReadTimeout = rec->Transport[5];
+        aptInfo[i].Transport.lWriteTimeout = rec->Transport[6];
+    }
+    flock(cacheFd, LOCK_UN);
+
+    if (DEBUG) printf("State cache hit for %ld channel %ld (0x%02x)\n",
+            aptInfo[i].SerialNumber, aptInfo[i].ChannelId, (int)rec->Cached);
+    return 0;
+}
+
+// Writes what aptInfo[i] knows about its current channel back to the cache.
+void cache_store(long i) {
+    CACHE_RECORD *rec;
+    int j;
+
+    if (cache == NULL) return;
+
+    flock(cacheFd, LOCK_EX);
+    rec = cache_find(aptInfo[i].SerialNumber, aptInfo[i].ChannelId);
+    if (rec == NULL) {
+        // take a free record, or recycle the oldest one
+        rec = &cache->Record[0];
+        for (j = 0; j < CACHE_RECORDS; j++) {
+            if (cache->Record[j].SerialNumber == 0) {
+                rec = &cache->Record[j];
+                break;
+            }
+            if (cache->Record[j].Updated < rec->Updated)
+                rec = &cache->Record[j];
+        }
+        memset(rec, 0, sizeof(CACHE_RECORD));
+    }
+
+    // a different firmware invalidates whatever was there
+    if (strcmp(rec->FirmwareVersion, aptInfo[i].FirmwareVersion) != 0)
+        rec->Cached = 0;
+
+    rec->SerialNumber = aptInfo[i].SerialNumber;
+    rec->ChannelId = aptInfo[i].ChannelId;
+    memcpy(rec->FirmwareVersion, aptInfo[i].FirmwareVersion, sizeof(rec->FirmwareVersion));
+    memcpy(rec->ModelNumber, aptInfo[i].ModelNumber, sizeof(rec->ModelNumber));
+    memcpy(rec->Notes, aptInfo[i].Notes, sizeof(rec->Notes));
+    rec->HardwareType = aptInfo[i].HardwareType;
+    rec->HardwareVersion = aptInfo[i].HardwareVersion;
+    rec->ModState = aptInfo[i].ModState;
+    rec->NumberChannels = aptInfo[i].NumberChannels;
+    rec->MinPos = aptInfo[i].MinPos;
+    rec->MaxPos = aptInfo[i].MaxPos;
+    rec->Units = aptInfo[i].Units;
+    rec->Pitch = aptInfo[i].Pitch;
+    rec->VelMin = aptInfo[i].VelMin;
+    rec->VelAccn = aptInfo[i].VelAccn;
+    rec->VelMax = aptInfo[i].VelMax;
+    rec->ProfMode = aptInfo[i].ProfMode;
+    rec->Jerk = aptInfo[i].Jerk;
+    rec->Homed = aptInfo[i].Homed;
+    rec->Transport[0] = aptInfo[i].Transport.lProfile;
+    rec->Transport[1] = aptInfo[i].Transport.lLatencyTimer;
+    rec->Transport[2] = aptInfo[i].Transport.lReadChunkSize;
+    rec->Transport[3] = aptInfo[i].Transport.lWriteChunkSize;
+    rec->Transport[4] = aptInfo[i].Transport.lFlowControl;
+    rec->Transport[5] = aptInfo[i].Transport.lReadTimeout;
+    rec->Transport[6] = aptInfo[i].Transport.lWriteTimeout;
+    rec->Cached = aptInfo[i].Cached | CACHED_INFO;
+    rec->Updated = (int64_t)time(NULL);
+    flock(cacheFd, LOCK_UN);
+}
+
+
+long WINAPI APT_SetStateCache(const char *szPath) {
+    long i, ret;
+
+    if (szPath == NULL) {
+        cache_close();
+        return 0;
+    }
+    if ((ret = cache_open(szPath)) != 0)
+        return ret;
+
+    // devices already initialised pick up the cached state straight away
+    for (i = 0; i < numDevs; i++) {
+        if (aptInfo[i].FirmwareVersion[0] == 0) continue;
+        if (cache_load(i) < 0)
+            cache_store(i);
+        else
+            homed_confirm(i);
+    }
+    return 0;
+}
+
+long WINAPI APT_ClearStateCache(long lSerialNum) {
+    long i;
+
+    for (i = 0; i < numDevs; i++) {
+        if (lSerialNum == 0 || aptInfo[i].SerialNumber == lSerialNum)
+            aptInfo[i].Cached = 0;
+    }
+    if (cache == NULL) return 0;
+
+    flock(cacheFd, LOCK_EX);
+    for (i = 0; i < CACHE_RECORDS; i++) {
+        if (lSerialNum == 0 || cache->Record[i].SerialNumber == lSerialNum)
+            memset(&cache->Record[i], 0, sizeof(CACHE_RECORD));
+    }
+    flock(cacheFd, LOCK_UN);
+    return 0;
+}
+
+long WINAPI APT_GetHomedStatus(long lSerialNum, long *plHomed) {
+    long i;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    *plHomed = aptInfo[i].Homed;
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Synchronized start of several controllers, see APT_SyncPrepare in
+// libapt.h.
+//
+// MOT_MoveAbsoluteEx opens the device, sends the 12 byte long form of
+// MGMSG_MOT_MOVE_ABSOLUTE and closes it again, so one controller after the
+// other starts several milliseconds after the previous one. Here the start
+// is split in two: APT_SyncPrepare opens every controller in an FTDI
+// context of its own, which it keeps, and loads the target with
+// MGMSG_MOT_SET_MOVEABSPARAMS. APT_SyncStart then only has to send the
+// 6 byte short form of MGMSG_MOT_MOVE_ABSOLUTE, which moves to that target,
+// to each of them in turn.
+//
+// The rest of libapt talks to whatever the global ftdic has open, so each
+// controller's context is swapped in while we talk to it.
+
+#include "libapt_private.h"
+
+typedef struct {
+    long i;                         // index in aptInfo
+    struct ftdi_context *ctx;       // open from APT_SyncPrepare to APT_SyncStart
+    float Target;
+    float StartPos;                 // where it was, if aptInfo knew
+    long StartValid;
+    double Start;                   // when its trigger was written
+    long Done;
+} SYNC_DEV;
+
+static SYNC_DEV group[APT_SYNC_MAX];
+static long numGroup = 0;
+
+static struct ftdi_context *swap_ctx(struct ftdi_context *ctx) {
+    struct ftdi_context *old = ftdic;
+
+    ftdic = ctx;
+    return old;
+}
+
+static void sync_release(void) {
+    long k;
+
+    for (k = 0; k < numGroup; k++) {
+        if (group[k].ctx == NULL) continue;
+        ftdi_usb_close(group[k].ctx);
+        ftdi_free(group[k].ctx);
+        group[k].ctx = NULL;
+    }
+    numGroup = 0;
+}
+
+// Opens one controller of the group in its own context and loads its target.
+static long sync_load(SYNC_DEV *d) {
+    struct ftdi_context *old;
+    long ret;
+    int16_t val16;
+    int32_t val32;
+    char txbuf[12];
+
+    if ((d->ctx = ftdi_new()) == NULL) return ENOMEM;
+
+    //MGMSG_MOT_SET_MOVEABSPARAMS
+    txbuf[0] = 0x50;
+    txbuf[1] = 0x04;
+    txbuf[2] = 0x06;
+    txbuf[3] = 0x00;
+    txbuf[4] = aptInfo[d->i].DestinationByte | 0x80;
+    txbuf[5] = 0x01;
+
+    //copy Chan Ident
+    val16 = (int16_t)caps_ident(d->i);
+    memcpy(txbuf+6,(char *)(&val16),2);
+    val32 = (int32_t)d->Target;
+    memcpy(txbuf+8,(char *)(&val32),4);
+    if (DEBUG) hexDump("sync_load txbuf",txbuf,12);
+
+    old = swap_ctx(d->ctx);
+    if ((ret = ftdi_open_apt_index(d->i)) < 0) goto end;
+    if ((ret = ftdi_write_data(ftdic, txbuf, 12)) < 0) goto end;
+    ret = 0;
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    swap_ctx(old);
+    return ret;
+}
+
+// Stops the moves that haven't finished, after a cancelled wait.
+static void sync_stop(void) {
+    long k;
+    char txbuf[6];
+
+    for (k = 0; k < numGroup; k++) {
+        if (group[k].Done) continue;
+
+        //MGMSG_MOT_MOVE_STOP, profiled
+        txbuf[0] = 0x65;
+        txbuf[1] = 0x04;
+        txbuf[2] = (char)caps_ident(group[k].i);
+        txbuf[3] = 0x02;
+        txbuf[4] = aptInfo[group[k].i].DestinationByte;
+        txbuf[5] = 0x01;
+        if (DEBUG) hexDump("sync_stop txbuf",txbuf,6);
+        ftdi_write_data(group[k].ctx, txbuf, 6);
+    }
+}
+
+// Waits for the MGMSG_MOT_MOVE_COMPLETED of every controller, the moves
+// having all started together. Returns 0, ETIMEDOUT, ECANCELED or a
+// libftdi error.
+static long sync_wait(void) {
+    struct ftdi_context *old;
+    long k, ret = 0, left, timeout = deadline_remaining_ms();
+    double until, dt;
+    char buf[32];
+
+    if (timeout == LONG_MAX) timeout = MOVE_TIMEOUT;
+    until = apt_time() + timeout / 1e3;
+
+    old = swap_ctx(NULL);
+    for (k = 0; k < numGroup; k++) {
+        SYNC_DEV *d = &group[k];
+
+        swap_ctx(d->ctx);
+        while (!d->Done) {
+            left = (long)((until - apt_time()) * 1e3);
+            if (left <= 0) break;
+            if ((ret = read_frame(buf, sizeof(buf), (int)left)) <= 0) break;
+            if (DEBUG) hexDump("sync_wait rxbuf",buf,ret);
+            if (ret >= 6 && buf[0] == 0x64 && buf[1] == 0x04) d->Done = 1;
+        }
+        if (ret < 0) break;
+        ret = 0;
+
+        //MGMSG_MOT_MOVE_COMPLETED
+        aptInfo[d->i].PositionValid = d->Done;
+        if (!d->Done) continue;
+        aptInfo[d->i].Position = d->Target;
+
+        //only the first one is timed, the others may have been done for a while
+        if (k == 0 && d->StartValid && (dt = apt_time() - d->Start) > 0)
+            motion_observe(d->i, d->Target - d->StartPos, dt);
+    }
+    swap_ctx(old);
+
+    if (ret < 0) return ret;
+    if (deadline_check() == ECANCELED) {
+        sync_stop();
+        return ECANCELED;
+    }
+    for (k = 0; k < numGroup; k++)
+        if (!group[k].Done) return ETIMEDOUT;
+    return 0;
+}
+
+
+long WINAPI APT_SyncPrepare(long lNumDevices, const long *plSerialNums, const float *pfAbsPos) {
+    long k, l, ret = 0;
+
+    sync_release();
+    if (lNumDevices < 1 || lNumDevices > APT_SYNC_MAX) return EINVAL;
+    for (k = 0; k < lNumDevices; k++) {
+        for (l = 0; l < k; l++)
+            if (plSerialNums[l] == plSerialNums[k]) return EINVAL;
+        if (GetIndex(plSerialNums[k], &group[k].i) < 0) return ENODEV;
+    }
+
+    for (k = 0; k < lNumDevices; k++) {
+        SYNC_DEV *d = &group[k];
+
+        d->ctx = NULL;
+        d->Target = pfAbsPos[k];
+        d->StartPos = aptInfo[d->i].Position;
+        d->StartValid = aptInfo[d->i].PositionValid;
+        d->Start = 0;
+        d->Done = 0;
+        numGroup = k + 1;
+        if ((ret = sync_load(d)) != 0) break;
+    }
+
+    if (ret == 0 && (ret = deadline_check()) == 0) return 0;
+    sync_release();
+    return ret;
+}
+
+long WINAPI APT_SyncStart(BOOL bWait, double *pdSkew, double *pdStartTimes) {
+    struct ftdi_context *old;
+    long k, ret = 0;
+    double first = 0, last = 0;
+    char txbuf[6];
+
+    if (numGroup == 0) return EINVAL;
+
+    //MGMSG_MOT_MOVE_ABSOLUTE, short form: go to the MOVEABSPARAMS target
+    old = swap_ctx(NULL);
+    for (k = 0; k < numGroup; k++) {
+        SYNC_DEV *d = &group[k];
+
+        txbuf[0] = 0x53;
+        txbuf[1] = 0x04;
+        txbuf[2] = (char)caps_ident(d->i);
+        txbuf[3] = 0x00;
+        txbuf[4] = aptInfo[d->i].DestinationByte;
+        txbuf[5] = 0x01;
+
+        swap_ctx(d->ctx);
+        if ((ret = ftdi_write_data(ftdic, txbuf, 6)) < 0) {
+            fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+            break;
+        }
+        d->Start = apt_time();
+        aptInfo[d->i].PositionValid = 0;
+    }
+    swap_ctx(old);
+
+    //the spread of the trigger writes, as near as we can tell from here
+    if (ret >= 0) {
+        first = group[0].Start;
+        last = group[numGroup - 1].Start;
+        if (DEBUG) printf("APT_SyncStart: %ld controllers started within %.3f ms\n", numGroup, (last - first) * 1e3);
+        if (pdStartTimes != NULL)
+            for (k = 0; k < numGroup; k++) pdStartTimes[k] = group[k].Start;
+        ret = bWait ? sync_wait() : 0;
+    }
+    if (pdSkew != NULL) *pdSkew = last - first;
+
+    sync_release();
+    return ret;
+}
+
+long WINAPI APT_SyncRelease(void) {
+    sync_release();
+    return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Per-device FTDI transport settings, see APT_SetTransport in libapt.h.
+//
+// The settings that matter for the APT traffic are the FTDI latency timer
+// (how long the chip holds a partial packet before sending it to the host),
+// the libftdi read and write chunk sizes, the flow control and the libusb
+// timeouts. Short request/reply exchanges want the smallest latency timer
+// and chunks, streaming status updates are happier with larger ones.
+// APT_CalibrateTransport tries a set of candidates on the actual
+// controller, on the actual USB bus, and keeps the one with the lowest tail
+// round trip time.
+
+#include "libapt_private.h"
+
+#include <math.h>
+
+// round trips per candidate when lNumRounds is 0
+#define CALIB_ROUNDS    20
+
+static const APT_TRANSPORT_SETTINGS profiles[] = {
+    // lProfile, latency, read chunk, write chunk, flow control, read/write timeouts
+    {APT_TRANSPORT_DEFAULT,    1, 4096, 4096, APT_FLOW_NONE,   3000, 5000},
+    {APT_TRANSPORT_LOWLATENCY, 1,   64,   64, APT_FLOW_NONE,    100,  100},
+    {APT_TRANSPORT_BULK,      16, 4096, 4096, APT_FLOW_RTSCTS, 3000, 5000},
+};
+
+// what APT_CalibrateTransport tries, on top of the lowlatency profile
+static const unsigned char calibLatency[] = {1, 2, 4, 16};
+static const long calibChunk[] = {64, 512, 4096};
+static const long calibFlow[] = {APT_FLOW_NONE, APT_FLOW_RTSCTS};
+
+static long profile_settings(long lProfile, APT_TRANSPORT_SETTINGS *s) {
+    unsigned long k;
+
+    for (k = 0; k < sizeof(profiles) / sizeof(profiles[0]); k++) {
+        if (profiles[k].lProfile == lProfile) {
+            memcpy(s, &profiles[k], sizeof(APT_TRANSPORT_SETTINGS));
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+static long check_settings(const APT_TRANSPORT_SETTINGS *s) {
+    if (s->lLatencyTimer < 1 || s->lLatencyTimer > 255) return EINVAL;
+    if (s->lReadChunkSize < 64 || s->lWriteChunkSize < 64) return EINVAL;
+    if (s->lFlowControl != APT_FLOW_NONE && s->lFlowControl != APT_FLOW_RTSCTS) return EINVAL;
+    if (s->lReadTimeout <= 0 || s->lWriteTimeout <= 0) return EINVAL;
+    return 0;
+}
+
+// Settings for a newly found device: $LIBAPT_TRANSPORT ("default",
+// "lowlatency" or "bulk") or the default profile.
+void transport_init(long i) {
+    const char *env = getenv("LIBAPT_TRANSPORT");
+    long lProfile = APT_TRANSPORT_DEFAULT;
+
+    if (env != NULL && strcmp(env, "lowlatency") == 0)
+        lProfile = APT_TRANSPORT_LOWLATENCY;
+    else if (env != NULL && strcmp(env, "bulk") == 0)
+        lProfile = APT_TRANSPORT_BULK;
+    profile_settings(lProfile, &aptInfo[i].Transport);
+}
+
+// Applies the settings to the open ftdic.
+long transport_apply(const APT_TRANSPORT_SETTINGS *s) {
+    long ret;
+
+    ftdic->usb_read_timeout = s->lReadTimeout;
+    ftdic->usb_write_timeout = s->lWriteTimeout;
+    if ((ret = ftdi_read_data_set_chunksize(ftdic, s->lReadChunkSize)) < 0) return ret;
+    if ((ret = ftdi_write_data_set_chunksize(ftdic, s->lWriteChunkSize)) < 0) return ret;
+    if ((ret = ftdi_setflowctrl(ftdic, s->lFlowControl == APT_FLOW_RTSCTS ? SIO_RTS_CTS_HS : SIO_DISABLE_FLOW_CTRL)) < 0) return ret;
+    return ftdi_set_latency_timer(ftdic, (unsigned char)s->lLatencyTimer);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Times lNumRounds MGMSG_MOT_REQ_POSCOUNTER round trips on the open device
+// (ms in rtt, sorted). Returns the number of replies received.
+static long measure(long i, long lNumRounds, double *rtt) {
+    char txbuf[6] ={0x11,0x04,0x00,0x00,0x50,0x01};
+    char buf[12];
+    long k, n = 0;
+    double t0;
+
+    txbuf[2] = (char)caps_ident(i);
+    txbuf[4] = aptInfo[i].DestinationByte;
+
+    for (k = 0; k < lNumRounds; k++) {
+        t0 = apt_time();
+        if (ftdi_write_data(ftdic, txbuf, 6) < 0) break;
+        if (read_reply(buf, 12, 500) != 12) {
+            // something else is talking, start again from a clean slate
+            ftdi_usb_purge_rx_buffer(ftdic);
+            rtt[k] = 1e9;
+            continue;
+        }
+        rtt[k] = (apt_time() - t0) * 1e3;
+        n++;
+    }
+    for (; k < lNumRounds; k++) rtt[k] = 1e9;
+    qsort(rtt, lNumRounds, sizeof(double), cmp_double);
+    return n;
+}
+
+
+long WINAPI APT_SetTransport(long lSerialNum, const APT_TRANSPORT_SETTINGS *pSettings) {
+    long i, ret;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if ((ret = check_settings(pSettings)) != 0) return ret;
+    memcpy(&aptInfo[i].Transport, pSettings, sizeof(APT_TRANSPORT_SETTINGS));
+    return 0;
+}
+
+long WINAPI APT_GetTransport(long lSerialNum, APT_TRANSPORT_SETTINGS *pSettings) {
+    long i;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    memcpy(pSettings, &aptInfo[i].Transport, sizeof(APT_TRANSPORT_SETTINGS));
+    return 0;
+}
+
+long WINAPI APT_SetTransportProfile(long lSerialNum, long lProfile) {
+    APT_TRANSPORT_SETTINGS s;
+    long i, ret;
+
+    if ((ret = profile_settings(lProfile, &s)) != 0) return ret;
+    if (lSerialNum != 0) return APT_SetTransport(lSerialNum, &s);
+
+    for (i = 0; i < numDevs; i++)
+        memcpy(&aptInfo[i].Transport, &s, sizeof(APT_TRANSPORT_SETTINGS));
+    return 0;
+}
+
+long WINAPI APT_CalibrateTransport(long lSerialNum, long lNumRounds, APT_TRANSPORT_SETTINGS *pBest, float *pfMedianRTT, float *pfTailRTT) {
+    APT_TRANSPORT_SETTINGS s, best;
+    double *rtt, tail, bestTail = HUGE_VAL, bestMedian = HUGE_VAL;
+    unsigned long l, c, f;
+    long i, n, ret = 0;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if (lNumRounds <= 0) lNumRounds = CALIB_ROUNDS;
+    if ((rtt = malloc(lNumRounds * sizeof(double))) == NULL) return ENOMEM;
+
+    profile_settings(APT_TRANSPORT_LOWLATENCY, &s);
+    memcpy(&best, &aptInfo[i].Transport, sizeof(APT_TRANSPORT_SETTINGS));
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+
+    for (l = 0; l < sizeof(calibLatency); l++) {
+        for (c = 0; c < sizeof(calibChunk) / sizeof(calibChunk[0]); c++) {
+            for (f = 0; f < sizeof(calibFlow) / sizeof(calibFlow[0]); f++) {
+                s.lLatencyTimer = calibLatency[l];
+                s.lReadChunkSize = s.lWriteChunkSize = calibChunk[c];
+                s.lFlowControl = calibFlow[f];
+                if ((ret = transport_apply(&s)) < 0) goto end;
+
+                // the first exchange after a change pays for it, don't count it
+                measure(i, 1, rtt);
+                n = measure(i, lNumRounds, rtt);
+
+                // the p99 (or worst of fewer than 100 rounds) decides
+                tail = rtt[(lNumRounds * 99) / 100 < lNumRounds - 1 ? (lNumRounds * 99) / 100 : lNumRounds - 1];
+                if (DEBUG) printf("Transport latency %d chunk %ld flow %ld: %ld/%ld replies, median %.3f ms, tail %.3f ms\n",
+                        (int)s.lLatencyTimer, s.lReadChunkSize, s.lFlowControl, n, lNumRounds, rtt[lNumRounds / 2], tail);
+
+                if (n == lNumRounds && tail < bestTail) {
+                    bestTail = tail;
+                    bestMedian = rtt[lNumRounds / 2];
+                    memcpy(&best, &s, sizeof(APT_TRANSPORT_SETTINGS));
+                }
+            }
+        }
+    }
+
+    ret = 0;
+    if (bestTail == HUGE_VAL) {
+        // the controller never answered every request
+        ret = EIO;
+        goto end;
+    }
+
+    best.lProfile = APT_TRANSPORT_CALIBRATED;
+    memcpy(&aptInfo[i].Transport, &best, sizeof(APT_TRANSPORT_SETTINGS));
+    aptInfo[i].Cached |= CACHED_TRANSPORT;
+    cache_store(i);
+
+    if (pBest != NULL) memcpy(pBest, &best, sizeof(APT_TRANSPORT_SETTINGS));
+    if (pfMedianRTT != NULL) *pfMedianRTT = (float)bestMedian;
+    if (pfTailRTT != NULL) *pfTailRTT = (float)bestTail;
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    free(rtt);
+    return ret;
+}
@@ -0,0 +1,285 @@
+/*
+ * (C) Copyright 2016 Egor Zindy (https://github.com/zindy)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// Loop gain auto-tuning, see APT_TunePID in libapt.h.
+//
+// A step response is measured by keeping the device open, sending a
+// relative move and then asking for the position counter as fast as the
+// replies come back (about once per USB latency timer tick, see
+// poll_position in inpos.c), until the stage has stayed within the settle
+// band for a while. From the samples:
+//
+//  - rise time, from 10% to 90% of the step,
+//  - overshoot, past the target, as a fraction of the step,
+//  - settle time, from the move command to the last sample outside the
+//    settle band.
+//
+// Every trial steps forward and back again, so the stage ends up where it
+// started, and is scored on the worse of the two. The tuning is a pattern
+// search on the proportional and derivative gains in log space: each is
+// multiplied and divided by a factor, the best of those that keep the
+// overshoot under the limit is kept, and the factor shrinks when nothing
+// improves. The integral gain and limit are left as they are.
+
+#include "libapt_private.h"
+
+#include <math.h>
+
+//MGMSG_MOT_MOVE_STOP
+#define MSG_STOP            0x0465
+
+// how long the stage has to stay in the band to count as settled (s)
+#define TUNE_HOLD           0.05
+
+// the cost of a trial that never settled, or went past the overshoot limit
+#define COST_UNSETTLED      1e6
+#define COST_OVERSHOOT      1e3
+
+#define GAIN_MAX            32767
+
+typedef struct {
+    double t;
+    double pos;
+} SAMPLE;
+
+static const APT_TUNE_OPTIONS defaults = {20000, 0.05f, 20, 2.0, 24};
+
+// Rise time, overshoot and settle time of a step from dFrom to dTo.
+static void step_metrics(const SAMPLE *s, long n, double dFrom, double dTo, double dBand,
+        double *pdRise, double *pdOvershoot, double *pdSettle) {
+    double step = dTo - dFrom, dir = step >= 0 ? 1 : -1, t10 = -1, t90 = -1, over = 0, f;
+    long k;
+
+    *pdSettle = -1;
+    for (k = 0; k < n; k++) {
+        f = (s[k].pos - dFrom) / step;
+        if (t10 < 0 && f >= 0.1) t10 = s[k].t;
+        if (t90 < 0 && f >= 0.9) t90 = s[k].t;
+        if ((s[k].pos - dTo) * dir > over) over = (s[k].pos - dTo) * dir;
+    }
+    for (k = n - 1; k >= 0; k--) {
+        if (fabs(s[k].pos - dTo) > dBand) {
+            if (k < n - 1) *pdSettle = s[k + 1].t;
+            break;
+        }
+    }
+    if (k < 0 && n > 0) *pdSettle = s[0].t;
+
+    *pdRise = t10 >= 0 && t90 >= 0 ? t90 - t10 : -1;
+    *pdOvershoot = step != 0 ? over / fabs(step) : 0;
+}
+
+// One step of fStep counts with whatever gains are set.
+static long measure_step(long i, float fStep, const APT_TUNE_OPTIONS *o,
+        double *pdRise, double *pdOvershoot, double *pdSettle) {
+    SAMPLE *s = NULL;
+    long n = 0, max, ret, completed = 0;
+    double t0, t, from, to, pos, inBand = -1;
+    int16_t val16;
+    int32_t val32;
+    char txbuf[12];
+
+    *pdRise = *pdOvershoot = *pdSettle = -1;
+
+    // a sample every half millisecond at the very most
+    max = (long)(o->dMaxStepTime * 2000) + 16;
+    if ((s = malloc(max * sizeof(SAMPLE))) == NULL) return ENOMEM;
+
+    if ((ret = ftdi_open_apt_index(i)) < 0) goto end;
+    if ((ret = poll_position(i, &from, &completed)) != 0) goto end;
+    to = from + fStep;
+
+    //MGMSG_MOT_MOVE_RELATIVE
+    txbuf[0] = 0x48;
+    txbuf[1] = 0x04;
+    txbuf[2] = 0x06;
+    txbuf[3] = 0x00;
+    txbuf[4] = aptInfo[i].DestinationByte | 0x80;
+    txbuf[5] = 0x01;
+
+    //copy Chan Ident
+    val16 = (int16_t)caps_ident(i);
+    memcpy(txbuf+6,(char *)(&val16),2);
+    val32 = (int32_t)fStep;
+    memcpy(txbuf+8,(char *)(&val32),4);
+    if (DEBUG) hexDump("measure_step txbuf",txbuf,12);
+
+    completed = 0;
+    t0 = apt_time();
+    if ((ret = ftdi_write_data(ftdic, txbuf, 12)) < 0) goto end;
+
+    while (n < max) {
+        if ((ret = poll_position(i, &pos, &completed)) != 0) break;
+        t = apt_time() - t0;
+        s[n].t = t;
+        s[n].pos = pos;
+        n++;
+
+        // done once it has held still in the band for a while
+        if (fabs(pos - to) <= o->fSettleBand) {
+            if (inBand < 0) inBand = t;
+            if (completed && t - inBand >= TUNE_HOLD) break;
+        } else
+            inBand = -1;
+        if (t > o->dMaxStepTime) break;
+
+        // running away: stop it before it hits something
+        if (fabs(pos - from) > 3 * fabs(fStep) + o->fSettleBand) {
+            write_short(MSG_STOP, i, 0x02);
+            break;
+        }
+    }
+    if (ret == 0 || ret == ETIMEDOUT) ret = 0;
+    step_metrics(s, n, from, to, o->fSettleBand, pdRise, pdOvershoot, pdSettle);
+    if (inBand < 0 || !completed) *pdSettle = -1;
+
+end:
+    if (ret < 0) fprintf(stderr, "Error: %ld (%s)\n", ret, ftdi_get_error_string(ftdic));
+    ftdi_usb_close(ftdic);
+    aptInfo[i].PositionValid = 0;
+    free(s);
+    return ret;
+}
+
+static long get_gains(long lSerialNum, long i, long *g) {
+    long l[6];
+
+    if (caps_has(i, APT_CAP_DCPID))
+        return MOT_GetPIDParams(lSerialNum, &g[0], &g[1], &g[2], &g[3]);
+    if (!caps_has(i, APT_CAP_POSITIONLOOP)) return ENOTSUP;
+    return MOT_GetDCPositionLoopParams(lSerialNum, &g[0], &g[1], &g[3], &g[2], &l[0], &l[1], &l[2], &l[3], &l[4]);
+}
+
+// g is prop, int, deriv, int limit; the rest of the position loop block
+// stays as the controller has it.
+static long set_gains(long lSerialNum, long i, const long *g) {
+    long p[4], l[5], ret;
+
+    if (caps_has(i, APT_CAP_DCPID))
+        return MOT_SetPIDParams(lSerialNum, g[0], g[1], g[2], g[3]);
+    if ((ret = MOT_GetDCPositionLoopParams(lSerialNum, &p[0], &p[1], &p[3], &p[2], &l[0], &l[1], &l[2], &l[3], &l[4])) != 0)
+        return ret;
+    return MOT_SetDCPositionLoopParams(lSerialNum, g[0], g[1], g[3], g[2], l[0], l[1], l[2], l[3], l[4]);
+}
+
+// A trial: set the gains, step there and back. Fills in the trial's
+// figures (the worse of the two steps) and returns its cost in *pdCost.
+static long trial(long lSerialNum, long i, const long *g, const APT_TUNE_OPTIONS *o,
+        APT_TUNE_TRIAL *t, double *pdCost) {
+    double rise[2], over[2], settle[2];
+    long ret, k;
+
+    *pdCost = COST_UNSETTLED;
+    t->lProp = g[0];
+    t->lInt = g[1];
+    t->lDeriv = g[2];
+    t->dRiseTime = t->dOvershoot = t->dSettleTime = -1;
+
+    if ((ret = set_gains(lSerialNum, i, g)) != 0) return ret;
+    for (k = 0; k < 2; k++)
+        if ((ret = measure_step(i, k ? -o->fStep : o->fStep, o, &rise[k], &over[k], &settle[k])) != 0) return ret;
+
+    t->dRiseTime = fmax(rise[0], rise[1]);
+    t->dOvershoot = fmax(over[0], over[1]);
+    t->dSettleTime = settle[0] < 0 || settle[1] < 0 ? -1 : fmax(settle[0], settle[1]);
+
+    if (DEBUG) printf("APT_TunePID: Prop %ld Int %ld Deriv %ld: rise %.1f ms, overshoot %.1f%%, settle %.1f ms\n",
+            g[0], g[1], g[2], t->dRiseTime * 1e3, t->dOvershoot * 100, t->dSettleTime * 1e3);
+
+    if (t->dSettleTime < 0) return 0;
+    *pdCost = t->dOvershoot > o->fMaxOvershoot ? COST_OVERSHOOT + t->dOvershoot : t->dSettleTime;
+    return deadline_check();
+}
+
+
+long WINAPI APT_MeasureStep(long lSerialNum, float fStep, const APT_TUNE_OPTIONS *pOptions,
+        double *pdRiseTime, double *pdOvershoot, double *pdSettleTime) {
+    long i;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if (pOptions == NULL) pOptions = &defaults;
+    return measure_step(i, fStep, pOptions, pdRiseTime, pdOvershoot, pdSettleTime);
+}
+
+long WINAPI APT_TunePID(long lSerialNum, const APT_TUNE_OPTIONS *pOptions, APT_TUNE_RESULT *pResult) {
+    long i, ret, k, d, start[4], best[4], g[4];
+    double cost, bestCost, factor = 2.0;
+    APT_TUNE_TRIAL t, bestTrial;
+    DEADLINE saved;
+    int improved;
+
+    if (GetIndex(lSerialNum, &i) < 0) return ENODEV;
+    if (pOptions == NULL) pOptions = &defaults;
+    if (pOptions->fStep == 0 || pOptions->fSettleBand <= 0 || pOptions->lMaxTrials < 1) return EINVAL;
+    memset(pResult, 0, sizeof(APT_TUNE_RESULT));
+
+    if ((ret = get_gains(lSerialNum, i, start)) != 0) return ret;
+    memcpy(best, start, sizeof(best));
+
+    // where we start from
+    if ((ret = trial(lSerialNum, i, best, pOptions, &bestTrial, &bestCost)) != 0) goto end;
+    pResult->Start = bestTrial;
+    pResult->lNumTrials = 1;
+    if (pResult->lNumTrials <= APT_TUNE_MAX_TRIALS) pResult->Trials[0] = bestTrial;
+
+    while (factor > 1.05 && pResult->lNumTrials < pOptions->lMaxTrials) {
+        improved = 0;
+
+        // prop (0) and deriv (2), up and down
+        for (k = 0; k <= 2 && pResult->lNumTrials < pOptions->lMaxTrials; k += 2) {
+            for (d = 0; d < 2 && pResult->lNumTrials < pOptions->lMaxTrials; d++) {
+                memcpy(g, best, sizeof(g));
+                g[k] = (long)(d ? g[k] / factor : g[k] * factor + 0.5);
+                if (g[k] < 1) g[k] = 1;
+                if (g[k] > GAIN_MAX) g[k] = GAIN_MAX;
+                if (g[k] == best[k]) continue;
+
+                ret = trial(lSerialNum, i, g, pOptions, &t, &cost);
+                if (pResult->lNumTrials < APT_TUNE_MAX_TRIALS) pResult->Trials[pResult->lNumTrials] = t;
+                pResult->lNumTrials++;
+                if (ret != 0) goto end;
+
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestTrial = t;
+                    memcpy(best, g, sizeof(best));
+                    improved = 1;
+                    break;
+                }
+            }
+        }
+        if (!improved) factor = sqrt(factor);
+    }
+
+end:
+    // the best gains if they are any good, the ones we started with if not
+    if (bestCost >= COST_OVERSHOOT) memcpy(best, start, sizeof(best));
+    pResult->lProp = best[0];
+    pResult->lInt = best[1];
+    pResult->lDeriv = best[2];
+    pResult->lIntLimit = best[3];
+    pResult->Best = bestCost >= COST_OVERSHOOT ? pResult->Start : bestTrial;
+
+    // leave the controller with those, even when out of time
+    deadline_push(0, NULL, &saved);
+    APT_SetDeadline(0, NULL);
+    set_gains(lSerialNum, i, best);
+    deadline_pop(&saved, 0);
+
+    if (ret == 0 && bestCost >= COST_OVERSHOOT) ret = ERANGE;
+    return ret;
+}